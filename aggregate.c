@@ -0,0 +1,361 @@
+/**
+ * @file aggregate.c
+ *
+ * @remark Copyright (C) 2006-2015 RotateRight, LLC
+ * @remark Read the file COPYING
+ *
+ * In-kernel aggregation of task exits. Instead of a record per exit,
+ * exits are folded into per-key summaries (tgid, comm or cgroup) that
+ * are written to the event buffer at aggregate_interval, when the reader
+ * reads and when the session stops.
+ */
+
+#include <linux/sched.h>
+#include <linux/vmalloc.h>
+#include <linux/workqueue.h>
+#include <linux/spinlock.h>
+#include <linux/jhash.h>
+#include <linux/jiffies.h>
+#include <linux/version.h>
+#include <linux/cgroup.h>
+#include <linux/string.h>
+#include <linux/time.h>
+
+#include "rrnotify.h"
+#include "rrnotify_stats.h"
+#include "logging.h"
+#include "event_buffer.h"
+#include "aggregate.h"
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,37)
+static DEFINE_SEMAPHORE(flush_sem);
+#else
+static DECLARE_MUTEX(flush_sem);
+#endif
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4,6,0) && defined(CONFIG_CGROUPS)
+#define RR_HAVE_CGROUP_KEY
+#endif
+
+#define AGGREGATE_TABLE_SIZE	1024
+/* flush early rather than let probe chains grow long */
+#define AGGREGATE_TABLE_LIMIT	(AGGREGATE_TABLE_SIZE * 3 / 4)
+
+struct aggregate_entry {
+	unsigned long key[RR_AGGREGATE_KEY_WORDS];
+	unsigned long count;
+	u64 utime;
+	u64 stime;
+	u64 lifetime;
+};
+
+struct aggregate_table {
+	struct aggregate_entry * entries;
+	unsigned int used;
+	struct timespec window_start;
+};
+
+/* Exits go into the active table; a flush swaps the tables under
+ * aggregate_lock and then writes out the retired one to the local part
+ * of the event buffer.
+ */
+static struct aggregate_table tables[2];
+static struct aggregate_table * active_table;
+static DEFINE_SPINLOCK(aggregate_lock);
+
+/* snapshot of fs_aggregate_mode; fs_aggregate_interval is read again
+ * at every flush, and 0 stops the timer */
+static unsigned long aggregate_mode;
+
+static void aggregate_work_fn(struct work_struct * work);
+static DECLARE_DELAYED_WORK(aggregate_work, aggregate_work_fn);
+
+
+static int table_alloc(struct aggregate_table * table)
+{
+	size_t size = sizeof(struct aggregate_entry) * AGGREGATE_TABLE_SIZE;
+
+	table->entries = vmalloc(size);
+	if (!table->entries)
+		return -ENOMEM;
+	memset(table->entries, 0, size);
+	table->used = 0;
+	rrnotify_get_time(&table->window_start);
+	return 0;
+}
+
+
+static void table_free(struct aggregate_table * table)
+{
+	vfree(table->entries);
+	table->entries = NULL;
+}
+
+
+static int key_is_free(unsigned long const * key)
+{
+	int i;
+
+	for (i = 0; i < RR_AGGREGATE_KEY_WORDS; i++) {
+		if (key[i])
+			return 0;
+	}
+	return 1;
+}
+
+
+static int get_task_key(struct task_struct * task, unsigned long * key)
+{
+	char comm[TASK_COMM_LEN];
+
+	memset(key, 0, sizeof(unsigned long) * RR_AGGREGATE_KEY_WORDS);
+
+	switch (aggregate_mode) {
+	case RRNOTIFY_AGGREGATE_TGID:
+		key[0] = task->tgid;
+		break;
+	case RRNOTIFY_AGGREGATE_COMM:
+		// get_task_comm() insists on an array of TASK_COMM_LEN from 4.18 on
+		get_task_comm(comm, task);
+		memcpy(key, comm, min(sizeof(comm), sizeof(unsigned long) * RR_AGGREGATE_KEY_WORDS));
+		break;
+#ifdef RR_HAVE_CGROUP_KEY
+	case RRNOTIFY_AGGREGATE_CGROUP:
+		rcu_read_lock();
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5,5,0)
+		*(u64 *)key = cgroup_id(task_dfl_cgroup(task));
+#else
+		*(u64 *)key = cgroup_ino(task_dfl_cgroup(task));
+#endif
+		rcu_read_unlock();
+		break;
+#endif
+	}
+
+	// an all-zero key marks a free slot
+	return !key_is_free(key);
+}
+
+
+static u64 get_task_lifetime(struct task_struct * task)
+{
+	struct timespec now;
+	u64 start;
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(3,17,0)
+	start = task->start_time;
+#else
+	start = timespec_to_ns(&task->start_time);
+#endif
+	rrnotify_get_time(&now);
+
+	return timespec_to_ns(&now) - start;
+}
+
+
+/* Find or claim the slot for key; NULL when the table is full. */
+static struct aggregate_entry * table_lookup(struct aggregate_table * table,
+	unsigned long const * key)
+{
+	u32 hash = jhash2((u32 const *)key,
+		sizeof(unsigned long) * RR_AGGREGATE_KEY_WORDS / sizeof(u32), 0);
+	unsigned int i;
+
+	for (i = 0; i < AGGREGATE_TABLE_SIZE; i++) {
+		struct aggregate_entry * entry =
+			&table->entries[(hash + i) % AGGREGATE_TABLE_SIZE];
+
+		if (!memcmp(entry->key, key, sizeof(entry->key)))
+			return entry;
+
+		if (key_is_free(entry->key)) {
+			if (table->used >= AGGREGATE_TABLE_LIMIT)
+				return NULL;
+			memcpy(entry->key, key, sizeof(entry->key));
+			table->used++;
+			return entry;
+		}
+	}
+	return NULL;
+}
+
+
+int aggregate_task(struct task_struct * task)
+{
+	unsigned long key[RR_AGGREGATE_KEY_WORDS];
+	struct aggregate_entry * entry;
+	u64 utime, stime, lifetime;
+
+	if (aggregate_mode == RRNOTIFY_AGGREGATE_OFF)
+		return 0;
+
+	if (!get_task_key(task, key))
+		return 0;
+
+	utime = jiffies_to_usecs(task->utime);
+	stime = jiffies_to_usecs(task->stime);
+	lifetime = get_task_lifetime(task);
+	do_div(lifetime, NSEC_PER_USEC);
+
+	for (;;) {
+		spin_lock(&aggregate_lock);
+		entry = table_lookup(active_table, key);
+		if (entry) {
+			entry->count++;
+			entry->utime += utime;
+			entry->stime += stime;
+			entry->lifetime += lifetime;
+		}
+		spin_unlock(&aggregate_lock);
+
+		if (entry)
+			break;
+
+		// table full - make room
+		aggregate_flush();
+	}
+
+	atomic_inc(&rrnotify_stats.event_aggregated);
+	return 1;
+}
+
+
+static void add_aggregate_records(struct node_buffer * nb, struct aggregate_table * table,
+	struct timespec * window_end)
+{
+	int i;
+
+	for (i = 0; i < AGGREGATE_TABLE_SIZE; i++) {
+		struct aggregate_entry * entry = &table->entries[i];
+		int j;
+
+		if (key_is_free(entry->key))
+			continue;
+
+		event_buffer_begin_record(nb, RRNOTIFY_AGGREGATE_BEGIN);
+		add_event_entry(nb, aggregate_mode);
+		for (j = 0; j < RR_AGGREGATE_KEY_WORDS; j++) {
+			add_event_entry(nb, entry->key[j]);
+		}
+		add_event_entry(nb, table->window_start.tv_sec);
+		add_event_entry(nb, table->window_start.tv_nsec);
+		add_event_entry(nb, window_end->tv_sec);
+		add_event_entry(nb, window_end->tv_nsec);
+		add_event_entry(nb, entry->count);
+		add_event_u64(nb, entry->utime);
+		add_event_u64(nb, entry->stime);
+		add_event_u64(nb, entry->lifetime);
+		event_buffer_end_record(nb, RRNOTIFY_AGGREGATE_END);
+	}
+}
+
+
+void aggregate_flush(void)
+{
+	struct aggregate_table * table;
+	struct timespec now;
+
+	if (aggregate_mode == RRNOTIFY_AGGREGATE_OFF)
+		return;
+
+	down(&flush_sem);
+
+	rrnotify_get_time(&now);
+
+	spin_lock(&aggregate_lock);
+	table = active_table;
+	active_table = (table == &tables[0]) ? &tables[1] : &tables[0];
+	active_table->window_start = now;
+	spin_unlock(&aggregate_lock);
+
+	if (table->used) {
+		struct node_buffer * nb = event_buffer_lock_local();
+
+		add_aggregate_records(nb, table, &now);
+		event_buffer_unlock(nb);
+
+		memset(table->entries, 0, sizeof(struct aggregate_entry) * AGGREGATE_TABLE_SIZE);
+		table->used = 0;
+	}
+
+	up(&flush_sem);
+}
+
+
+static void aggregate_work_fn(struct work_struct * work)
+{
+	unsigned long interval;
+
+	aggregate_flush();
+
+	/* summaries are small and rarely reach the watershed */
+	wake_up_buffer_reader();
+
+	interval = READ_ONCE(fs_aggregate_interval);
+	if (interval)
+		schedule_delayed_work(&aggregate_work, msecs_to_jiffies(interval));
+}
+
+
+int aggregate_start(void)
+{
+	int err;
+
+	spin_lock(&rrnotifyfs_lock);
+	aggregate_mode = fs_aggregate_mode;
+	spin_unlock(&rrnotifyfs_lock);
+
+	if (aggregate_mode > RRNOTIFY_AGGREGATE_CGROUP)
+		return -EINVAL;
+
+#ifndef RR_HAVE_CGROUP_KEY
+	if (aggregate_mode == RRNOTIFY_AGGREGATE_CGROUP) {
+		LOG_WARNING("cgroup aggregation is not supported by this kernel, using tgid");
+		aggregate_mode = RRNOTIFY_AGGREGATE_TGID;
+	}
+#endif
+
+	if (aggregate_mode == RRNOTIFY_AGGREGATE_OFF)
+		return 0;
+
+	if ((err = table_alloc(&tables[0])))
+		goto fail;
+	if ((err = table_alloc(&tables[1])))
+		goto fail;
+	active_table = &tables[0];
+
+	aggregate_interval_changed();
+	return 0;
+
+fail:
+	table_free(&tables[0]);
+	table_free(&tables[1]);
+	aggregate_mode = RRNOTIFY_AGGREGATE_OFF;
+	return err;
+}
+
+
+void aggregate_stop(void)
+{
+	if (aggregate_mode == RRNOTIFY_AGGREGATE_OFF)
+		return;
+
+	cancel_delayed_work_sync(&aggregate_work);
+	aggregate_flush();
+
+	aggregate_mode = RRNOTIFY_AGGREGATE_OFF;
+	table_free(&tables[0]);
+	table_free(&tables[1]);
+}
+
+
+/* Under start_sem, so aggregation can't stop meanwhile. A pending
+ * flush is left as it is.
+ */
+void aggregate_interval_changed(void)
+{
+	unsigned long interval = READ_ONCE(fs_aggregate_interval);
+
+	if (aggregate_mode != RRNOTIFY_AGGREGATE_OFF && interval)
+		schedule_delayed_work(&aggregate_work, msecs_to_jiffies(interval));
+}
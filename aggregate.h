@@ -0,0 +1,40 @@
+/**
+ * @file aggregate.h
+ *
+ * @remark Copyright (C) 2006-2015 RotateRight, LLC
+ * @remark Read the file COPYING
+ */
+
+#ifndef RRNOTIFY_AGGREGATE_H_
+#define RRNOTIFY_AGGREGATE_H_
+
+#include <linux/sched.h>
+
+/* fs_aggregate_mode values */
+#define RRNOTIFY_AGGREGATE_OFF		0
+#define RRNOTIFY_AGGREGATE_TGID		1
+#define RRNOTIFY_AGGREGATE_COMM		2
+#define RRNOTIFY_AGGREGATE_CGROUP	3
+
+/* summary keys are written as this many entries: the comm, or the
+ * tgid or cgroup id zero padded
+ */
+#define RR_AGGREGATE_KEY_WORDS	(TASK_COMM_LEN / sizeof(unsigned long))
+
+/* set up the summary tables and the flush timer */
+int aggregate_start(void);
+
+/* start the flush timer if aggregate_interval was set from 0; a change
+ * of a running interval is picked up at the next flush */
+void aggregate_interval_changed(void);
+
+/* flush what is left and free the tables */
+void aggregate_stop(void);
+
+/* fold an exiting task into its summary; returns 0 if aggregation is off */
+int aggregate_task(struct task_struct * task);
+
+/* write the current summaries to the event buffer */
+void aggregate_flush(void);
+
+#endif /* RRNOTIFY_AGGREGATE_H_ */
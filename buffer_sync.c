@@ -14,14 +14,70 @@
 #include <linux/profile.h>
 #include <linux/module.h>
 #include <linux/fs.h>
+#include <linux/file.h>
 #include <linux/jiffies.h>
 #include <linux/sched.h>
+#include <linux/slab.h>
+#include <linux/list.h>
 #include <linux/version.h>
+#include <linux/tracepoint.h>
+#include <linux/kprobes.h>
+#include <linux/rcupdate.h>
+#include <linux/pid.h>
+#include <linux/vmalloc.h>
+#include <asm/uaccess.h>
  
 #include "rrnotify.h" 
 #include "rrnotify_stats.h"
+#include "logging.h"
 #include "event_buffer.h"
 #include "buffer_sync.h"
+#include "aggregate.h"
+#include "exit_filter.h"
+#include "build_id.h"
+#include "string_table.h"
+#include "config.h"
+#include "cpu_tick.h"
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(3,7,0)
+// fixup removal of VM_EXECUTABLE flag in linux 3.7.0 and later
+// https://lkml.org/lkml/2012/3/31/42
+#define VM_EXECUTABLE   0x00001000
+#endif // >= 3.7.0
+
+/* exec and fork are reported from the sched tracepoints; sched_process_exec
+ * first appeared in 3.4.
+ */
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(3,4,0) && defined(CONFIG_TRACEPOINTS)
+#define RR_HAVE_TASK_TRACEPOINTS
+#endif
+
+/* executable mmaps are caught with a jprobe on perf_event_mmap(), which
+ * mmap_region() calls for every new mapping.
+ */
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,32) && LINUX_VERSION_CODE < KERNEL_VERSION(4,15,0) \
+	&& defined(CONFIG_KPROBES) && defined(CONFIG_PERF_EVENTS)
+#define RR_HAVE_MMAP_PROBE
+#endif
+
+/* command lines are read with access_process_vm(), not exported before */
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,32)
+#define RR_HAVE_ARGV
+#endif
+
+/* snapshot of fs_event_mask taken in sync_start() */
+static unsigned long event_mask;
+
+/* Stream settings from rrnotify_config, taken over in sync_start() and
+ * sync_config_changed() with every part of the event buffer locked, so
+ * a writer holding its part sees them stable. Queries run without any,
+ * so each is read once where its value shapes the layout.
+ */
+static unsigned long record_fields;
+static unsigned long module_options;
+static unsigned long module_limit;
+static unsigned long argv_max;
+static unsigned long sample_period;
 
 /* The task is on its way out. A sync of the buffer means we can catch
  * any remaining samples for this task.
@@ -29,6 +85,9 @@
 static int task_exit_notify(struct notifier_block * self, unsigned long val, void * data)
 {
 	struct task_struct * task = data;
+
+	if (exit_filter_task(task))
+		return 0;
 	
 	sync_buffer(task);
   	
@@ -39,19 +98,6 @@ static struct notifier_block task_exit_nb = {
 	.notifier_call	= task_exit_notify,
 };
 
-int sync_start(void)
-{
-	int err;
-
-	err = profile_event_register(PROFILE_TASK_EXIT, &task_exit_nb);
-	return err;
-}
-
-void sync_stop(void)
-{
-	profile_event_unregister(PROFILE_TASK_EXIT, &task_exit_nb);
-}
-
 /* Optimisation. We can manage without taking the dcookie sem
  * because we cannot reach this code without at least one
  * dcookie user still being registered (namely, the reader
@@ -59,7 +105,7 @@ void sync_stop(void)
 #if LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,25)
 static inline unsigned long fast_get_dcookie(struct path * path)
 {
-	unsigned long cookie;
+	unsigned long cookie = RR_INVALID_COOKIE;
 
 #if LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,29)
 	if (path->dentry->d_flags & DCACHE_COOKIE)
@@ -67,18 +113,20 @@ static inline unsigned long fast_get_dcookie(struct path * path)
 	if (path->dentry->d_cookie)
 #endif
 		return (unsigned long)path->dentry;
-	get_dcookie(path, &cookie);
+	if (get_dcookie(path, &cookie))
+		return RR_INVALID_COOKIE;
 	return cookie;
 }
 #else
 static inline unsigned long fast_get_dcookie(struct dentry * dentry,
 	struct vfsmount * vfsmnt)
 {
-	unsigned long cookie;
+	unsigned long cookie = RR_INVALID_COOKIE;
  
 	if (dentry->d_cookie)
 		return (unsigned long)dentry;
-	get_dcookie(dentry, vfsmnt, &cookie);
+	if (get_dcookie(dentry, vfsmnt, &cookie))
+		return RR_INVALID_COOKIE;
 	return cookie;
 }
 #endif
@@ -100,135 +148,1562 @@ static struct mm_struct * take_tasks_mm(struct task_struct * task)
 	return mm;
 }
 
-static void add_escape_code(int code)
+static void add_escape_code(struct node_buffer * nb, int code)
+{
+	add_event_entry(nb, RR_ESCAPE_CODE);
+	add_event_entry(nb, code);
+}
+
+/* The thread and module encoders write either to a locked part of the
+ * event buffer or to the output of a query. A query sink counts what
+ * did not fit so the caller can tell it was truncated.
+ */
+struct entry_sink {
+	/* the part of the event buffer, NULL for a query */
+	struct node_buffer * part;
+	unsigned long * buf;
+	size_t size;
+	size_t pos;
+	/* id of the next string defined in place, 0 to leave strings out */
+	unsigned long next_string;
+};
+
+/* a sink for the records written to a locked part */
+static inline void record_sink(struct entry_sink * sink, struct node_buffer * nb)
+{
+	memset(sink, 0, sizeof(*sink));
+	sink->part = nb;
+}
+
+static inline void sink_entry(struct entry_sink * sink, unsigned long value)
+{
+	if (sink->part) {
+		add_event_entry(sink->part, value);
+		return;
+	}
+	if (sink->pos < sink->size)
+		sink->buf[sink->pos] = value;
+	sink->pos++;
+}
+
+static inline void sink_u64(struct entry_sink * sink, u64 value)
+{
+	sink_entry(sink, (unsigned long)value);
+#if BITS_PER_LONG == 32
+	sink_entry(sink, (unsigned long)(value >> 32));
+#endif
+}
+
+static inline void sink_escape(struct entry_sink * sink, int code)
+{
+	sink_entry(sink, RR_ESCAPE_CODE);
+	sink_entry(sink, code);
+}
+
+static unsigned long get_task_max_rss(struct task_struct * task)
+{
+	unsigned long max_rss = 0;
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,34)
+	struct mm_struct * mm = get_task_mm(task);
+
+	if (mm) {
+		max_rss = get_mm_hiwater_rss(mm);
+		mmput(mm);
+	}
+	if (task->signal && task->signal->maxrss > max_rss)
+		max_rss = task->signal->maxrss;
+#endif // >= 2.6.34
+	// pages to kB, as in getrusage()
+	return max_rss * (PAGE_SIZE / 1024);
+}
+
+/* The command line with its arguments separated by spaces, cut at size
+ * bytes. Returns its length, 0 for kernel threads.
+ */
+static size_t get_task_argv(struct task_struct * task, char * buf, size_t size)
+{
+#ifdef RR_HAVE_ARGV
+	struct mm_struct * mm;
+	unsigned long start, end;
+	int len = 0;
+	int i;
+
+	mm = get_task_mm(task);
+	if (!mm)
+		return 0;
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4,18,0)
+	spin_lock(&mm->arg_lock);
+#endif
+	start = mm->arg_start;
+	end = mm->arg_end;
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4,18,0)
+	spin_unlock(&mm->arg_lock);
+#endif
+
+	if (end > start && size)
+		len = access_process_vm(task, start, buf, min_t(unsigned long, end - start, size), 0);
+	mmput(mm);
+	if (len <= 0)
+		return 0;
+
+	while (len && !buf[len - 1])
+		len--;
+	for (i = 0; i < len; i++) {
+		if (!buf[i])
+			buf[i] = ' ';
+	}
+	return len;
+#else
+	return 0;
+#endif // RR_HAVE_ARGV
+}
+
+/* bytes packed into entries, the last one zero padded */
+static void sink_bytes(struct entry_sink * sink, char const * bytes, size_t len)
+{
+	unsigned long word;
+	size_t i;
+
+	for (i = 0; i < len; i += sizeof(word)) {
+		word = 0;
+		memcpy(&word, bytes + i, min(len - i, sizeof(word)));
+		sink_entry(sink, word);
+	}
+}
+
+/* STRING block: id, length in bytes, then the bytes packed into entries */
+static void add_string_def(struct entry_sink * sink, unsigned long id,
+	char const * str, size_t len)
+{
+	sink_escape(sink, RRNOTIFY_STRING_BEGIN);
+	sink_entry(sink, id);
+	sink_entry(sink, len);
+	sink_bytes(sink, str, len);
+	sink_escape(sink, RRNOTIFY_STRING_END);
+}
+
+/* Id of a string for the thread info, defining it first if this is the
+ * first record to use it. Query results have no stream before them,
+ * so they define each of their strings.
+ */
+static unsigned long add_string(struct entry_sink * sink, char const * str, size_t len)
+{
+	unsigned long id;
+	int is_new;
+
+	if (!len)
+		return 0;
+	if (len > STRING_MAX_LEN)
+		len = STRING_MAX_LEN;
+
+	if (!sink->part) {
+		if (!sink->next_string)
+			return 0;
+		id = sink->next_string++;
+		add_string_def(sink, id, str, len);
+		return id;
+	}
+
+	id = string_table_intern(event_buffer_index(sink->part), str, len, &is_new);
+	if (is_new)
+		add_string_def(sink, id, str, len);
+	return id;
+}
+
+/* A task's command line, read before the event buffer is locked as
+ * reading it may fault pages in.
+ */
+struct task_argv {
+	char * buf;
+	size_t len;
+};
+
+static void read_task_argv(struct task_struct * task, struct task_argv * argv)
+{
+	unsigned long max = READ_ONCE(argv_max);
+
+	argv->buf = NULL;
+	argv->len = 0;
+	if (!(READ_ONCE(record_fields) & RRNOTIFY_FIELD_ARGV) || !max)
+		return;
+	argv->buf = kmalloc(max, GFP_KERNEL);
+	if (argv->buf)
+		argv->len = get_task_argv(task, argv->buf, max);
+}
+
+static void free_task_argv(struct task_argv * argv)
 {
-	add_event_entry(RR_ESCAPE_CODE);
-	add_event_entry(code);
+	kfree(argv->buf);
 }
 
-static void add_task_thread_info(struct task_struct * task)
+/* Query results read the command line here, without a lock. A
+ * record that selected RRNOTIFY_FIELD_ARGV after argv was read gets no
+ * command line.
+ */
+static unsigned long add_task_argv(struct entry_sink * sink, struct task_struct * task,
+	struct task_argv const * argv)
+{
+	struct task_argv own;
+	unsigned long id;
+
+	if (argv)
+		return add_string(sink, argv->buf, argv->len);
+
+	if (!sink->next_string)
+		return 0;
+	read_task_argv(task, &own);
+	id = add_string(sink, own.buf, own.len);
+	free_task_argv(&own);
+	return id;
+}
+
+/* Thread info fields are written in RRNOTIFY_FIELD_* bit order and only
+ * when selected in record_fields, which is written first as record_fields
+ * may change mid-stream. The definitions of new strings come before.
+ * argv is the command line read by read_task_argv() for a stream
+ * record, NULL for a query.
+ */
+static void add_task_thread_info(struct entry_sink * sink, struct task_struct * task,
+	struct task_argv const * argv)
 {
+	unsigned long fields = READ_ONCE(record_fields);
 	unsigned long utime, stime;
 	struct timespec end_time;
+	unsigned long comm_id = 0, argv_id = 0;
+	char comm[TASK_COMM_LEN];
+
+	if (fields & RRNOTIFY_FIELD_COMM) {
+		get_task_comm(comm, task);
+		comm_id = add_string(sink, comm, strnlen(comm, sizeof(comm)));
+	}
+	if (fields & RRNOTIFY_FIELD_ARGV)
+		argv_id = add_task_argv(sink, task, argv);
 
-	add_escape_code(RRNOTIFY_THREAD_INFO_BEGIN);
+	sink_escape(sink, RRNOTIFY_THREAD_INFO_BEGIN);
+	sink_entry(sink, fields);
 
 	// Write the task group id and the thread id
-	add_event_entry(task->tgid);
-	add_event_entry(task->pid);
+	if (fields & RRNOTIFY_FIELD_IDS) {
+		sink_entry(sink, task->tgid);
+		sink_entry(sink, task->pid);
+	}
 
 	// Write out the user time and the system time
-	utime = jiffies_to_usecs(task->utime);
-	stime = jiffies_to_usecs(task->stime);
-	add_event_entry(utime);
-	add_event_entry(stime); 
+	if (fields & RRNOTIFY_FIELD_CPU_TIME) {
+		utime = jiffies_to_usecs(task->utime);
+		stime = jiffies_to_usecs(task->stime);
+		sink_entry(sink, utime);
+		sink_entry(sink, stime); 
+	}
 	
 	// Write out the start time 
+	if (fields & RRNOTIFY_FIELD_START_TIME) {
 #if LINUX_VERSION_CODE >= KERNEL_VERSION(3,17,0)
-	add_event_entry(task->real_start_time/1000000000);
-	add_event_entry(task->real_start_time);
+		sink_entry(sink, task->real_start_time/1000000000);
+		sink_entry(sink, task->real_start_time);
 #elif LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,23)
-	add_event_entry(task->real_start_time.tv_sec);
-	add_event_entry(task->real_start_time.tv_nsec);
+		sink_entry(sink, task->real_start_time.tv_sec);
+		sink_entry(sink, task->real_start_time.tv_nsec);
 #else
-	add_event_entry(task->start_time.tv_sec);
-	add_event_entry(task->start_time.tv_nsec);
+		sink_entry(sink, task->start_time.tv_sec);
+		sink_entry(sink, task->start_time.tv_nsec);
 #endif
+	}
 	
 	// Write out the end time
-#if LINUX_VERSION_CODE >= KERNEL_VERSION(4,2,0)
-	ktime_get_ts(&end_time);
-#elif LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,16)
-	do_posix_clock_monotonic_gettime(&end_time);
+	if (fields & RRNOTIFY_FIELD_END_TIME) {
+		rrnotify_get_time(&end_time);
+		sink_entry(sink, end_time.tv_sec);
+		sink_entry(sink, end_time.tv_nsec);
+	}
+
+	// Write out the precise run time in ns
+	if (fields & RRNOTIFY_FIELD_RUNTIME) {
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,23)
+		sink_u64(sink, task->se.sum_exec_runtime);
 #else
-	end_time = current_kernel_time();
+		sink_u64(sink, (u64)jiffies_to_usecs(task->utime + task->stime) * 1000);
 #endif
-	add_event_entry(end_time.tv_sec);
-	add_event_entry(end_time.tv_nsec);
+	}
 
-	add_escape_code(RRNOTIFY_THREAD_INFO_END);
-}
+	// Write out the voluntary and involuntary context switches
+	if (fields & RRNOTIFY_FIELD_CTX_SWITCHES) {
+		sink_entry(sink, task->nvcsw);
+		sink_entry(sink, task->nivcsw);
+	}
 
-static void add_task_module_info(struct task_struct * task)
-{
-	struct mm_struct *mm = take_tasks_mm(task);
+	// Write out the minor and major page faults
+	if (fields & RRNOTIFY_FIELD_FAULTS) {
+		sink_entry(sink, task->min_flt);
+		sink_entry(sink, task->maj_flt);
+	}
 
-	// module info is variable-length - calculate total length in entries first
-	unsigned long moduleCount = 0;
-	if(mm) {
-		struct vm_area_struct * vma;
-		for (vma = mm->mmap; vma; vma = vma->vm_next) {
-			if (vma->vm_file && (vma->vm_flags & VM_EXEC)) {
-				moduleCount++;
-			} else {
-				continue;
-			}
-		}
-	} else {
-		atomic_inc(&rrnotify_stats.sample_lost_no_mm);
+	// Write out the maximum resident set size in kB
+	if (fields & RRNOTIFY_FIELD_MAX_RSS) {
+		sink_entry(sink, get_task_max_rss(task));
+	}
+
+	// Write out the bytes read from and written to storage
+	if (fields & RRNOTIFY_FIELD_IO_BYTES) {
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,28) && defined(CONFIG_TASK_IO_ACCOUNTING)
+		sink_u64(sink, task->ioac.read_bytes);
+		sink_u64(sink, task->ioac.write_bytes);
+#else
+		sink_u64(sink, 0);
+		sink_u64(sink, 0);
+#endif
 	}
 
-	add_escape_code(RRNOTIFY_MODULE_LIST_BEGIN);
-	add_event_entry(moduleCount); // number of module entries
+	// Write out the cpu the thread last ran on
+	if (fields & RRNOTIFY_FIELD_LAST_CPU) {
+		sink_entry(sink, task_cpu(task));
+	}
 
-	if(mm) {
-		unsigned long cookie = RR_NO_COOKIE;
-		off_t offset = 0;
-		struct vm_area_struct * vma;
+	if (fields & RRNOTIFY_FIELD_COMM)
+		sink_entry(sink, comm_id);
+	if (fields & RRNOTIFY_FIELD_ARGV)
+		sink_entry(sink, argv_id);
 
-#if LINUX_VERSION_CODE >= KERNEL_VERSION(3,7,0)
-		// fixup removal of VM_EXECUTABLE flag in linux 3.7.0 and later
-		// https://lkml.org/lkml/2012/3/31/42
-#define VM_EXECUTABLE   0x00001000
-		unsigned long vm_flags = 0;
-		unsigned long app_cookie = RR_NO_COOKIE;
-		if (mm->exe_file) {
-			app_cookie = fast_get_dcookie(&mm->exe_file->f_path);
-		}
-#endif // >= 3.7.0
+	sink_escape(sink, RRNOTIFY_THREAD_INFO_END);
+}
 
-		for (vma = mm->mmap; vma; vma = vma->vm_next) {
-			if (vma->vm_file && (vma->vm_flags & VM_EXEC)) {
 #if LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,25)
-				cookie = fast_get_dcookie(&vma->vm_file->f_path);
+#define vma_file_cookie(vma)	fast_get_dcookie(&(vma)->vm_file->f_path)
 #else
-				cookie = fast_get_dcookie(vma->vm_file->f_dentry,
-								vma->vm_file->f_vfsmnt);
+#define vma_file_cookie(vma)	fast_get_dcookie((vma)->vm_file->f_dentry, (vma)->vm_file->f_vfsmnt)
 #endif
-				offset = vma->vm_pgoff << PAGE_SHIFT;
 
-				add_event_entry(vma->vm_start);
-				add_event_entry(vma->vm_end);
+/* cookie of the main executable, used to restore VM_EXECUTABLE */
+static unsigned long get_app_cookie(struct mm_struct * mm)
+{
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(3,7,0)
+	if (mm->exe_file) {
+		return fast_get_dcookie(&mm->exe_file->f_path);
+	}
+#endif // >= 3.7.0
+	return RR_NO_COOKIE;
+}
+
+/* One module entry: start, end, flags, cookie, offset */
+static void add_module_entry(struct entry_sink * sink, unsigned long start, unsigned long end,
+	unsigned long flags, unsigned long cookie, unsigned long offset)
+{
+	sink_entry(sink, start);
+	sink_entry(sink, end);
+	sink_entry(sink, flags);
+	sink_entry(sink, cookie);
+	sink_entry(sink, offset);
+}
+
+/* executable mappings reported as modules */
+static inline int is_module_vma(struct vm_area_struct * vma, unsigned long options)
+{
+	if (!(vma->vm_flags & VM_EXEC))
+		return 0;
+	return vma->vm_file || (options & RRNOTIFY_MODULE_ANON_EXEC);
+}
+
+struct module_entry {
+	unsigned long start;
+	unsigned long end;
+	unsigned long flags;
+	unsigned long cookie;
+	unsigned long offset;
+};
+
+static void get_vma_module_entry(struct vm_area_struct * vma, unsigned long app_cookie,
+	struct module_entry * entry)
+{
+	entry->start = vma->vm_start;
+	entry->end = vma->vm_end;
+	entry->flags = vma->vm_flags;
+
+	if (!vma->vm_file) {
+		entry->cookie = RR_ANON_COOKIE;
+		entry->offset = 0;
+		return;
+	}
+
+	entry->cookie = vma_file_cookie(vma);
+	entry->offset = vma->vm_pgoff << PAGE_SHIFT;
 
 #if LINUX_VERSION_CODE >= KERNEL_VERSION(3,7,0)
-				vm_flags = vma->vm_flags;
-				if(cookie == app_cookie) {
-					vm_flags |= VM_EXECUTABLE;
-				}
-				add_event_entry(vm_flags);
-#else
-				add_event_entry(vma->vm_flags);
+	if(entry->cookie == app_cookie) {
+		entry->flags |= VM_EXECUTABLE;
+	}
 #endif // >= 3.7.0
-				add_event_entry(cookie);
-				add_event_entry(offset);
-			} else {
-				continue;
-			}
+}
+
+/* can next be folded into entry, which ends just before it */
+static inline int can_coalesce(struct module_entry * entry, struct module_entry * next)
+{
+	if (entry->end != next->start || entry->cookie != next->cookie
+		|| entry->flags != next->flags)
+		return 0;
+	return entry->cookie == RR_ANON_COOKIE
+		|| entry->offset + (entry->end - entry->start) == next->offset;
+}
+
+/* Module lists are written MODULE_CHUNK entries at a time. In the event
+ * buffer the first chunk goes in the record itself and the rest in
+ * MODULE_CONT records after it, locking the part and mmap_sem afresh
+ * for each, so a process with a huge number of mappings doesn't hold
+ * up everyone else. Lists longer than module_limit are cut short.
+ */
+#define MODULE_CHUNK		512
+/* vmas looked at per chunk, modules or not */
+#define MODULE_CHUNK_VMAS	(MODULE_CHUNK * 8)
+
+/* where the next chunk of a module list starts */
+struct module_cont {
+	struct mm_struct * mm;
+	unsigned long app_cookie;
+	/* address to resume at, 0 when the list is complete */
+	unsigned long next;
+	unsigned long written;
+	/* part of the event buffer the record is in */
+	int buffer;
+};
+
+/* Walk the module vmas from addr on, writing their entries if write is
+ * set. Stops after max entries or MODULE_CHUNK_VMAS vmas, setting *next
+ * to where the walk should resume, or to 0 at the end of the list.
+ * Returns the number of entries.
+ */
+static unsigned long walk_task_modules(struct entry_sink * sink, struct mm_struct * mm,
+	unsigned long app_cookie, unsigned long options, unsigned long addr,
+	unsigned long max, int write, unsigned long * next)
+{
+	struct vm_area_struct * vma;
+	struct module_entry entry;
+	struct module_entry cur;
+	unsigned long count = 0;
+	int vmas = 0;
+
+	*next = 0;
+
+	for (vma = find_vma(mm, addr); vma; vma = vma->vm_next) {
+		if (++vmas > MODULE_CHUNK_VMAS) {
+			*next = vma->vm_start;
+			break;
+		}
+
+		if (!is_module_vma(vma, options))
+			continue;
+
+		get_vma_module_entry(vma, app_cookie, &cur);
+
+		if (count && (options & RRNOTIFY_MODULE_COALESCE)
+			&& can_coalesce(&entry, &cur)) {
+			entry.end = cur.end;
+			continue;
+		}
+
+		if (count == max) {
+			*next = vma->vm_start;
+			break;
+		}
+
+		if (count && write)
+			add_module_entry(sink, entry.start, entry.end, entry.flags,
+				entry.cookie, entry.offset);
+		entry = cur;
+		count++;
+	}
+
+	if (count && write)
+		add_module_entry(sink, entry.start, entry.end, entry.flags,
+			entry.cookie, entry.offset);
+
+	return count;
+}
+
+/* build-ids of the files mapped in [start, end), end 0 being the top */
+static void add_build_ids(struct node_buffer * nb, struct mm_struct * mm,
+	unsigned long start, unsigned long end)
+{
+	struct vm_area_struct * vma;
+
+	for (vma = find_vma(mm, start); vma && (!end || vma->vm_start < end); vma = vma->vm_next) {
+		if (vma->vm_file && (vma->vm_flags & VM_EXEC)) {
+			add_build_id(nb, vma_file_cookie(vma));
 		}
 	}
+}
+
+/* files whose build-ids are read per record before locking the buffer */
+#define BUILD_ID_PREFETCH	16
+
+/* Read the build-ids of the task's executable mappings that aren't
+ * cached yet into the cache, so that the record written with its part
+ * locked only copies them. The files are held while the reads, which
+ * may go to disk, happen without mmap_sem. Called without the event
+ * buffer locked.
+ */
+static void prefetch_build_ids(struct task_struct * task)
+{
+	struct file * files[BUILD_ID_PREFETCH];
+	unsigned long cookies[BUILD_ID_PREFETCH];
+	struct vm_area_struct * vma;
+	struct mm_struct * mm;
+	int i, nr = 0;
+
+	if (!(READ_ONCE(module_options) & RRNOTIFY_MODULE_BUILD_ID))
+		return;
+
+	mm = take_tasks_mm(task);
+	if (!mm)
+		return;
+
+	for (vma = mm->mmap; vma && nr < BUILD_ID_PREFETCH; vma = vma->vm_next) {
+		unsigned long cookie;
+
+		if (!vma->vm_file || !(vma->vm_flags & VM_EXEC))
+			continue;
+		cookie = vma_file_cookie(vma);
+		if (build_id_cached(cookie))
+			continue;
+		for (i = 0; i < nr && cookies[i] != cookie; i++)
+			;
+		if (i < nr)
+			continue;
+
+		get_file(vma->vm_file);
+		files[nr] = vma->vm_file;
+		cookies[nr++] = cookie;
+	}
+	release_mm(mm);
+
+	for (i = 0; i < nr; i++) {
+		build_id_prefetch(files[i], cookies[i]);
+		fput(files[i]);
+	}
+}
+
+/* One module list block: count, RR_MODULES_* flags, then the entries.
+ * Called with cont->mm's mmap_sem held.
+ */
+static void add_module_chunk(struct entry_sink * sink, struct module_cont * cont)
+{
+	unsigned long options = READ_ONCE(module_options);
+	unsigned long limit = READ_ONCE(module_limit);
+	unsigned long addr = cont->next;
+	unsigned long max = MODULE_CHUNK;
+	unsigned long count, next;
+	unsigned long flags = 0;
+
+	// module_limit may have been lowered below what was written already
+	if (limit && cont->written >= limit)
+		max = 0;
+	else if (limit && limit - cont->written < max)
+		max = limit - cont->written;
+
+	// module info is variable-length - calculate total length in entries first
+	count = walk_task_modules(sink, cont->mm, cont->app_cookie, options, addr, max, 0, &next);
+	if (next && limit && cont->written + count >= limit)
+		flags = RR_MODULES_TRUNCATED;
+	else if (next)
+		flags = RR_MODULES_CONTINUED;
+
+	sink_escape(sink, RRNOTIFY_MODULE_LIST_BEGIN);
+	sink_entry(sink, count); // number of module entries
+	sink_entry(sink, flags);
+	walk_task_modules(sink, cont->mm, cont->app_cookie, options, addr, max, 1, &next);
+	sink_escape(sink, RRNOTIFY_MODULE_LIST_END);
+
+	// build-ids of the chunk's files, as far as prefetch_build_ids() cached them
+	if (sink->part && (options & RRNOTIFY_MODULE_BUILD_ID))
+		add_build_ids(sink->part, cont->mm, addr, next);
+
+	cont->written += count;
+	cont->next = (flags & RR_MODULES_CONTINUED) ? next : 0;
+}
+
+/* Write the module list of the task. With a cont, only its first chunk
+ * is written and cont is left for add_module_continuations(), which the
+ * caller must call once the record is finished. Without, as for a
+ * query, the whole list is written in place.
+ */
+static void add_task_module_info(struct entry_sink * sink, struct task_struct * task,
+	struct module_cont * cont)
+{
+	struct mm_struct *mm = take_tasks_mm(task);
+	struct module_cont whole;
+	int in_place = !cont;
+
+	if (in_place)
+		cont = &whole;
+
+	cont->mm = mm;
+	cont->next = 0;
+	cont->written = 0;
+	if (!in_place)
+		cont->buffer = event_buffer_index(sink->part);
+
+	if(!mm) {
+		atomic_inc(&rrnotify_stats.sample_lost_no_mm);
+		sink_escape(sink, RRNOTIFY_MODULE_LIST_BEGIN);
+		sink_entry(sink, 0);
+		sink_entry(sink, 0);
+		sink_escape(sink, RRNOTIFY_MODULE_LIST_END);
+		return;
+	}
+
+	cont->app_cookie = get_app_cookie(mm);
+	add_module_chunk(sink, cont);
+
+	while (in_place && cont->next) {
+		cond_resched();
+		add_module_chunk(sink, cont);
+	}
+
+	if (cont->next) {
+		/* keep the mm for the continuations */
+		up_read(&mm->mmap_sem);
+		return;
+	}
 
 	release_mm(mm);
+	cont->mm = NULL;
+}
 
-	add_escape_code(RRNOTIFY_MODULE_LIST_END);
+/* Write the rest of a module list begun in record seq of tgid/pid, to
+ * the part that record is in, or just let go of it if that record was
+ * dropped. Called without the event buffer locked.
+ */
+static void add_module_continuations(struct module_cont * cont, pid_t tgid, pid_t pid,
+	unsigned long seq, int err)
+{
+	struct mm_struct * mm = cont->mm;
+	struct entry_sink rec;
+
+	if (!mm)
+		return;
+
+	while (!err && cont->next) {
+		cond_resched();
+
+		record_sink(&rec, event_buffer_lock(cont->buffer));
+		down_read(&mm->mmap_sem);
+		event_buffer_begin_record(rec.part, RRNOTIFY_MODULE_CONT_BEGIN);
+		add_event_entry(rec.part, seq);
+		add_event_entry(rec.part, tgid);
+		add_event_entry(rec.part, pid);
+		add_module_chunk(&rec, cont);
+		err = event_buffer_end_record(rec.part, RRNOTIFY_MODULE_CONT_END);
+		build_id_record_done(rec.part, err);
+		up_read(&mm->mmap_sem);
+		event_buffer_unlock(rec.part);
+	}
+
+	mmput(mm);
+	cont->mm = NULL;
 }
 
 void sync_buffer(struct task_struct * task)
 {
-	down(&buffer_sem);
+	struct module_cont cont;
+	struct entry_sink rec;
+	struct task_argv argv;
+	unsigned long seq;
+	int err;
+
+	if (aggregate_task(task))
+		return;
+
+	prefetch_build_ids(task);
+	read_task_argv(task, &argv);
+
+	record_sink(&rec, event_buffer_lock_local());
 	atomic_inc(&rrnotify_stats.event_received);
-	add_escape_code(RRNOTIFY_RECORD_BEGIN);
-	add_task_thread_info(task);
-	add_task_module_info(task);
-	add_escape_code(RRNOTIFY_RECORD_END);
-	up(&buffer_sem);
+	rrnotify_cpu_stat_inc(event_received);
+	seq = event_buffer_begin_record(rec.part, RRNOTIFY_RECORD_BEGIN);
+	add_task_thread_info(&rec, task, &argv);
+	add_task_module_info(&rec, task, &cont);
+	err = event_buffer_end_record(rec.part, RRNOTIFY_RECORD_END);
+	build_id_record_done(rec.part, err);
+	string_table_record_done(event_buffer_index(rec.part), err);
+	event_buffer_unlock(rec.part);
+	free_task_argv(&argv);
+
+	add_module_continuations(&cont, task->tgid, task->pid, seq, err);
+}
+
+
+/* Called with every part of the event buffer locked. */
+static void take_stream_settings(void)
+{
+	struct rrnotify_config const * cfg;
+
+	rcu_read_lock();
+	cfg = rcu_dereference(rrnotify_config);
+	record_fields = cfg->record_fields;
+	module_options = cfg->module_options;
+	module_limit = cfg->module_limit;
+	argv_max = cfg->argv_max;
+	sample_period = cfg->sample_period > 1 ? cfg->sample_period : 1;
+	rcu_read_unlock();
+}
+
+/* the settings in the header and CONFIG records */
+static void add_stream_settings(struct node_buffer * nb)
+{
+	add_event_entry(nb, record_fields);
+	add_event_entry(nb, event_mask);
+	add_event_entry(nb, sample_period);
+	add_event_entry(nb, module_options);
+}
+
+/* The first record in the stream describes how the rest is encoded.
+ * It has no sequence number so that the version can be read first.
+ * Each part of the buffer starts with one. Called with every part
+ * locked.
+ */
+static void add_session_headers(void)
+{
+	int i;
+
+	for (i = 0; i < event_buffer_count(); i++) {
+		struct node_buffer * nb = event_buffer_part(i);
+
+		add_escape_code(nb, RRNOTIFY_HEADER_BEGIN);
+		add_event_entry(nb, RRNOTIFY_FORMAT_VERSION);
+		add_stream_settings(nb);
+		add_escape_code(nb, RRNOTIFY_HEADER_END);
+	}
+}
+
+/* The spool thread and the reader hand the session over, and the spool
+ * moves to a new file, with the buffer empty: what follows has to be a
+ * stream of its own. Headers go first, and strings and build-ids are
+ * defined again. Called with every part locked.
+ */
+void sync_restart_stream(void)
+{
+	string_table_start();
+	build_id_reset_reported();
+	add_session_headers();
+}
+
+/* A live setting changed: take over the new stream settings and note
+ * them in a CONFIG record in each part of the buffer. Called under
+ * start_sem with the buffer set up.
+ */
+void sync_config_changed(void)
+{
+	int i;
+
+	event_buffer_lock_all();
+	take_stream_settings();
+	for (i = 0; i < event_buffer_count(); i++) {
+		struct node_buffer * nb = event_buffer_part(i);
+
+		event_buffer_begin_record(nb, RRNOTIFY_CONFIG_BEGIN);
+		add_stream_settings(nb);
+		event_buffer_end_record(nb, RRNOTIFY_CONFIG_END);
+	}
+	event_buffer_unlock_all();
+}
+
+
+/* Live snapshot: a SNAPSHOT record, laid out like an exit record, for
+ * each thread alive when it is requested. The walk takes TASK_WALK_BATCH
+ * threads at a time under rcu_read_lock() and writes their records with
+ * it dropped, so the machine is never stalled for long. Between batches
+ * only the ids of the last thread are kept: if that thread exited, the
+ * walk restarts its process, and if the whole process is gone it skips
+ * the processes started before it (the task list is in fork order).
+ * Threads may thus be reported twice, and ones forked during the walk
+ * may or may not be.
+ */
+u64 task_start_ns(struct task_struct * task)
+{
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(3,17,0)
+	return task->real_start_time;
+#elif LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,23)
+	return timespec_to_ns(&task->real_start_time);
+#else
+	return timespec_to_ns(&task->start_time);
+#endif
+}
+
+/* Called under rcu_read_lock(). */
+static struct task_struct * find_live_task(pid_t nr)
+{
+	struct task_struct * task;
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,24)
+	task = pid_task(find_vpid(nr), PIDTYPE_PID);
+#else
+	task = find_task_by_pid(nr);
+#endif
+	if (task && !pid_alive(task))
+		return NULL;
+	return task;
+}
+
+/* Find where the walk carries on, called under rcu_read_lock().
+ * Returns NULL at the end.
+ */
+static struct task_struct * task_walk_resume(struct task_walk * walk)
+{
+	struct task_struct * task;
+	struct task_struct * leader;
+
+	if (!walk->started) {
+		walk->started = 1;
+		if (walk->single)
+			return find_live_task(walk->tgid);
+		task = next_task(&init_task);
+		return task == &init_task ? NULL : task;
+	}
+
+	task = find_live_task(walk->pid);
+	if (task && task->tgid == walk->tgid) {
+		leader = task->group_leader;
+		task = next_thread(task);
+		if (task != leader)
+			return task;
+		if (walk->single)
+			return NULL;
+		task = next_task(leader);
+		return task == &init_task ? NULL : task;
+	}
+
+	/* the thread exited, redo its process */
+	leader = find_live_task(walk->tgid);
+	if (leader && thread_group_leader(leader))
+		return leader;
+
+	if (walk->single)
+		return NULL;
+
+	for_each_process(task) {
+		if (task_start_ns(task) > walk->leader_start)
+			return task;
+	}
+	return NULL;
+}
+
+/* Take references on the next batch of threads. */
+int task_walk_collect(struct task_walk * walk, struct task_struct ** batch)
+{
+	struct task_struct * task;
+	struct task_struct * leader;
+	int count = 0;
+
+	rcu_read_lock();
+
+	task = task_walk_resume(walk);
+
+	while (task && count < TASK_WALK_BATCH) {
+		leader = task->group_leader;
+
+		get_task_struct(task);
+		batch[count++] = task;
+		walk->tgid = task->tgid;
+		walk->pid = task->pid;
+		walk->leader_start = task_start_ns(leader);
+
+		task = next_thread(task);
+		if (task != leader)
+			continue;
+		if (walk->single)
+			task = NULL;
+		else if ((task = next_task(leader)) == &init_task)
+			task = NULL;
+	}
+
+	if (!task)
+		walk->done = 1;
+
+	rcu_read_unlock();
+	return count;
+}
+
+static void add_snapshot_record(struct task_struct * task)
+{
+	struct module_cont cont;
+	struct entry_sink rec;
+	struct task_argv argv;
+	unsigned long seq;
+	int err;
+
+	prefetch_build_ids(task);
+	read_task_argv(task, &argv);
+
+	record_sink(&rec, event_buffer_lock_local());
+	atomic_inc(&rrnotify_stats.snapshot_task);
+	seq = event_buffer_begin_record(rec.part, RRNOTIFY_SNAPSHOT_BEGIN);
+	add_task_thread_info(&rec, task, &argv);
+	add_task_module_info(&rec, task, &cont);
+	err = event_buffer_end_record(rec.part, RRNOTIFY_SNAPSHOT_END);
+	build_id_record_done(rec.part, err);
+	string_table_record_done(event_buffer_index(rec.part), err);
+	event_buffer_unlock(rec.part);
+	free_task_argv(&argv);
+
+	add_module_continuations(&cont, task->tgid, task->pid, seq, err);
+}
+
+static int snapshot_walk(struct task_walk * walk)
+{
+	struct task_struct * batch[TASK_WALK_BATCH];
+	int count;
+	int i;
+
+	while (!walk->done) {
+		count = task_walk_collect(walk, batch);
+
+		for (i = 0; i < count; i++) {
+			add_snapshot_record(batch[i]);
+			put_task_struct(batch[i]);
+		}
+
+		if (fatal_signal_pending(current))
+			return -EINTR;
+		cond_resched();
+	}
+	return 0;
+}
+
+int sync_snapshot(pid_t const * tgids, int nr_tgids)
+{
+	struct task_walk walk;
+	int err = 0;
+	int i;
+
+	if (!nr_tgids) {
+		memset(&walk, 0, sizeof(walk));
+		return snapshot_walk(&walk);
+	}
+
+	for (i = 0; i < nr_tgids && !err; i++) {
+		memset(&walk, 0, sizeof(walk));
+		walk.single = 1;
+		walk.tgid = tgids[i];
+		err = snapshot_walk(&walk);
+	}
+	return err;
+}
+
+
+/* Thread info of current, made out as tgid 0 and the given pid, for
+ * synthetic records. Strings are left out, their ids are 0. Returns
+ * the number of entries, which may be more than size.
+ */
+size_t encode_synthetic_thread_info(pid_t pid, unsigned long * buf, size_t size)
+{
+	struct entry_sink sink;
+
+	sink.part = NULL;
+	sink.buf = buf;
+	sink.size = size;
+	sink.pos = 0;
+	sink.next_string = 0;
+	add_task_thread_info(&sink, current, NULL);
+
+	// ids follow the THREAD_INFO_BEGIN escape and the fields
+	if (size >= 5 && (buf[2] & RRNOTIFY_FIELD_IDS)) {
+		buf[3] = 0;
+		buf[4] = pid;
+	}
+	return sink.pos;
+}
+
+
+/* RRNOTIFY_IOC_QUERY: thread info and module lists of the given threads,
+ * encoded as in the event stream, straight into the caller's buffer.
+ */
+#define QUERY_MAX_PIDS		4096
+#define QUERY_MAX_BYTES		(4 * 1024 * 1024)
+
+static void add_query_result(struct entry_sink * sink, pid_t pid, unsigned long what)
+{
+	struct task_struct * task;
+
+	rcu_read_lock();
+	task = find_live_task(pid);
+	if (task)
+		get_task_struct(task);
+	rcu_read_unlock();
+
+	sink_escape(sink, RRNOTIFY_QUERY_BEGIN);
+	sink_entry(sink, pid);
+	sink_entry(sink, task ? 0 : ESRCH);
+
+	if (task) {
+		if (what & RRNOTIFY_QUERY_THREAD)
+			add_task_thread_info(sink, task, NULL);
+		if (what & RRNOTIFY_QUERY_MODULES)
+			add_task_module_info(sink, task, NULL);
+		put_task_struct(task);
+	}
+
+	sink_escape(sink, RRNOTIFY_QUERY_END);
+}
+
+int sync_query(struct rrnotify_query * query)
+{
+	struct entry_sink sink;
+	unsigned long what = query->flags;
+	size_t size = min_t(u64, query->buf_size, QUERY_MAX_BYTES);
+	size_t used = 0;
+	pid_t * pids;
+	u32 i;
+	int err = 0;
+
+	if (query->nr_pids > QUERY_MAX_PIDS)
+		return -EINVAL;
+
+	if (!(what & (RRNOTIFY_QUERY_THREAD | RRNOTIFY_QUERY_MODULES)))
+		what = RRNOTIFY_QUERY_THREAD | RRNOTIFY_QUERY_MODULES;
+
+	pids = kmalloc(query->nr_pids * sizeof(pid_t) + 1, GFP_KERNEL);
+	if (!pids)
+		return -ENOMEM;
+
+	sink.part = NULL;
+	sink.size = size / sizeof(unsigned long);
+	sink.pos = 0;
+	sink.next_string = 1;
+	sink.buf = vmalloc(sink.size * sizeof(unsigned long) + 1);
+	if (!sink.buf) {
+		kfree(pids);
+		return -ENOMEM;
+	}
+
+	err = -EFAULT;
+	if (copy_from_user(pids, (void __user *)(unsigned long)query->pids,
+			query->nr_pids * sizeof(pid_t)))
+		goto out;
+
+	err = 0;
+	for (i = 0; i < query->nr_pids; i++) {
+		add_query_result(&sink, pids[i], what);
+		/* only whole results are returned */
+		if (sink.pos > sink.size)
+			break;
+		used = sink.pos;
+
+		if (fatal_signal_pending(current)) {
+			err = -EINTR;
+			goto out;
+		}
+		cond_resched();
+	}
+
+	if (i == 0 && query->nr_pids) {
+		err = -ENOSPC;
+		goto out;
+	}
+
+	if (copy_to_user((void __user *)(unsigned long)query->buf, sink.buf,
+			used * sizeof(unsigned long))) {
+		err = -EFAULT;
+		goto out;
+	}
+
+	query->buf_used = used * sizeof(unsigned long);
+	query->nr_done = i;
+
+out:
+	vfree(sink.buf);
+	kfree(pids);
+	return err;
+}
+
+
+/* The time is taken with the part locked, so markers are in time order
+ * with the records around them in their part; across parts the
+ * sequence numbers order them. Called without start_sem;
+ * rrnotify_started is stable with any part locked.
+ */
+int sync_marker(struct rrnotify_marker const * marker)
+{
+	struct timespec now;
+	struct entry_sink rec;
+	size_t len = strnlen(marker->label, sizeof(marker->label));
+	int err;
+
+	if (marker->magic != RRNOTIFY_MARKER_MAGIC || marker->flags)
+		return -EINVAL;
+
+	record_sink(&rec, event_buffer_lock_local());
+	if (!rrnotify_started) {
+		event_buffer_unlock(rec.part);
+		return -EINVAL;
+	}
+	event_buffer_begin_record(rec.part, RRNOTIFY_MARKER_BEGIN);
+	rrnotify_get_time(&now);
+	add_event_entry(rec.part, now.tv_sec);
+	add_event_entry(rec.part, now.tv_nsec);
+	add_event_entry(rec.part, current->tgid);
+	add_event_entry(rec.part, current->pid);
+	add_event_u64(rec.part, marker->value);
+	add_event_entry(rec.part, len);
+	sink_bytes(&rec, marker->label, len);
+	err = event_buffer_end_record(rec.part, RRNOTIFY_MARKER_END);
+	event_buffer_unlock(rec.part);
+
+	if (!err)
+		atomic_inc(&rrnotify_stats.marker_record);
+	return err;
+}
+
+
+/* Optional address-space events (fs_event_mask). exec, fork and mmap are
+ * seen from atomic context, so they are queued and written to the event
+ * buffer from a work item. munmap arrives through a blocking notifier and
+ * is written directly.
+ */
+
+static void add_task_ids(struct node_buffer * nb, struct task_struct * task)
+{
+	add_event_entry(nb, task->tgid);
+	add_event_entry(nb, task->pid);
+}
+
+static int munmap_notify(struct notifier_block * self, unsigned long val, void * data)
+{
+	unsigned long addr = (unsigned long)data;
+	struct mm_struct * mm = current->mm;
+	struct vm_area_struct * vma;
+	struct node_buffer * nb;
+	int exec_mapping = 0;
+
+	if (!mm)
+		return 0;
+
+	down_read(&mm->mmap_sem);
+	vma = find_vma(mm, addr);
+	if (vma && vma->vm_start <= addr && is_module_vma(vma, READ_ONCE(module_options)))
+		exec_mapping = 1;
+	up_read(&mm->mmap_sem);
+
+	if (!exec_mapping)
+		return 0;
+
+	nb = event_buffer_lock_local();
+	atomic_inc(&rrnotify_stats.task_event_received);
+	event_buffer_begin_record(nb, RRNOTIFY_MUNMAP_BEGIN);
+	add_task_ids(nb, current);
+	add_event_entry(nb, addr);
+	event_buffer_end_record(nb, RRNOTIFY_MUNMAP_END);
+	event_buffer_unlock(nb);
+
+	return 0;
+}
+
+static struct notifier_block munmap_nb = {
+	.notifier_call	= munmap_notify,
+};
+
+
+#if defined(RR_HAVE_TASK_TRACEPOINTS) || defined(RR_HAVE_MMAP_PROBE)
+
+#define MAX_PENDING_TASK_EVENTS	4096
+
+struct task_event {
+	struct list_head list;
+	int code;
+	pid_t tgid;
+	pid_t pid;
+	union {
+		/* RRNOTIFY_FORK_BEGIN */
+		struct {
+			pid_t tgid;
+			pid_t pid;
+		} child;
+		/* RRNOTIFY_EXEC_BEGIN */
+		struct task_struct * task;
+		/* RRNOTIFY_MMAP_BEGIN */
+		struct {
+			struct file * file;
+			unsigned long start;
+			unsigned long end;
+			unsigned long flags;
+			unsigned long offset;
+		} map;
+	} u;
+};
+
+static LIST_HEAD(task_event_list);
+static DEFINE_SPINLOCK(task_event_lock);
+static unsigned int task_event_count;
+
+static void task_event_work_fn(struct work_struct * work);
+static DECLARE_WORK(task_event_work, task_event_work_fn);
+
+static struct task_event * alloc_task_event(int code, struct task_struct * task)
+{
+	struct task_event * ev = kmalloc(sizeof(*ev), GFP_ATOMIC);
+
+	if (!ev) {
+		atomic_inc(&rrnotify_stats.task_event_lost_queue);
+		return NULL;
+	}
+	ev->code = code;
+	ev->tgid = task->tgid;
+	ev->pid = task->pid;
+	return ev;
+}
+
+static void free_task_event(struct task_event * ev)
+{
+	if (ev->code == RRNOTIFY_EXEC_BEGIN)
+		put_task_struct(ev->u.task);
+	else if (ev->code == RRNOTIFY_MMAP_BEGIN && ev->u.map.file)
+		fput(ev->u.map.file);
+	kfree(ev);
+}
+
+static void queue_task_event(struct task_event * ev)
+{
+	unsigned long flags;
+
+	spin_lock_irqsave(&task_event_lock, flags);
+	if (task_event_count >= MAX_PENDING_TASK_EVENTS) {
+		spin_unlock_irqrestore(&task_event_lock, flags);
+		atomic_inc(&rrnotify_stats.task_event_lost_queue);
+		free_task_event(ev);
+		return;
+	}
+	list_add_tail(&ev->list, &task_event_list);
+	task_event_count++;
+	spin_unlock_irqrestore(&task_event_lock, flags);
+
+	schedule_work(&task_event_work);
+}
+
+static void add_task_event(struct task_event * ev)
+{
+	struct module_cont cont = { .mm = NULL };
+	unsigned long cookie = RR_ANON_COOKIE;
+	struct entry_sink rec;
+	struct node_buffer * nb;
+	unsigned long seq;
+	int err = 0;
+
+	if (ev->code == RRNOTIFY_EXEC_BEGIN)
+		prefetch_build_ids(ev->u.task);
+	if (ev->code == RRNOTIFY_MMAP_BEGIN && ev->u.map.file) {
+		cookie = fast_get_dcookie(&ev->u.map.file->f_path);
+		if (READ_ONCE(module_options) & RRNOTIFY_MODULE_BUILD_ID)
+			build_id_prefetch(ev->u.map.file, cookie);
+	}
+
+	nb = event_buffer_lock_local();
+	record_sink(&rec, nb);
+	atomic_inc(&rrnotify_stats.task_event_received);
+	seq = event_buffer_begin_record(nb, ev->code);
+	add_event_entry(nb, ev->tgid);
+	add_event_entry(nb, ev->pid);
+
+	switch (ev->code) {
+	case RRNOTIFY_FORK_BEGIN:
+		add_event_entry(nb, ev->u.child.tgid);
+		add_event_entry(nb, ev->u.child.pid);
+		event_buffer_end_record(nb, RRNOTIFY_FORK_END);
+		break;
+	case RRNOTIFY_EXEC_BEGIN:
+		add_task_module_info(&rec, ev->u.task, &cont);
+		err = event_buffer_end_record(nb, RRNOTIFY_EXEC_END);
+		build_id_record_done(nb, err);
+		break;
+	case RRNOTIFY_MMAP_BEGIN:
+		add_escape_code(nb, RRNOTIFY_MODULE_LIST_BEGIN);
+		add_event_entry(nb, 1);
+		add_event_entry(nb, 0);
+		add_module_entry(&rec, ev->u.map.start, ev->u.map.end, ev->u.map.flags,
+			cookie, ev->u.map.offset);
+		add_escape_code(nb, RRNOTIFY_MODULE_LIST_END);
+		if (ev->u.map.file && (module_options & RRNOTIFY_MODULE_BUILD_ID))
+			add_build_id(nb, cookie);
+		build_id_record_done(nb, event_buffer_end_record(nb, RRNOTIFY_MMAP_END));
+		break;
+	}
+	event_buffer_unlock(nb);
+
+	add_module_continuations(&cont, ev->tgid, ev->pid, seq, err);
+}
+
+static void task_event_work_fn(struct work_struct * work)
+{
+	LIST_HEAD(events);
+	struct task_event * ev;
+	struct task_event * tmp;
+	unsigned long flags;
+
+	spin_lock_irqsave(&task_event_lock, flags);
+	list_splice_init(&task_event_list, &events);
+	task_event_count = 0;
+	spin_unlock_irqrestore(&task_event_lock, flags);
+
+	list_for_each_entry_safe(ev, tmp, &events, list) {
+		list_del(&ev->list);
+		add_task_event(ev);
+		free_task_event(ev);
+	}
+}
+
+/* write out anything still queued once the hooks are gone */
+static void flush_task_events(void)
+{
+	cancel_work_sync(&task_event_work);
+	task_event_work_fn(&task_event_work);
+}
+
+#endif // RR_HAVE_TASK_TRACEPOINTS || RR_HAVE_MMAP_PROBE
+
+
+#ifdef RR_HAVE_TASK_TRACEPOINTS
+
+struct linux_binprm;
+
+static void fork_probe(void * data, struct task_struct * parent, struct task_struct * child)
+{
+	struct task_event * ev = alloc_task_event(RRNOTIFY_FORK_BEGIN, parent);
+
+	if (!ev)
+		return;
+	ev->u.child.tgid = child->tgid;
+	ev->u.child.pid = child->pid;
+	queue_task_event(ev);
+}
+
+static void exec_probe(void * data, struct task_struct * task, pid_t old_pid,
+	struct linux_binprm * bprm)
+{
+	struct task_event * ev = alloc_task_event(RRNOTIFY_EXEC_BEGIN, task);
+
+	if (!ev)
+		return;
+	get_task_struct(task);
+	ev->u.task = task;
+	queue_task_event(ev);
+}
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(3,15,0)
+/* The sched tracepoints are not exported to modules; look them up by name. */
+struct tracepoint_lookup {
+	const char * name;
+	struct tracepoint * tp;
+};
+
+static void match_tracepoint(struct tracepoint * tp, void * priv)
+{
+	struct tracepoint_lookup * lookup = priv;
+
+	if (!strcmp(tp->name, lookup->name))
+		lookup->tp = tp;
+}
+
+static struct tracepoint * find_tracepoint(const char * name)
+{
+	struct tracepoint_lookup lookup = { .name = name, .tp = NULL };
+
+	for_each_kernel_tracepoint(match_tracepoint, &lookup);
+	return lookup.tp;
+}
+
+static int rr_tracepoint_register(const char * name, void * probe)
+{
+	struct tracepoint * tp = find_tracepoint(name);
+
+	if (!tp)
+		return -ENOENT;
+	return tracepoint_probe_register(tp, probe, NULL);
+}
+
+static void rr_tracepoint_unregister(const char * name, void * probe)
+{
+	struct tracepoint * tp = find_tracepoint(name);
+
+	if (tp)
+		tracepoint_probe_unregister(tp, probe, NULL);
+}
+#else
+static int rr_tracepoint_register(const char * name, void * probe)
+{
+	return tracepoint_probe_register(name, probe, NULL);
+}
+
+static void rr_tracepoint_unregister(const char * name, void * probe)
+{
+	tracepoint_probe_unregister(name, probe, NULL);
+}
+#endif // >= 3.15.0
+
+#endif // RR_HAVE_TASK_TRACEPOINTS
+
+
+#ifdef RR_HAVE_MMAP_PROBE
+
+static void mmap_probe(struct vm_area_struct * vma)
+{
+	struct task_event * ev;
+	unsigned long vm_flags = vma->vm_flags;
+
+	if (!is_module_vma(vma, READ_ONCE(module_options)))
+		goto out;
+
+	ev = alloc_task_event(RRNOTIFY_MMAP_BEGIN, current);
+	if (!ev)
+		goto out;
+
+	ev->u.map.file = NULL;
+	ev->u.map.offset = 0;
+
+	if (vma->vm_file) {
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(3,7,0)
+		struct file * exe_file = rcu_access_pointer(vma->vm_mm->exe_file);
+		if (exe_file && exe_file->f_path.dentry == vma->vm_file->f_path.dentry) {
+			vm_flags |= VM_EXECUTABLE;
+		}
+#endif // >= 3.7.0
+
+		get_file(vma->vm_file);
+		ev->u.map.file = vma->vm_file;
+		ev->u.map.offset = vma->vm_pgoff << PAGE_SHIFT;
+	}
+
+	ev->u.map.start = vma->vm_start;
+	ev->u.map.end = vma->vm_end;
+	ev->u.map.flags = vm_flags;
+	queue_task_event(ev);
+
+out:
+	jprobe_return();
+}
+
+static struct jprobe mmap_jprobe = {
+	.entry	= mmap_probe,
+	.kp	= {
+		.symbol_name	= "perf_event_mmap",
+	},
+};
+
+#endif // RR_HAVE_MMAP_PROBE
+
+
+static int task_events_start(void)
+{
+	int err = 0;
+
+	if (event_mask & RRNOTIFY_EVENT_FORK) {
+#ifdef RR_HAVE_TASK_TRACEPOINTS
+		if ((err = rr_tracepoint_register("sched_process_fork", fork_probe)))
+			goto out;
+#else
+		LOG_WARNING("fork events are not supported by this kernel");
+		event_mask &= ~RRNOTIFY_EVENT_FORK;
+#endif
+	}
+
+	if (event_mask & RRNOTIFY_EVENT_EXEC) {
+#ifdef RR_HAVE_TASK_TRACEPOINTS
+		if ((err = rr_tracepoint_register("sched_process_exec", exec_probe)))
+			goto out_fork;
+#else
+		LOG_WARNING("exec events are not supported by this kernel");
+		event_mask &= ~RRNOTIFY_EVENT_EXEC;
+#endif
+	}
+
+	if (event_mask & RRNOTIFY_EVENT_MMAP) {
+		if ((err = profile_event_register(PROFILE_MUNMAP, &munmap_nb)))
+			goto out_exec;
+#ifdef RR_HAVE_MMAP_PROBE
+		if ((err = register_jprobe(&mmap_jprobe))) {
+			profile_event_unregister(PROFILE_MUNMAP, &munmap_nb);
+			goto out_exec;
+		}
+#else
+		LOG_WARNING("mmap events are not supported by this kernel, reporting munmap only");
+#endif
+	}
+
+	return 0;
+
+out_exec:
+#ifdef RR_HAVE_TASK_TRACEPOINTS
+	if (event_mask & RRNOTIFY_EVENT_EXEC)
+		rr_tracepoint_unregister("sched_process_exec", exec_probe);
+out_fork:
+	if (event_mask & RRNOTIFY_EVENT_FORK)
+		rr_tracepoint_unregister("sched_process_fork", fork_probe);
+	tracepoint_synchronize_unregister();
+out:
+#endif
+	return err;
+}
+
+static void task_events_stop(void)
+{
+	if (event_mask & RRNOTIFY_EVENT_MMAP) {
+		profile_event_unregister(PROFILE_MUNMAP, &munmap_nb);
+#ifdef RR_HAVE_MMAP_PROBE
+		unregister_jprobe(&mmap_jprobe);
+#endif
+	}
+
+#ifdef RR_HAVE_TASK_TRACEPOINTS
+	if (event_mask & RRNOTIFY_EVENT_EXEC)
+		rr_tracepoint_unregister("sched_process_exec", exec_probe);
+	if (event_mask & RRNOTIFY_EVENT_FORK)
+		rr_tracepoint_unregister("sched_process_fork", fork_probe);
+	tracepoint_synchronize_unregister();
+#endif
+
+#if defined(RR_HAVE_TASK_TRACEPOINTS) || defined(RR_HAVE_MMAP_PROBE)
+	flush_task_events();
+#endif
+}
+
+
+int sync_start(void)
+{
+	int err;
+
+	spin_lock(&rrnotifyfs_lock);
+	event_mask = fs_event_mask;
+	spin_unlock(&rrnotifyfs_lock);
+
+	exit_filter_start();
+	build_id_start();
+	string_table_start();
+
+	event_buffer_lock_all();
+	take_stream_settings();
+	add_session_headers();
+	event_buffer_unlock_all();
+
+	err = profile_event_register(PROFILE_TASK_EXIT, &task_exit_nb);
+	if (err)
+		return err;
+
+	err = task_events_start();
+	if (err)
+		goto out1;
+
+	err = cpu_tick_start();
+	if (err)
+		goto out2;
+
+	return 0;
+
+out2:
+	task_events_stop();
+out1:
+	profile_event_unregister(PROFILE_TASK_EXIT, &task_exit_nb);
+	return err;
+}
+
+void sync_stop(void)
+{
+	cpu_tick_stop();
+	profile_event_unregister(PROFILE_TASK_EXIT, &task_exit_nb);
+	task_events_stop();
 }
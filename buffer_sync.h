@@ -10,6 +10,8 @@
 #ifndef RRNOTIFY_BUFFER_SYNC_H_
 #define RRNOTIFY_BUFFER_SYNC_H_
 
+#include <linux/types.h>
+
 struct task_struct;
 
 /* add the necessary profiling hooks */
@@ -21,4 +23,50 @@ void sync_stop(void);
 /* sync the tgid buffer */
 void sync_buffer(struct task_struct * task);
 
+/* take over a new rrnotify_config and note it in the stream */
+void sync_config_changed(void);
+
+/* start the stream over for a new consumer, with the buffer locked */
+void sync_restart_stream(void);
+
+/* write SNAPSHOT records for the live threads of the given processes,
+ * or of all processes if nr_tgids is 0 */
+int sync_snapshot(pid_t const * tgids, int nr_tgids);
+
+/* Walks live threads a batch at a time, see task_walk_collect(). Zero
+ * it to walk all threads, or set single and tgid for one process.
+ */
+#define TASK_WALK_BATCH	64
+
+struct task_walk {
+	/* only walk the threads of tgid */
+	int single;
+	/* last thread taken, and its process */
+	pid_t tgid;
+	pid_t pid;
+	u64 leader_start;
+	int started;
+	int done;
+};
+
+/* Take references on up to TASK_WALK_BATCH threads, returns how many.
+ * Sets walk->done once there are no more.
+ */
+int task_walk_collect(struct task_walk * walk, struct task_struct ** batch);
+
+/* start time of a task in ns, tells apart tasks reusing a pid */
+u64 task_start_ns(struct task_struct * task);
+
+/* thread info entries for inject.c */
+size_t encode_synthetic_thread_info(pid_t pid, unsigned long * buf, size_t size);
+
+struct rrnotify_query;
+struct rrnotify_marker;
+
+/* answer RRNOTIFY_IOC_QUERY */
+int sync_query(struct rrnotify_query * query);
+
+/* add a MARKER record for a write() of struct rrnotify_marker */
+int sync_marker(struct rrnotify_marker const * marker);
+
 #endif /*RRNOTIFY_BUFFER_SYNC_H_*/
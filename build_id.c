@@ -0,0 +1,301 @@
+/**
+ * @file build_id.c
+ *
+ * @remark Copyright (C) 2006-2015 RotateRight, LLC
+ * @remark Read the file COPYING
+ *
+ * GNU build-IDs of mapped files, so symbol caches can be keyed by
+ * content instead of by path. The note is read from the file the
+ * mapping holds, so it identifies what was actually mapped even if the
+ * path was replaced since. Each file is reported once per session and
+ * part of the event buffer.
+ *
+ * Reading the note may have to go to disk, so it is never done with a
+ * part of the event buffer locked: the writers read the ids of the
+ * files a record is going to need into a cache first, and the record
+ * only copies them from there. A file that isn't cached when its
+ * record is written, e.g. because another file took its slot, is
+ * reported with a later record.
+ */
+
+#include <linux/fs.h>
+#include <linux/elf.h>
+#include <linux/hash.h>
+#include <linux/slab.h>
+#include <linux/spinlock.h>
+#include <linux/string.h>
+#include <linux/version.h>
+
+#include "rrnotify.h"
+#include "event_buffer.h"
+#include "build_id.h"
+
+#ifndef NT_GNU_BUILD_ID
+#define NT_GNU_BUILD_ID		3
+#endif
+
+#define BUILD_ID_MAX		64
+/* don't walk program header tables of unreasonable size */
+#define MAX_PHDRS			64
+
+#define SEEN_HASH_BITS		12
+#define SEEN_HASH_SIZE		(1 << SEEN_HASH_BITS)
+#define SEEN_MAX_PROBES		16
+#define MAX_PENDING			64
+#define CACHE_BITS			10
+#define CACHE_SIZE			(1 << CACHE_BITS)
+#define NOTE_BUF_SIZE		1024
+
+/* ids read so far this session, direct mapped by cookie */
+struct cached_build_id {
+	unsigned long cookie;	/* 0 is empty */
+	size_t len;
+	unsigned char id[BUILD_ID_MAX];
+};
+
+static struct cached_build_id cache[CACHE_SIZE];
+static DEFINE_SPINLOCK(cache_lock);
+
+/* cookies reported this session, open addressing, 0 is empty. Once a
+ * probe sequence is full, files falling into it are reported each time.
+ * Protected by seen_lock.
+ */
+static unsigned long seen_cookies[SEEN_HASH_SIZE];
+/* the parts of the event buffer each was reported in */
+static unsigned long seen_buffers[SEEN_HASH_SIZE];
+static DEFINE_SPINLOCK(seen_lock);
+
+/* cookies reported in the record being written to each part, only
+ * touched by the writer holding the part's lock */
+static unsigned long pending_cookies[EVENT_MAX_BUFFERS][MAX_PENDING];
+static int nr_pending[EVENT_MAX_BUFFERS];
+
+
+void build_id_reset_reported(void)
+{
+	spin_lock(&seen_lock);
+	memset(seen_cookies, 0, sizeof(seen_cookies));
+	memset(seen_buffers, 0, sizeof(seen_buffers));
+	spin_unlock(&seen_lock);
+	memset(nr_pending, 0, sizeof(nr_pending));
+}
+
+
+void build_id_start(void)
+{
+	build_id_reset_reported();
+
+	spin_lock(&cache_lock);
+	memset(cache, 0, sizeof(cache));
+	spin_unlock(&cache_lock);
+}
+
+
+/* Returns the slot holding cookie, or the empty slot it would go in.
+ * Called with seen_lock held.
+ */
+static unsigned long * seen_slot(unsigned long cookie)
+{
+	unsigned long idx = hash_long(cookie, SEEN_HASH_BITS);
+	int i;
+
+	for (i = 0; i < SEEN_MAX_PROBES; i++) {
+		unsigned long * slot = &seen_cookies[(idx + i) & (SEEN_HASH_SIZE - 1)];
+		if (*slot == cookie || *slot == 0)
+			return slot;
+	}
+	return NULL;
+}
+
+
+static int is_reported(int buffer, unsigned long cookie)
+{
+	unsigned long * slot;
+	int i, reported;
+
+	for (i = 0; i < nr_pending[buffer]; i++) {
+		if (pending_cookies[buffer][i] == cookie)
+			return 1;
+	}
+
+	spin_lock(&seen_lock);
+	slot = seen_slot(cookie);
+	reported = slot && *slot == cookie
+		&& (seen_buffers[slot - seen_cookies] & (1UL << buffer));
+	spin_unlock(&seen_lock);
+	return reported;
+}
+
+
+void build_id_record_done(struct node_buffer * nb, int err)
+{
+	int buffer = event_buffer_index(nb);
+	int i;
+
+	if (!err) {
+		spin_lock(&seen_lock);
+		for (i = 0; i < nr_pending[buffer]; i++) {
+			unsigned long * slot = seen_slot(pending_cookies[buffer][i]);
+			if (slot) {
+				*slot = pending_cookies[buffer][i];
+				seen_buffers[slot - seen_cookies] |= 1UL << buffer;
+			}
+		}
+		spin_unlock(&seen_lock);
+	}
+	nr_pending[buffer] = 0;
+}
+
+
+static int read_file(struct file * file, loff_t pos, void * buf, size_t count)
+{
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4,14,0)
+	return kernel_read(file, buf, count, &pos) == count;
+#else
+	return kernel_read(file, pos, buf, count) == count;
+#endif // >= 4.14.0
+}
+
+
+/* Look for the GNU build-ID in a PT_NOTE segment, returns its length. */
+static size_t find_build_id_note(struct file * file, loff_t offset, size_t size,
+	unsigned char * id)
+{
+	char * note_buf;
+	size_t pos = 0, len = 0;
+
+	if (size > NOTE_BUF_SIZE)
+		size = NOTE_BUF_SIZE;
+	note_buf = kmalloc(size, GFP_KERNEL);
+	if (!note_buf)
+		return 0;
+	if (!read_file(file, offset, note_buf, size))
+		goto out;
+
+	while (pos + sizeof(struct elf_note) <= size) {
+		struct elf_note * note = (struct elf_note *)(note_buf + pos);
+		size_t name = pos + sizeof(*note);
+		size_t desc = name + ALIGN(note->n_namesz, 4);
+
+		if (desc + note->n_descsz > size)
+			break;
+
+		if (note->n_type == NT_GNU_BUILD_ID && note->n_namesz == 4
+			&& !memcmp(note_buf + name, "GNU", 4)
+			&& note->n_descsz > 0 && note->n_descsz <= BUILD_ID_MAX) {
+			memcpy(id, note_buf + desc, note->n_descsz);
+			len = note->n_descsz;
+			break;
+		}
+
+		pos = desc + ALIGN(note->n_descsz, 4);
+	}
+out:
+	kfree(note_buf);
+	return len;
+}
+
+
+/* Only ELF files of the kernel's own class are parsed. */
+static size_t read_build_id(struct file * file, unsigned char * id)
+{
+	struct elfhdr ehdr;
+	struct elf_phdr phdr;
+	size_t len;
+	int i;
+
+	if (!read_file(file, 0, &ehdr, sizeof(ehdr)))
+		return 0;
+
+	if (memcmp(ehdr.e_ident, ELFMAG, SELFMAG) || ehdr.e_ident[EI_CLASS] != ELF_CLASS
+		|| ehdr.e_phentsize != sizeof(phdr) || ehdr.e_phnum > MAX_PHDRS)
+		return 0;
+
+	for (i = 0; i < ehdr.e_phnum; i++) {
+		if (!read_file(file, ehdr.e_phoff + i * sizeof(phdr), &phdr, sizeof(phdr)))
+			return 0;
+		if (phdr.p_type != PT_NOTE)
+			continue;
+		if ((len = find_build_id_note(file, phdr.p_offset, phdr.p_filesz, id)))
+			return len;
+	}
+	return 0;
+}
+
+
+static inline struct cached_build_id * cache_slot(unsigned long cookie)
+{
+	return &cache[hash_long(cookie, CACHE_BITS)];
+}
+
+
+int build_id_cached(unsigned long cookie)
+{
+	int cached;
+
+	if (cookie == RR_NO_COOKIE || cookie == RR_INVALID_COOKIE)
+		return 1;
+
+	spin_lock(&cache_lock);
+	cached = cache_slot(cookie)->cookie == cookie;
+	spin_unlock(&cache_lock);
+	return cached;
+}
+
+
+void build_id_prefetch(struct file * file, unsigned long cookie)
+{
+	struct cached_build_id entry;
+
+	if (build_id_cached(cookie))
+		return;
+
+	memset(&entry, 0, sizeof(entry));
+	entry.cookie = cookie;
+	entry.len = read_build_id(file, entry.id);
+
+	spin_lock(&cache_lock);
+	*cache_slot(cookie) = entry;
+	spin_unlock(&cache_lock);
+}
+
+
+/* BUILD_ID block: cookie, length in bytes (0 if the file has none),
+ * then the id packed into entries.
+ */
+void add_build_id(struct node_buffer * nb, unsigned long cookie)
+{
+	unsigned long id[BUILD_ID_MAX / sizeof(unsigned long)];
+	struct cached_build_id * slot;
+	int buffer = event_buffer_index(nb);
+	size_t len;
+	size_t i;
+
+	if (cookie == RR_NO_COOKIE || cookie == RR_INVALID_COOKIE)
+		return;
+
+	if (nr_pending[buffer] == MAX_PENDING || is_reported(buffer, cookie))
+		return;
+
+	spin_lock(&cache_lock);
+	slot = cache_slot(cookie);
+	if (slot->cookie != cookie) {
+		spin_unlock(&cache_lock);
+		return;
+	}
+	len = slot->len;
+	memset(id, 0, sizeof(id));
+	memcpy(id, slot->id, len);
+	spin_unlock(&cache_lock);
+
+	add_event_entry(nb, RR_ESCAPE_CODE);
+	add_event_entry(nb, RRNOTIFY_BUILD_ID_BEGIN);
+	add_event_entry(nb, cookie);
+	add_event_entry(nb, len);
+	for (i = 0; i < DIV_ROUND_UP(len, sizeof(unsigned long)); i++)
+		add_event_entry(nb, id[i]);
+	add_event_entry(nb, RR_ESCAPE_CODE);
+	add_event_entry(nb, RRNOTIFY_BUILD_ID_END);
+
+	pending_cookies[buffer][nr_pending[buffer]++] = cookie;
+}
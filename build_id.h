@@ -0,0 +1,40 @@
+/**
+ * @file build_id.h
+ *
+ * @remark Copyright (C) 2006-2015 RotateRight, LLC
+ * @remark Read the file COPYING
+ */
+
+#ifndef RRNOTIFY_BUILD_ID_H_
+#define RRNOTIFY_BUILD_ID_H_
+
+struct file;
+struct node_buffer;
+
+/* forget the files reported in the previous session */
+void build_id_start(void);
+
+/* Report every file again, for a stream started over. Called with every
+ * part of the event buffer locked.
+ */
+void build_id_reset_reported(void);
+
+/* Read the build-id of a file into the cache unless it is there
+ * already. May sleep on I/O, so it is called without any part of the
+ * event buffer locked.
+ */
+void build_id_prefetch(struct file * file, unsigned long cookie);
+int build_id_cached(unsigned long cookie);
+
+/* Write a BUILD_ID block for the file unless it was reported in this
+ * part of the event buffer already or isn't cached yet.
+ * Called with the part locked, inside a record.
+ */
+void add_build_id(struct node_buffer * nb, unsigned long cookie);
+
+/* Called with the result of event_buffer_end_record(): files written
+ * into a record that was dropped are reported again next time.
+ */
+void build_id_record_done(struct node_buffer * nb, int err);
+
+#endif /* RRNOTIFY_BUILD_ID_H_ */
@@ -0,0 +1,120 @@
+/**
+ * @file config.c
+ *
+ * @remark Copyright (C) 2006-2015 RotateRight, LLC
+ * @remark Read the file COPYING
+ *
+ * Live settings. Readers on the exit path only do rcu_dereference(),
+ * so a setting can be changed while exits are being recorded without
+ * stopping the session or taking a lock they would wait on.
+ */
+
+#include <linux/kernel.h>
+#include <linux/slab.h>
+#include <linux/stddef.h>
+
+#include "rrnotify.h"
+#include "config.h"
+#include "string_table.h"
+
+struct rrnotify_config __rcu * rrnotify_config;
+
+/* the copy last published, only used under start_sem */
+static struct rrnotify_config * published;
+
+static struct {
+	unsigned long * fs;
+	size_t offset;
+} const config_fields[] = {
+	{ &fs_sample_period,		offsetof(struct rrnotify_config, sample_period) },
+	{ &fs_rate_limit,		offsetof(struct rrnotify_config, rate_limit) },
+	{ &fs_rate_burst,		offsetof(struct rrnotify_config, rate_burst) },
+	{ &fs_record_fields,		offsetof(struct rrnotify_config, record_fields) },
+	{ &fs_module_options,		offsetof(struct rrnotify_config, module_options) },
+	{ &fs_module_limit,		offsetof(struct rrnotify_config, module_limit) },
+	{ &fs_argv_max,			offsetof(struct rrnotify_config, argv_max) },
+	{ &fs_buffer_watershed_adaptive,	offsetof(struct rrnotify_config, watershed_adaptive) },
+};
+
+#define config_field(cfg, i)	((unsigned long *)((char *)(cfg) + config_fields[i].offset))
+
+
+int rrnotify_config_has(unsigned long * addr)
+{
+	int i;
+
+	for (i = 0; i < ARRAY_SIZE(config_fields); i++) {
+		if (config_fields[i].fs == addr)
+			return 1;
+	}
+	return 0;
+}
+
+
+struct rrnotify_config * rrnotify_config_build(unsigned long ** addrs,
+	unsigned long * vals, int count)
+{
+	struct rrnotify_config * cfg;
+	int i, j;
+
+	cfg = kmalloc(sizeof(*cfg), GFP_KERNEL);
+	if (!cfg)
+		return NULL;
+
+	spin_lock(&rrnotifyfs_lock);
+	for (i = 0; i < ARRAY_SIZE(config_fields); i++)
+		*config_field(cfg, i) = *config_fields[i].fs;
+	spin_unlock(&rrnotifyfs_lock);
+
+	for (j = 0; j < count; j++) {
+		for (i = 0; i < ARRAY_SIZE(config_fields); i++) {
+			if (config_fields[i].fs == addrs[j])
+				*config_field(cfg, i) = vals[j];
+		}
+	}
+
+	if (!cfg->rate_burst)
+		cfg->rate_burst = 1;
+	cfg->record_fields &= RRNOTIFY_FIELDS_ALL;
+	cfg->argv_max = min_t(unsigned long, cfg->argv_max, STRING_MAX_LEN);
+
+	return cfg;
+}
+
+
+static void config_free_rcu(struct rcu_head * head)
+{
+	kfree(container_of(head, struct rrnotify_config, rcu));
+}
+
+
+void rrnotify_config_publish(struct rrnotify_config * cfg)
+{
+	struct rrnotify_config * old = published;
+
+	published = cfg;
+	rcu_assign_pointer(rrnotify_config, cfg);
+	if (old)
+		call_rcu(&old->rcu, config_free_rcu);
+}
+
+
+int rrnotify_config_init(void)
+{
+	struct rrnotify_config * cfg = rrnotify_config_build(NULL, NULL, 0);
+
+	if (!cfg)
+		return -ENOMEM;
+	rrnotify_config_publish(cfg);
+	return 0;
+}
+
+
+void rrnotify_config_exit(void)
+{
+	/* the hooks are gone, wait for the callbacks of earlier changes */
+	rcu_barrier();
+	rcu_assign_pointer(rrnotify_config, NULL);
+	kfree(published);
+	published = NULL;
+}
@@ -0,0 +1,56 @@
+/**
+ * @file config.h
+ *
+ * @remark Copyright (C) 2006-2015 RotateRight, LLC
+ * @remark Read the file COPYING
+ */
+
+#ifndef RRNOTIFY_CONFIG_H_
+#define RRNOTIFY_CONFIG_H_
+
+#include <linux/rcupdate.h>
+
+#ifndef __rcu
+#define __rcu
+#endif
+
+/* The settings that may change while a session runs. The fs_* files
+ * stay the place they are written to; each change publishes a new
+ * copy here, which the recording paths read under rcu_read_lock().
+ */
+struct rrnotify_config {
+	/* exit filter */
+	unsigned long sample_period;
+	unsigned long rate_limit;
+	unsigned long rate_burst;
+	/* stream encoding, taken over by buffer_sync.c with the buffer locked */
+	unsigned long record_fields;
+	unsigned long module_options;
+	unsigned long module_limit;
+	unsigned long argv_max;
+	/* event buffer */
+	unsigned long watershed_adaptive;
+
+	struct rcu_head rcu;
+};
+
+extern struct rrnotify_config __rcu * rrnotify_config;
+
+/* publish the initial settings, and free the last ones on unload */
+int rrnotify_config_init(void);
+void rrnotify_config_exit(void);
+
+/* non-zero if the fs_* setting at addr is part of rrnotify_config */
+int rrnotify_config_has(unsigned long * addr);
+
+/* A copy of the current settings with the given fs_* values applied,
+ * to be published once the values are stored. Called under start_sem.
+ */
+struct rrnotify_config * rrnotify_config_build(unsigned long ** addrs,
+	unsigned long * vals, int count);
+
+/* make cfg the current settings, the previous ones are freed after a
+ * grace period. Called under start_sem. */
+void rrnotify_config_publish(struct rrnotify_config * cfg);
+
+#endif /* RRNOTIFY_CONFIG_H_ */
@@ -0,0 +1,255 @@
+/**
+ * @file cpu_tick.c
+ *
+ * @remark Copyright (C) 2006-2015 RotateRight, LLC
+ * @remark Read the file COPYING
+ *
+ * Periodic cpu time of long running threads. Every cpu_tick_interval
+ * the live threads are walked and those that ran since the previous
+ * tick get an entry with how much cpu time they used since then. The
+ * first tick only takes the baseline; threads first seen later report
+ * their time since they started.
+ */
+
+#include <linux/sched.h>
+#include <linux/slab.h>
+#include <linux/list.h>
+#include <linux/hash.h>
+#include <linux/jiffies.h>
+#include <linux/workqueue.h>
+#include <linux/version.h>
+
+#include "rrnotify.h"
+#include "rrnotify_stats.h"
+#include "event_buffer.h"
+#include "buffer_sync.h"
+#include "cpu_tick.h"
+
+#define TICK_HASH_BITS		12
+#define TICK_HASH_SIZE		(1 << TICK_HASH_BITS)
+
+/* cpu time of a thread at the last tick */
+struct tick_thread {
+	struct list_head list;
+	pid_t pid;
+	u64 start_ns;
+	unsigned long utime;
+	unsigned long stime;
+	u64 runtime;
+	unsigned long generation;
+};
+
+/* an entry of a CPU_TICK record */
+struct tick_delta {
+	pid_t tgid;
+	pid_t pid;
+	unsigned long utime;
+	unsigned long stime;
+	u64 runtime;
+};
+
+/* only touched by the tick work, which doesn't run concurrently */
+static struct list_head tick_hash[TICK_HASH_SIZE];
+static unsigned long tick_generation;
+static struct task_struct * tick_batch[TASK_WALK_BATCH];
+static struct tick_delta tick_deltas[TASK_WALK_BATCH];
+
+/* between cpu_tick_start() and cpu_tick_stop(); the interval itself
+ * is read again at every tick, and 0 stops the ticks */
+static int tick_started;
+
+static void cpu_tick_work_fn(struct work_struct * work);
+static DECLARE_DELAYED_WORK(cpu_tick_work, cpu_tick_work_fn);
+
+
+static inline u64 task_runtime(struct task_struct * task)
+{
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,23)
+	return task->se.sum_exec_runtime;
+#else
+	return (u64)jiffies_to_usecs(task->utime + task->stime) * 1000;
+#endif
+}
+
+
+static struct tick_thread * find_tick_thread(struct task_struct * task, u64 start_ns)
+{
+	struct list_head * bucket = &tick_hash[hash_long(task->pid, TICK_HASH_BITS)];
+	struct tick_thread * thread;
+
+	list_for_each_entry(thread, bucket, list) {
+		if (thread->pid == task->pid && thread->start_ns == start_ns)
+			return thread;
+	}
+
+	thread = kmalloc(sizeof(*thread), GFP_KERNEL);
+	if (!thread)
+		return NULL;
+	thread->pid = task->pid;
+	thread->start_ns = start_ns;
+	/* new threads report everything they used so far, except on the
+	 * first tick which only takes the baseline */
+	thread->utime = 0;
+	thread->stime = 0;
+	thread->runtime = 0;
+	thread->generation = 0;
+	list_add(&thread->list, bucket);
+	return thread;
+}
+
+
+/* Update the thread's times, returns 1 if it ran since the last tick. */
+static int tick_task(struct task_struct * task, struct tick_delta * delta)
+{
+	struct tick_thread * thread = find_tick_thread(task, task_start_ns(task));
+	unsigned long utime = task->utime;
+	unsigned long stime = task->stime;
+	u64 runtime = task_runtime(task);
+	int first = tick_generation == 1;
+	int ran;
+
+	if (!thread)
+		return 0;
+
+	ran = runtime != thread->runtime;
+
+	delta->tgid = task->tgid;
+	delta->pid = task->pid;
+	delta->utime = jiffies_to_usecs(utime - thread->utime);
+	delta->stime = jiffies_to_usecs(stime - thread->stime);
+	delta->runtime = runtime - thread->runtime;
+
+	thread->utime = utime;
+	thread->stime = stime;
+	thread->runtime = runtime;
+	thread->generation = tick_generation;
+
+	return ran && !first;
+}
+
+
+/* CPU_TICK record: tick time, count, then per thread tgid, pid, utime
+ * and stime in usecs and runtime in ns (u64), as in thread info.
+ */
+static void add_tick_record(struct timespec * now, struct tick_delta * deltas, int count)
+{
+	struct node_buffer * nb;
+	int i;
+
+	nb = event_buffer_lock_local();
+	event_buffer_begin_record(nb, RRNOTIFY_CPU_TICK_BEGIN);
+	add_event_entry(nb, now->tv_sec);
+	add_event_entry(nb, now->tv_nsec);
+	add_event_entry(nb, count);
+	for (i = 0; i < count; i++) {
+		add_event_entry(nb, deltas[i].tgid);
+		add_event_entry(nb, deltas[i].pid);
+		add_event_entry(nb, deltas[i].utime);
+		add_event_entry(nb, deltas[i].stime);
+		add_event_u64(nb, deltas[i].runtime);
+	}
+	event_buffer_end_record(nb, RRNOTIFY_CPU_TICK_END);
+	event_buffer_unlock(nb);
+
+	atomic_add(count, &rrnotify_stats.cpu_tick_thread);
+}
+
+
+/* forget threads that weren't seen by this tick */
+static void prune_tick_threads(int all)
+{
+	struct tick_thread * thread;
+	struct tick_thread * tmp;
+	int i;
+
+	for (i = 0; i < TICK_HASH_SIZE; i++) {
+		list_for_each_entry_safe(thread, tmp, &tick_hash[i], list) {
+			if (all || thread->generation != tick_generation) {
+				list_del(&thread->list);
+				kfree(thread);
+			}
+		}
+	}
+}
+
+
+static void cpu_tick(void)
+{
+	struct task_walk walk;
+	struct timespec now;
+	int count, ran, i;
+
+	memset(&walk, 0, sizeof(walk));
+	tick_generation++;
+	rrnotify_get_time(&now);
+
+	while (!walk.done) {
+		count = task_walk_collect(&walk, tick_batch);
+
+		ran = 0;
+		for (i = 0; i < count; i++) {
+			if (tick_task(tick_batch[i], &tick_deltas[ran]))
+				ran++;
+			put_task_struct(tick_batch[i]);
+		}
+
+		if (ran)
+			add_tick_record(&now, tick_deltas, ran);
+
+		cond_resched();
+	}
+
+	prune_tick_threads(0);
+}
+
+
+static void cpu_tick_work_fn(struct work_struct * work)
+{
+	unsigned long interval = READ_ONCE(fs_cpu_tick_interval);
+
+	if (!interval) {
+		/* turned off; if it is turned on again, start with a baseline */
+		prune_tick_threads(1);
+		tick_generation = 0;
+		return;
+	}
+
+	cpu_tick();
+	schedule_delayed_work(&cpu_tick_work, msecs_to_jiffies(interval));
+}
+
+
+int cpu_tick_start(void)
+{
+	int i;
+
+	for (i = 0; i < TICK_HASH_SIZE; i++)
+		INIT_LIST_HEAD(&tick_hash[i]);
+	tick_generation = 0;
+	tick_started = 1;
+
+	cpu_tick_interval_changed();
+	return 0;
+}
+
+
+void cpu_tick_stop(void)
+{
+	if (!tick_started)
+		return;
+
+	tick_started = 0;
+	cancel_delayed_work_sync(&cpu_tick_work);
+	prune_tick_threads(1);
+}
+
+
+/* Called under start_sem, as are start and stop. Does nothing while a
+ * tick is pending, which reads the new interval when it reschedules.
+ */
+void cpu_tick_interval_changed(void)
+{
+	/* baseline right away, deltas from the first interval on */
+	if (tick_started && READ_ONCE(fs_cpu_tick_interval))
+		schedule_delayed_work(&cpu_tick_work, 0);
+}
@@ -0,0 +1,21 @@
+/**
+ * @file cpu_tick.h
+ *
+ * @remark Copyright (C) 2006-2015 RotateRight, LLC
+ * @remark Read the file COPYING
+ */
+
+#ifndef RRNOTIFY_CPU_TICK_H_
+#define RRNOTIFY_CPU_TICK_H_
+
+/* start the periodic cpu time records if cpu_tick_interval is set */
+int cpu_tick_start(void);
+
+/* stop them and forget the threads seen */
+void cpu_tick_stop(void);
+
+/* start the ticks if cpu_tick_interval was set from 0; a change of a
+ * running interval is picked up at the next tick */
+void cpu_tick_interval_changed(void);
+
+#endif /* RRNOTIFY_CPU_TICK_H_ */
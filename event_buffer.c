@@ -10,13 +10,27 @@
  * daemon reads from. The event buffer is an untyped array
  * of unsigned longs. Entries are prefixed by the
  * escape value ESCAPE_CODE followed by an identifying code.
+ *
+ * The buffer is made of one part per NUMA node, allocated on that
+ * node, and a record goes to the part of the node it is written on so
+ * the exit path doesn't write across the interconnect. Each part is a
+ * stream of its own, with its own header, string and build-id
+ * definitions and LOST records; the reader gets them one after the
+ * other. Records of different parts are only ordered by their
+ * sequence numbers. Each part has its own lock and record state, so
+ * writers only contend with others on their node.
  */
 
 #include <linux/vmalloc.h>
+#include <linux/slab.h>
+#include <linux/gfp.h>
+#include <linux/mm.h>
+#include <linux/nodemask.h>
+#include <linux/topology.h>
 #include <linux/sched.h>
 #include <linux/fs.h>
 #include <linux/dcookies.h>
-#include <linux/fs.h>
+#include <linux/uio.h>
 #include <asm/uaccess.h>
 
 /* Only for printk */
@@ -25,90 +39,820 @@
 #include "rrnotify.h"
 #include "event_buffer.h"
 #include "rrnotify_stats.h"
+#include "aggregate.h"
+#include "spool.h"
+#include "buffer_sync.h"
+#include "config.h"
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(3,11,0) \
+	&& (defined(CONFIG_LZ4_COMPRESS) || defined(CONFIG_LZ4_COMPRESS_MODULE))
+#define RR_HAVE_LZ4
+#include <linux/lz4.h>
+#endif
 
-#if LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,37)
-DEFINE_SEMAPHORE(buffer_sem);
+/* splice() reaches the buffer through ->read_iter from 4.11 on */
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4,11,0)
+#define RR_HAVE_SPLICE_READ
+#endif
+
+/* nodes with memory were N_HIGH_MEMORY before 3.8 */
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(3,8,0)
+#define RR_N_MEMORY		N_MEMORY
 #else
-DECLARE_MUTEX(buffer_sem);
+#define RR_N_MEMORY		N_HIGH_MEMORY
 #endif
+
 atomic_t buffer_dump = ATOMIC_INIT(0);
 
 static unsigned long buffer_opened;
 
 static DECLARE_WAIT_QUEUE_HEAD(buffer_wait);
-static unsigned long * event_buffer;
+
+/* With fs_buffer_watershed_adaptive the watershed follows the amount
+ * written between crossing it and the reader getting to the data, so
+ * the headroom covers the bursts the reader actually sees.
+ */
+#define WATERSHED_MIN_DIV	64
+
+/* The part of the buffer on one node. All of it is protected by sem,
+ * which its writers take alone and the readers together with the
+ * other parts' (event_buffer_lock_all()).
+ */
+struct node_buffer {
+	struct semaphore sem;
+	unsigned long * mem;
+	/* mem came from the page allocator rather than vmalloc */
+	int contiguous;
+	/* node the part is for, and the one mem is on if that was full */
+	int node;
+	int mem_node;
+	size_t pos;
+	/* start of the unread data, only moved by splice and the spool */
+	size_t read_pos;
+	unsigned long words_written;
+	/* words_written when the watershed was crossed, if it was since
+	 * the last read */
+	unsigned long watershed_wake_words;
+	int watershed_woken;
+	/* see open_chunk() */
+	int chunk_open;
+	size_t chunk_start;
+	void * chunk_scratch;
+	void * chunk_workmem;
+	/* The record being written, see event_buffer_begin_record() */
+	size_t record_start;
+	int record_overflow;
+	unsigned long record_seq;
+	/* Records dropped since the last LOST record made it into this part */
+	unsigned long lost_count;
+	unsigned long lost_first_seq;
+	struct timespec lost_first_time;
+	struct timespec lost_last_time;
+};
+
+static struct node_buffer node_buffers[EVENT_MAX_BUFFERS];
+static int nr_buffers;
+/* the part each node writes to */
+static int node_buffer[MAX_NUMNODES];
+/* the part a partial read stopped in, which has to be finished first */
+static struct node_buffer * read_partial;
+
+/* size and watershed of each part */
 static unsigned long buffer_size;
 static unsigned long buffer_watershed;
-static size_t buffer_pos;
-/* atomic_t because wait_event checks it outside of buffer_sem */
+/* atomic_t because wait_event checks it outside of the locks */
 static atomic_t buffer_ready = ATOMIC_INIT(0);
 
+/* next sequence number, taken by the parts' writers in turn */
+static atomic_long_t record_seq = ATOMIC_LONG_INIT(0);
+
+/* With fs_buffer_compress each part holds chunks, see RR_CHUNK_MAGIC.
+ * Records are written raw behind the header of the open chunk, which
+ * is compressed in place once it holds CHUNK_BYTES or the reader asks
+ * for the data. Each part has its scratch buffers on its node; they live
+ * as long as the part does.
+ */
+#define CHUNK_BYTES		(64 * 1024)
+/* bigger chunks (one huge record) are stored uncompressed */
+#define CHUNK_MAX_BYTES		(256 * 1024)
+
+static int compress_chunks;
+
 /* Add an entry to the event buffer. When we
  * get near to the end we wake up the process
  * sleeping on the read() of the file.
  */
-void add_event_entry(unsigned long value)
+static void open_chunk(struct node_buffer * nb);
+
+void add_event_entry(struct node_buffer * nb, unsigned long value)
 {
-	if (buffer_pos == buffer_size) {
-		atomic_inc(&rrnotify_stats.event_lost_overflow);
+	if (unlikely(compress_chunks && !nb->chunk_open))
+		open_chunk(nb);
+
+	if (nb->pos == buffer_size) {
+		nb->record_overflow = 1;
 		return;
 	}
 
-	event_buffer[buffer_pos] = value;
-	if (++buffer_pos == buffer_size - buffer_watershed) {
+	nb->mem[nb->pos] = value;
+	nb->words_written++;
+	if (++nb->pos == buffer_size - buffer_watershed) {
+		nb->watershed_wake_words = nb->words_written;
+		nb->watershed_woken = 1;
 		atomic_set(&buffer_ready, 1);
 		wake_up(&buffer_wait);
 	}
 }
 
 
+/* 64-bit values take two entries on 32-bit kernels, low word first */
+void add_event_u64(struct node_buffer * nb, u64 value)
+{
+	add_event_entry(nb, (unsigned long)value);
+#if BITS_PER_LONG == 32
+	add_event_entry(nb, (unsigned long)(value >> 32));
+#endif
+}
+
+
+static void open_chunk(struct node_buffer * nb)
+{
+	if (buffer_size - nb->pos < RR_CHUNK_HEADER_WORDS) {
+		nb->record_overflow = 1;
+		return;
+	}
+
+	nb->chunk_start = nb->pos;
+	memset(nb->mem + nb->pos, 0, RR_CHUNK_HEADER_WORDS * sizeof(unsigned long));
+	nb->pos += RR_CHUNK_HEADER_WORDS;
+	nb->chunk_open = 1;
+}
+
+
+#ifdef RR_HAVE_LZ4
+static size_t compress_chunk(struct node_buffer * nb, void const * src, size_t len)
+{
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4,11,0)
+	return LZ4_compress_default(src, nb->chunk_scratch, len,
+		LZ4_compressBound(CHUNK_MAX_BYTES), nb->chunk_workmem);
+#else
+	size_t out_len = 0;
+
+	if (lz4_compress(src, len, nb->chunk_scratch, &out_len, nb->chunk_workmem))
+		return 0;
+	return out_len;
+#endif
+}
+#endif // RR_HAVE_LZ4
+
+
+/* Fill in the open chunk's header, compressing its data when that
+ * saves space. Called between records with the part locked.
+ */
+static void close_chunk(struct node_buffer * nb)
+{
+	unsigned long * header = nb->mem + nb->chunk_start;
+	size_t raw_bytes;
+	size_t compressed_bytes = 0;
+
+	if (!nb->chunk_open)
+		return;
+	nb->chunk_open = 0;
+
+	raw_bytes = (nb->pos - nb->chunk_start - RR_CHUNK_HEADER_WORDS) * sizeof(unsigned long);
+	if (!raw_bytes) {
+		nb->pos = nb->chunk_start;
+		return;
+	}
+
+#ifdef RR_HAVE_LZ4
+	if (raw_bytes <= CHUNK_MAX_BYTES)
+		compressed_bytes = compress_chunk(nb, header + RR_CHUNK_HEADER_WORDS, raw_bytes);
+#endif
+	if (compressed_bytes && compressed_bytes < raw_bytes) {
+		memcpy(header + RR_CHUNK_HEADER_WORDS, nb->chunk_scratch, compressed_bytes);
+		nb->pos = nb->chunk_start + RR_CHUNK_HEADER_WORDS
+			+ DIV_ROUND_UP(compressed_bytes, sizeof(unsigned long));
+		atomic_inc(&rrnotify_stats.chunk_compressed);
+	} else {
+		compressed_bytes = 0;
+		atomic_inc(&rrnotify_stats.chunk_stored);
+	}
+
+	header[0] = RR_CHUNK_MAGIC;
+	header[1] = raw_bytes;
+	header[2] = compressed_bytes;
+}
+
+
+static void close_chunks(void)
+{
+	int i;
+
+	for (i = 0; i < nr_buffers; i++)
+		close_chunk(&node_buffers[i]);
+}
+
+
+static void add_lost_record(struct node_buffer * nb)
+{
+	if (compress_chunks && !nb->chunk_open)
+		open_chunk(nb);
+
+	nb->record_start = nb->pos;
+	nb->record_overflow = 0;
+
+	add_event_entry(nb, RR_ESCAPE_CODE);
+	add_event_entry(nb, RRNOTIFY_LOST_BEGIN);
+	add_event_entry(nb, nb->lost_count);
+	add_event_entry(nb, nb->lost_first_seq);
+	add_event_entry(nb, nb->lost_first_time.tv_sec);
+	add_event_entry(nb, nb->lost_first_time.tv_nsec);
+	add_event_entry(nb, nb->lost_last_time.tv_sec);
+	add_event_entry(nb, nb->lost_last_time.tv_nsec);
+	add_event_entry(nb, RR_ESCAPE_CODE);
+	add_event_entry(nb, RRNOTIFY_LOST_END);
+
+	if (nb->record_overflow) {
+		nb->pos = nb->record_start;
+		return;
+	}
+	nb->lost_count = 0;
+}
+
+
+/* node whose memory the calling CPU allocates from */
+static int local_mem_node(void)
+{
+	int cpu = get_cpu();
+	int node;
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,35)
+	node = cpu_to_mem(cpu);
+#else
+	node = cpu_to_node(cpu);
+#endif
+	put_cpu();
+	return node;
+}
+
+
+int event_buffer_count(void)
+{
+	return nr_buffers;
+}
+
+
+int event_buffer_local(void)
+{
+	return node_buffer[local_mem_node()];
+}
+
+
+int event_buffer_index(struct node_buffer const * nb)
+{
+	return nb - node_buffers;
+}
+
+
+struct node_buffer * event_buffer_lock(int buffer)
+{
+	struct node_buffer * nb = &node_buffers[buffer];
+
+	down(&nb->sem);
+	return nb;
+}
+
+
+struct node_buffer * event_buffer_lock_local(void)
+{
+	return event_buffer_lock(event_buffer_local());
+}
+
+
+void event_buffer_unlock(struct node_buffer * nb)
+{
+	up(&nb->sem);
+}
+
+
+/* All of EVENT_MAX_BUFFERS, so that the parts locked don't depend on
+ * nr_buffers.
+ */
+void event_buffer_lock_all(void)
+{
+	int i;
+
+	for (i = 0; i < EVENT_MAX_BUFFERS; i++)
+		down(&node_buffers[i].sem);
+}
+
+
+void event_buffer_unlock_all(void)
+{
+	int i;
+
+	for (i = EVENT_MAX_BUFFERS - 1; i >= 0; i--)
+		up(&node_buffers[i].sem);
+}
+
+
+struct node_buffer * event_buffer_part(int buffer)
+{
+	return &node_buffers[buffer];
+}
+
+
+/* Start a record in a locked part: the escaped begin code followed by
+ * the record's sequence number, which is returned. A LOST record for
+ * anything dropped earlier goes first, as soon as there is room for it.
+ */
+unsigned long event_buffer_begin_record(struct node_buffer * nb, int code)
+{
+	if (nb->mem_node == local_mem_node())
+		rrnotify_cpu_stat_inc(buffer_write_local);
+	else
+		rrnotify_cpu_stat_inc(buffer_write_remote);
+
+	if (nb->lost_count)
+		add_lost_record(nb);
+
+	if (compress_chunks && !nb->chunk_open)
+		open_chunk(nb);
+
+	nb->record_start = nb->pos;
+	nb->record_overflow = 0;
+	nb->record_seq = atomic_long_inc_return(&record_seq) - 1;
+
+	add_event_entry(nb, RR_ESCAPE_CODE);
+	add_event_entry(nb, code);
+	add_event_entry(nb, nb->record_seq);
+	return nb->record_seq;
+}
+
+
+/* Finish a record. If it didn't fit, it is removed from the part as a
+ * whole and accounted for in the next LOST record; returns -ENOSPC.
+ */
+int event_buffer_end_record(struct node_buffer * nb, int code)
+{
+	add_event_entry(nb, RR_ESCAPE_CODE);
+	add_event_entry(nb, code);
+
+	if (!nb->record_overflow) {
+		if (nb->chunk_open && (nb->pos - nb->chunk_start) * sizeof(unsigned long) >= CHUNK_BYTES)
+			close_chunk(nb);
+		return 0;
+	}
+
+	nb->pos = nb->record_start;
+	nb->record_overflow = 0;
+
+	atomic_inc(&rrnotify_stats.event_lost_overflow);
+	rrnotify_cpu_stat_inc(event_lost_overflow);
+
+	rrnotify_get_time(&nb->lost_last_time);
+	if (!nb->lost_count++) {
+		nb->lost_first_seq = nb->record_seq;
+		nb->lost_first_time = nb->lost_last_time;
+	}
+	return -ENOSPC;
+}
+
+
 /* Wake up the waiting process if any. This happens
  * on "echo 0 >/dev/oprofile/enable" so the daemon
  * processes the data remaining in the event buffer.
  */
 void wake_up_buffer_waiter(void)
 {
-	down(&buffer_sem);
+	event_buffer_lock_all();
 	atomic_set(&buffer_ready, 1);
 	atomic_set(&buffer_dump, 1);
 	wake_up(&buffer_wait);
-	up(&buffer_sem);
+	event_buffer_unlock_all();
+}
+
+
+/* Wake the reader without ending the session, for data that trickles
+ * in below the watershed.
+ */
+void wake_up_buffer_reader(void)
+{
+	atomic_set(&buffer_ready, 1);
+	wake_up(&buffer_wait);
 }
 
 
 void init_event_buffer(void)
 {
-#if LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,37)
-	sema_init(&buffer_sem, 1);
+	int i;
+
+	for (i = 0; i < EVENT_MAX_BUFFERS; i++)
+		sema_init(&node_buffers[i].sem, 1);
+}
+
+/* Prefer physically contiguous pages: they sit in the kernel's linear
+ * mapping, which is mapped with huge pages where the architecture allows,
+ * so the write path doesn't walk a TLB entry per 4 KB page the way a
+ * vmalloc area does. Fall back to vmalloc when no such block is free.
+ * Either comes from another node if the given one is out of memory.
+ */
+static unsigned long * alloc_buffer_mem(unsigned long size, int node, int * contiguous)
+{
+	unsigned long bytes = sizeof(unsigned long) * size;
+	unsigned int order = get_order(bytes);
+	unsigned long * mem = NULL;
+	struct page * page = NULL;
+
+	if (order < MAX_ORDER) {
+		page = alloc_pages_node(node, GFP_KERNEL | __GFP_NOWARN | __GFP_NORETRY, order);
+	}
+	if (page) {
+		*contiguous = 1;
+		return page_address(page);
+	}
+
+	*contiguous = 0;
+	mem = vmalloc_node(bytes, node);
+	if (!mem) {
+		printk(KERN_ERR "rrnotify: failed to allocate event buffer (%ld bytes on node %d)\n",
+			bytes, node);
+	}
+	return mem;
+}
+
+static void free_buffer_mem(unsigned long * mem, unsigned long size, int contiguous)
+{
+	if (!mem)
+		return;
+	if (contiguous)
+		free_pages((unsigned long)mem, get_order(sizeof(unsigned long) * size));
+	else
+		vfree(mem);
+}
+
+/* a vmalloc area may be spread over nodes, go by its first page */
+static int buffer_mem_node(unsigned long * mem, int contiguous)
+{
+	if (contiguous)
+		return page_to_nid(virt_to_page(mem));
+	return page_to_nid(vmalloc_to_page(mem));
+}
+
+static void free_chunk_scratch(void)
+{
+	int i;
+
+	for (i = 0; i < nr_buffers; i++) {
+		struct node_buffer * nb = &node_buffers[i];
+
+		vfree(nb->chunk_scratch);
+		vfree(nb->chunk_workmem);
+		nb->chunk_scratch = NULL;
+		nb->chunk_workmem = NULL;
+	}
+}
+
+
+static int alloc_chunk_scratch(void)
+{
+#ifdef RR_HAVE_LZ4
+	int i;
+
+	for (i = 0; i < nr_buffers; i++) {
+		struct node_buffer * nb = &node_buffers[i];
+
+		if (nb->chunk_scratch)
+			continue;
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4,11,0)
+		nb->chunk_scratch = vmalloc_node(LZ4_compressBound(CHUNK_MAX_BYTES), nb->node);
+#else
+		nb->chunk_scratch = vmalloc_node(lz4_compressbound(CHUNK_MAX_BYTES), nb->node);
+#endif
+		nb->chunk_workmem = vmalloc_node(LZ4_MEM_COMPRESS, nb->node);
+		if (!nb->chunk_scratch || !nb->chunk_workmem) {
+			free_chunk_scratch();
+			return -ENOMEM;
+		}
+	}
+	return 0;
+#else
+	printk(KERN_WARNING "rrnotify: buffer compression is not supported by this kernel\n");
+	return -EOPNOTSUPP;
 #endif
 }
- 
+
+
+/* Give each node with memory a part of its own, up to
+ * EVENT_MAX_BUFFERS; past that nodes share. CPUs of memoryless nodes
+ * write to the part of the node they allocate from. Returns the number
+ * of parts and their nodes.
+ */
+static int map_node_buffers(int * nodes)
+{
+	int node, nr = 0;
+
+	memset(node_buffer, 0, sizeof(node_buffer));
+	for_each_node_state(node, RR_N_MEMORY) {
+		if (nr < EVENT_MAX_BUFFERS)
+			nodes[nr] = node;
+		node_buffer[node] = nr % EVENT_MAX_BUFFERS;
+		nr++;
+	}
+	if (!nr)
+		nodes[nr++] = 0;
+	return min(nr, EVENT_MAX_BUFFERS);
+}
+
+
+/* buffer_size and buffer_watershed are split evenly between the parts,
+ * so the memory used and the size of a read that takes everything
+ * don't change with the number of nodes. A node's share is all it gets:
+ * a busy node loses records once its part is full even while the
+ * others have room.
+ */
+static int split_buffer_size(unsigned long * size, unsigned long * watershed, int nr)
+{
+	*size /= nr;
+	*watershed /= nr;
+	return *watershed < *size ? 0 : -EINVAL;
+}
+
+
+static int same_nodes(int const * nodes, int nr)
+{
+	int i;
+
+	if (nr != nr_buffers)
+		return 0;
+	for (i = 0; i < nr; i++) {
+		if (node_buffers[i].node != nodes[i])
+			return 0;
+	}
+	return 1;
+}
+
+
+static void reset_node_buffer(struct node_buffer * nb)
+{
+	nb->pos = 0;
+	nb->read_pos = 0;
+	nb->chunk_open = 0;
+	nb->watershed_woken = 0;
+	nb->lost_count = 0;
+}
+
+
+/* The buffer is kept across sessions so that reopening doesn't pay
+ * for a new allocation; it is only replaced when buffer_size or the
+ * nodes with memory changed.
+ */
 int alloc_event_buffer(void)
 {
+	unsigned long size, watershed, compress;
+	int nodes[EVENT_MAX_BUFFERS];
+	int i, nr, err;
+
 	spin_lock(&rrnotifyfs_lock);
-	buffer_size = fs_buffer_size;
-	buffer_watershed = fs_buffer_watershed;
+	size = fs_buffer_size;
+	watershed = fs_buffer_watershed;
+	compress = fs_buffer_compress;
 	spin_unlock(&rrnotifyfs_lock);
  
-	if (buffer_watershed >= buffer_size)
+	if (watershed >= size)
 		return -EINVAL;
- 
-	event_buffer = vmalloc(sizeof(unsigned long) * buffer_size);
-	if (!event_buffer) {
-		printk(KERN_ERR "rrnotify: failed to allocate event buffer (%ld bytes)\n", sizeof(unsigned long) * buffer_size);
-		return -ENOMEM;
+
+	nr = map_node_buffers(nodes);
+	if ((err = split_buffer_size(&size, &watershed, nr)))
+		return err;
+
+	if (nr_buffers && (size != buffer_size || !same_nodes(nodes, nr))) {
+		destroy_event_buffer();
+	}
+
+	if (!nr_buffers) {
+		buffer_size = size;
+		for (i = 0; i < nr; i++) {
+			struct node_buffer * nb = &node_buffers[i];
+
+			nb->node = nodes[i];
+			nb->mem = alloc_buffer_mem(size, nodes[i], &nb->contiguous);
+			if (!nb->mem) {
+				nr_buffers = i;
+				destroy_event_buffer();
+				return -ENOMEM;
+			}
+			nb->mem_node = buffer_mem_node(nb->mem, nb->contiguous);
+		}
+		nr_buffers = nr;
 	}
 
+	/* after the pool, which takes the scratch buffers with it */
+	if (compress && (err = alloc_chunk_scratch()))
+		return err;
+
+	buffer_watershed = watershed;
+	for (i = 0; i < nr_buffers; i++)
+		reset_node_buffer(&node_buffers[i]);
+	read_partial = NULL;
+	atomic_long_set(&record_seq, 0);
+	compress_chunks = compress != 0;
+	atomic_set(&rrnotify_stats.watershed_current, watershed * nr_buffers);
+
 	return 0;
 }
 
 
+/* Return the buffer to the pool at the end of a session. */
 void free_event_buffer(void)
 {
-	vfree(event_buffer);
+	int i;
+
+	for (i = 0; i < nr_buffers; i++) {
+		node_buffers[i].pos = 0;
+		node_buffers[i].read_pos = 0;
+		node_buffers[i].chunk_open = 0;
+	}
+	read_partial = NULL;
+	atomic_set(&buffer_ready, 0);
+}
+
+
+void destroy_event_buffer(void)
+{
+	int i;
+
+	free_chunk_scratch();
+	for (i = 0; i < nr_buffers; i++) {
+		free_buffer_mem(node_buffers[i].mem, buffer_size, node_buffers[i].contiguous);
+		node_buffers[i].mem = NULL;
+	}
+	nr_buffers = 0;
+	read_partial = NULL;
+	compress_chunks = 0;
+}
+
+
+/* Called with every part locked. */
+static void set_watershed(unsigned long watershed)
+{
+	int i;
+
+	buffer_watershed = watershed;
+	atomic_set(&rrnotify_stats.watershed_current, watershed * nr_buffers);
+
+	/* add_event_entry() only wakes the reader when it crosses the
+	 * watershed; we may have moved it behind a part's pos.
+	 */
+	for (i = 0; i < nr_buffers; i++) {
+		if (node_buffers[i].pos >= buffer_size - buffer_watershed) {
+			atomic_set(&buffer_ready, 1);
+			wake_up(&buffer_wait);
+			break;
+		}
+	}
+}
+
+
+/* Called by the readers with every part locked. What was written since
+ * the watershed was crossed is the burst the headroom had to absorb
+ * while the reader was being scheduled. Keep twice that, growing at
+ * once and shrinking slowly, and double it after losing records. The
+ * parts share one watershed, sized for the busiest of them.
+ */
+static void adapt_watershed(void)
+{
+	unsigned long burst = 0, target, watershed;
+	int adaptive, woken = 0, lost = 0;
+	int i;
+
+	rcu_read_lock();
+	adaptive = rcu_dereference(rrnotify_config)->watershed_adaptive != 0;
+	rcu_read_unlock();
+
+	if (!adaptive)
+		return;
+
+	for (i = 0; i < nr_buffers; i++) {
+		struct node_buffer * nb = &node_buffers[i];
+
+		if (nb->lost_count)
+			lost = 1;
+		if (!nb->watershed_woken)
+			continue;
+		nb->watershed_woken = 0;
+		woken = 1;
+		burst = max(burst, nb->words_written - nb->watershed_wake_words);
+	}
+	if (!woken)
+		return;
+
+	target = lost ? buffer_watershed * 2 : burst * 2;
+	target = clamp(target, buffer_size / WATERSHED_MIN_DIV, buffer_size / 2);
+
+	watershed = buffer_watershed;
+	if (target > watershed)
+		watershed = target;
+	else
+		watershed -= (watershed - target) / 8;
+
+	if (watershed != buffer_watershed) {
+		atomic_inc(&rrnotify_stats.watershed_adjust);
+		set_watershed(watershed);
+	}
+}
+
+
+/* Resize the buffer of a running session. The records not read yet are
+ * carried over; shrinking a part below them fails with -EBUSY until the
+ * reader has drained it.
+ */
+int event_buffer_resize(unsigned long size, unsigned long watershed)
+{
+	struct {
+		unsigned long * mem;
+		int contiguous;
+	} * mems = NULL;
+	unsigned long mems_size;
+	int i, err;
+
+	if (watershed >= size)
+		return -EINVAL;
+	if ((err = split_buffer_size(&size, &watershed, nr_buffers)))
+		return err;
+	mems_size = size;
+
+	if (size != buffer_size) {
+		mems = kcalloc(nr_buffers, sizeof(*mems), GFP_KERNEL);
+		if (!mems)
+			return -ENOMEM;
+		for (i = 0; i < nr_buffers; i++) {
+			mems[i].mem = alloc_buffer_mem(size, node_buffers[i].node, &mems[i].contiguous);
+			if (!mems[i].mem) {
+				err = -ENOMEM;
+				goto out;
+			}
+		}
+	}
+
+	event_buffer_lock_all();
+
+	if (mems) {
+		for (i = 0; i < nr_buffers; i++) {
+			if (node_buffers[i].pos > size) {
+				event_buffer_unlock_all();
+				err = -EBUSY;
+				goto out;
+			}
+		}
+
+		/* swap, leaving the old memory in mems to be freed */
+		for (i = 0; i < nr_buffers; i++) {
+			struct node_buffer * nb = &node_buffers[i];
+			unsigned long * mem = mems[i].mem;
+			int contiguous = mems[i].contiguous;
+
+			memcpy(mem, nb->mem, nb->pos * sizeof(unsigned long));
+			mems[i].mem = nb->mem;
+			mems[i].contiguous = nb->contiguous;
+			nb->mem = mem;
+			nb->contiguous = contiguous;
+			nb->mem_node = buffer_mem_node(mem, contiguous);
+		}
+		mems_size = buffer_size;
+		buffer_size = size;
+	}
+	set_watershed(watershed);
+
+	event_buffer_unlock_all();
+	err = 0;
+
+out:
+	if (mems) {
+		for (i = 0; i < nr_buffers; i++)
+			free_buffer_mem(mems[i].mem, mems_size, mems[i].contiguous);
+		kfree(mems);
+	}
+	return err;
 }
 
  
+int event_buffer_reader_attached(void)
+{
+	return test_bit(0, &buffer_opened);
+}
+
+
+/* Opened without read access, the file only takes markers and leaves
+ * the session alone.
+ */
+static inline int is_marker_writer(struct file * file)
+{
+	return !(file->f_mode & FMODE_READ);
+}
+
+
 static int event_buffer_open(struct inode * inode, struct file * file)
 {	
 	int err = -EPERM;
@@ -116,8 +860,16 @@ static int event_buffer_open(struct inode * inode, struct file * file)
 	if (!capable(CAP_SYS_ADMIN))
 		return -EPERM;
 
+	if (is_marker_writer(file)) {
+		file->private_data = NULL;
+		return 0;
+	}
+
+	spool_lock();
+
+	err = -EBUSY;
 	if (test_and_set_bit(0, &buffer_opened))
-		return -EBUSY;
+		goto busy;
 
 	/* Register as a user of dcookies
 	 * to ensure they persist for the lifetime of
@@ -127,6 +879,12 @@ static int event_buffer_open(struct inode * inode, struct file * file)
 	file->private_data = dcookie_register();
 	if (!file->private_data)
 		goto out;
+
+	/* take over a session the spool thread was draining */
+	if (spool_suspend()) {
+		spool_unlock();
+		return 0;
+	}
 		
 	if ((err = rrnotify_setup())) {
 		goto fail;
@@ -136,6 +894,7 @@ static int event_buffer_open(struct inode * inode, struct file * file)
 	 * echo 1 >/dev/oprofile/enable
 	 */
  
+	spool_unlock();
 	return 0;
 
 fail:
@@ -143,31 +902,99 @@ fail:
 
 out:
 	clear_bit(0, &buffer_opened);
+busy:
+	spool_unlock();
 	return err;
 }
 
 
 static int event_buffer_release(struct inode * inode, struct file * file)
 {
-	rrnotify_stop();
-	rrnotify_shutdown();
+	if (is_marker_writer(file))
+		return 0;
+
+	spool_lock();
+
+	/* with spooling on, capture carries on without a reader */
+	if (!spool_resume()) {
+		rrnotify_stop();
+		rrnotify_shutdown();
+	}
+
 	dcookie_unregister(file->private_data);
-	buffer_pos = 0;
-	atomic_set(&buffer_ready, 0);
 	clear_bit(0, &buffer_opened);
+
+	spool_unlock();
 	return 0;
 }
 
 
-static ssize_t event_buffer_read(struct file * file, char __user * buf,
-				 size_t count, loff_t * offset)
+static inline size_t pending_words(struct node_buffer const * nb)
 {
-	int retval = -EINVAL;
-	size_t const max = buffer_size * sizeof(unsigned long);
+	return nb->pos - nb->read_pos;
+}
 
-	/* handling partial reads is more trouble than it's worth */
-	if (count != max || *offset)
-		return -EINVAL;
+
+/* Clear buffer_ready once every part is drained, or the waits on it
+ * would return at once from then on. Called with every part locked.
+ */
+static void update_buffer_ready(void)
+{
+	int i;
+
+	for (i = 0; i < nr_buffers; i++) {
+		if (pending_words(&node_buffers[i]))
+			return;
+	}
+	atomic_set(&buffer_ready, 0);
+}
+
+
+/* The parts are handed out one after the other, starting with the rest
+ * of one a partial read stopped in, else with the reader's own node's
+ * part. Returns the index of the first.
+ */
+static int first_to_read(void)
+{
+	if (read_partial)
+		return read_partial - node_buffers;
+	return event_buffer_local();
+}
+
+
+/* Mark words at a part's read cursor as read. Called with every part
+ * locked.
+ */
+static void consume_buffer(struct node_buffer * nb, size_t words)
+{
+	nb->read_pos += words;
+
+	if (nb->read_pos == nb->pos) {
+		nb->pos = 0;
+		nb->read_pos = 0;
+		if (read_partial == nb)
+			read_partial = NULL;
+	} else {
+		/* the next read has to go on with the rest of it */
+		read_partial = nb;
+		if (nb->pos - nb->read_pos <= nb->read_pos) {
+			/* compact once the remainder is no bigger than what
+			 * was consumed, so each entry moves at most once on
+			 * average */
+			memmove(nb->mem, nb->mem + nb->read_pos,
+				(nb->pos - nb->read_pos) * sizeof(unsigned long));
+			nb->pos -= nb->read_pos;
+			nb->read_pos = 0;
+		}
+	}
+}
+
+
+/* Block until the buffer is worth reading. */
+static int wait_for_buffer(void)
+{
+	/* summaries are flushed on read as well as on the timer */
+	aggregate_flush();
 
 	if (!atomic_read(&buffer_dump)) {	
 		wait_event_interruptible(buffer_wait, atomic_read(&buffer_ready));
@@ -180,34 +1007,251 @@ static ssize_t event_buffer_read(struct file * file, char __user * buf,
 	if (!atomic_read(&buffer_ready))
 		return -EAGAIN;
 
-	down(&buffer_sem);
+	return 0;
+}
+
+
+static ssize_t event_buffer_read(struct file * file, char __user * buf,
+				 size_t count, loff_t * offset)
+{
+	int retval = -EINVAL;
+	size_t pending = 0;
+	int i, first;
+
+	if (*offset)
+		return -EINVAL;
+
+	if ((retval = wait_for_buffer()))
+		return retval;
+
+	retval = -EINVAL;
+
+	event_buffer_lock_all();
+
+	adapt_watershed();
+	close_chunks();
+
+	/* handling partial reads is more trouble than it's worth. The
+	 * buffer may have been resized since the reader sized its read,
+	 * so only insist that everything pending fits.
+	 */
+	for (i = 0; i < nr_buffers; i++)
+		pending += pending_words(&node_buffers[i]) * sizeof(unsigned long);
+	if (count < pending)
+		goto out;
 
 	atomic_set(&buffer_ready, 0);
 
 	retval = -EFAULT;
 
-	count = buffer_pos * sizeof(unsigned long);
- 
-	if (copy_to_user(buf, event_buffer, count))
-		goto out;
+	count = 0;
+	first = first_to_read();
+	for (i = 0; i < nr_buffers; i++) {
+		struct node_buffer * nb = &node_buffers[(first + i) % nr_buffers];
+		size_t bytes = pending_words(nb) * sizeof(unsigned long);
+
+		if (copy_to_user(buf + count, nb->mem + nb->read_pos, bytes))
+			goto out;
+		count += bytes;
+	}
 
 	retval = count;
-	buffer_pos = 0;
+	for (i = 0; i < nr_buffers; i++) {
+		node_buffers[i].pos = 0;
+		node_buffers[i].read_pos = 0;
+	}
+	read_partial = NULL;
  
 out:
-	up(&buffer_sem);
+	event_buffer_unlock_all();
 	return retval;
 }
 
+
+#ifdef RR_HAVE_SPLICE_READ
+/* Only used by splice(): the data goes straight from the event buffer
+ * into the pipe's pages. A pipe holds less than the buffer, so unlike
+ * read() this drains whatever fits and leaves the rest for the next
+ * call.
+ */
+static ssize_t event_buffer_read_iter(struct kiocb * iocb, struct iov_iter * to)
+{
+	size_t pending, count, copied = 0, done;
+	int retval, i, first;
+
+	if ((retval = wait_for_buffer()))
+		return retval;
+
+	event_buffer_lock_all();
+
+	adapt_watershed();
+	close_chunks();
+
+	first = first_to_read();
+	for (i = 0; i < nr_buffers; i++) {
+		struct node_buffer * nb = &node_buffers[(first + i) % nr_buffers];
+
+		pending = pending_words(nb) * sizeof(unsigned long);
+		if (!pending)
+			continue;
+		count = min(pending, iov_iter_count(to));
+		count -= count % sizeof(unsigned long);
+
+		done = copy_to_iter(nb->mem + nb->read_pos, count, to);
+		consume_buffer(nb, done / sizeof(unsigned long));
+		copied += done;
+		if (done < pending)
+			break;
+	}
+	update_buffer_ready();
+
+	event_buffer_unlock_all();
+	return copied;
+}
+#endif // RR_HAVE_SPLICE_READ
+
+/* Wait for the watershed, a dump or the timeout, for the spool thread. */
+void event_buffer_wait_timeout(long timeout)
+{
+	aggregate_flush();
+	wait_event_interruptible_timeout(buffer_wait, atomic_read(&buffer_ready), timeout);
+}
+
+
+/* Copy out up to max bytes of pending data, for the spool thread. With
+ * *restart set, the stream is started over behind the data copied if
+ * that was all of it, see sync_restart_stream(); otherwise *restart is
+ * cleared.
+ */
+size_t event_buffer_drain(void * dst, size_t max, int * restart)
+{
+	size_t pending, count, copied = 0;
+	int i, first;
+
+	event_buffer_lock_all();
+
+	adapt_watershed();
+	close_chunks();
+
+	first = first_to_read();
+	for (i = 0; i < nr_buffers; i++) {
+		struct node_buffer * nb = &node_buffers[(first + i) % nr_buffers];
+
+		pending = pending_words(nb) * sizeof(unsigned long);
+		if (!pending)
+			continue;
+		count = min(pending, max - copied);
+		count -= count % sizeof(unsigned long);
+
+		memcpy((char *)dst + copied, nb->mem + nb->read_pos, count);
+		consume_buffer(nb, count / sizeof(unsigned long));
+		copied += count;
+		if (count < pending)
+			break;
+	}
+	update_buffer_ready();
+
+	if (*restart) {
+		for (i = 0; i < nr_buffers; i++) {
+			if (pending_words(&node_buffers[i]))
+				*restart = 0;
+		}
+		if (*restart)
+			sync_restart_stream();
+	}
+
+	event_buffer_unlock_all();
+	return copied;
+}
+
+
+/* The data left belongs to a consumer that went away, and refers to
+ * the strings and build-ids defined in what it read.
+ */
+void event_buffer_restart(void)
+{
+	int i;
+
+	event_buffer_lock_all();
+	for (i = 0; i < nr_buffers; i++) {
+		node_buffers[i].pos = 0;
+		node_buffers[i].read_pos = 0;
+		node_buffers[i].chunk_open = 0;
+	}
+	read_partial = NULL;
+	atomic_set(&buffer_ready, 0);
+	sync_restart_stream();
+	event_buffer_unlock_all();
+}
+
+
+/* size of the buffer in use, in bytes */
+size_t event_buffer_bytes(void)
+{
+	return buffer_size * nr_buffers * sizeof(unsigned long);
+}
+
 static ssize_t event_buffer_write(struct file * file, char const __user * buf, size_t count, loff_t * offset)
 {
+	struct rrnotify_marker marker;
+	int err;
+
+	if (count == sizeof(marker)) {
+		if (copy_from_user(&marker, buf, sizeof(marker)))
+			return -EFAULT;
+		if (marker.magic == RRNOTIFY_MARKER_MAGIC) {
+			if ((err = rrnotify_marker(&marker)))
+				return err;
+			return count;
+		}
+	}
+
+	if (is_marker_writer(file))
+		return -EINVAL;
+
 	wake_up_buffer_waiter();
 	return count;
 }
  
+static long event_buffer_ioctl(struct file * file, unsigned int cmd, unsigned long arg)
+{
+	struct rrnotify_query query;
+	void __user * argp = (void __user *)arg;
+	int err;
+
+	if (cmd != RRNOTIFY_IOC_QUERY)
+		return -ENOTTY;
+
+	/* the module list cookies are only good to the dcookie user, which
+	 * a marker writer isn't */
+	if (is_marker_writer(file))
+		return -EBADF;
+
+	if (copy_from_user(&query, argp, sizeof(query)))
+		return -EFAULT;
+
+	if ((err = sync_query(&query)))
+		return err;
+
+	if (copy_to_user(argp, &query, sizeof(query)))
+		return -EFAULT;
+
+	return 0;
+}
+
+
 struct file_operations event_buffer_fops = {
 	.open		= event_buffer_open,
 	.release	= event_buffer_release,
 	.read		= event_buffer_read,
 	.write		= event_buffer_write,
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,11)
+	/* no compat_ioctl: results are in the kernel's word size, which a
+	 * 32-bit caller couldn't decode */
+	.unlocked_ioctl	= event_buffer_ioctl,
+#endif // >= 2.6.11
+#ifdef RR_HAVE_SPLICE_READ
+	.read_iter	= event_buffer_read_iter,
+	.splice_read	= generic_file_splice_read,
+#endif // RR_HAVE_SPLICE_READ
 };
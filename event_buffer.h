@@ -11,6 +11,7 @@
 #define EVENT_BUFFER_H
 #include <linux/version.h>
 #include <linux/types.h> 
+#include <linux/ioctl.h>
 #if LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,26)
 #include <linux/semaphore.h>
 #else
@@ -23,12 +24,33 @@ int alloc_event_buffer(void);
 
 void free_event_buffer(void);
 
+/* release the pooled buffer memory */
+void destroy_event_buffer(void);
+
+/* change the size and watershed of the buffer in use */
+int event_buffer_resize(unsigned long size, unsigned long watershed);
+
+/* is the buffer file open */
+int event_buffer_reader_attached(void);
+
+/* kernel side draining for the spool thread */
+void event_buffer_wait_timeout(long timeout);
+size_t event_buffer_drain(void * dst, size_t max, int * restart);
+/* drop what is left and start the stream over for a new consumer */
+void event_buffer_restart(void);
+size_t event_buffer_bytes(void);
+
 /* wake up the process sleeping on the event file */
 void wake_up_buffer_waiter(void);
 
+/* wake up the reader but keep the session going */
+void wake_up_buffer_reader(void);
+
 /* Each escaped entry is prefixed by ESCAPE_CODE
  * then one of the following codes, then the
- * relevant data.
+ * relevant data. Every top level *_BEGIN code except
+ * the header and LOST is followed by the record's
+ * sequence number.
  */
 #define RR_ESCAPE_CODE			~0UL
 
@@ -38,21 +60,175 @@ typedef enum {
 	RRNOTIFY_THREAD_INFO_END	=3,
 	RRNOTIFY_MODULE_LIST_BEGIN	=4,
 	RRNOTIFY_MODULE_LIST_END	=5,
-	RRNOTIFY_RECORD_END			=6
+	RRNOTIFY_RECORD_END			=6,
+	/* optional address-space events, see fs_event_mask */
+	RRNOTIFY_EXEC_BEGIN			=7,	/* tgid, pid, module list */
+	RRNOTIFY_EXEC_END			=8,
+	RRNOTIFY_FORK_BEGIN			=9,	/* tgid, pid, child tgid, child pid */
+	RRNOTIFY_FORK_END			=10,
+	RRNOTIFY_MMAP_BEGIN			=11,	/* tgid, pid, module list of one entry */
+	RRNOTIFY_MMAP_END			=12,
+	RRNOTIFY_MUNMAP_BEGIN		=13,	/* tgid, pid, address */
+	RRNOTIFY_MUNMAP_END			=14,
+	/* format version, record_fields, event_mask, sample period,
+	 * module_options */
+	RRNOTIFY_HEADER_BEGIN		=15,
+	RRNOTIFY_HEADER_END			=16,
+	/* records dropped on overflow: count, first lost sequence number,
+	 * time of the first and last loss (sec, nsec each) */
+	RRNOTIFY_LOST_BEGIN			=17,
+	RRNOTIFY_LOST_END			=18,
+	/* aggregate_mode summaries: mode, key (RR_AGGREGATE_KEY_WORDS),
+	 * window start and end (sec, nsec each), exit count, then utime,
+	 * stime and summed lifetime in usecs (u64 each) */
+	RRNOTIFY_AGGREGATE_BEGIN	=19,
+	RRNOTIFY_AGGREGATE_END		=20,
+	/* module_options BUILD_ID: written after a module list for files
+	 * not reported yet this session: cookie, id length in bytes (0 if
+	 * the file has none), then the id packed into entries */
+	RRNOTIFY_BUILD_ID_BEGIN		=21,
+	RRNOTIFY_BUILD_ID_END		=22,
+	/* a live thread, written on request to the snapshot file; same
+	 * layout as RECORD, with the end time being the snapshot time */
+	RRNOTIFY_SNAPSHOT_BEGIN		=23,
+	RRNOTIFY_SNAPSHOT_END		=24,
+	/* only in RRNOTIFY_IOC_QUERY output: pid, 0 or ESRCH, then if
+	 * found the thread info and module list as asked for */
+	RRNOTIFY_QUERY_BEGIN		=25,
+	RRNOTIFY_QUERY_END			=26,
+	/* cpu_tick_interval: time of the tick (sec, nsec), count, then
+	 * for each thread that ran since the previous tick: tgid, pid,
+	 * utime and stime in usecs, runtime in ns (u64) used since then */
+	RRNOTIFY_CPU_TICK_BEGIN		=27,
+	RRNOTIFY_CPU_TICK_END		=28,
+	/* the rest of a module list with RR_MODULES_CONTINUED set:
+	 * sequence number of the record it continues, tgid, pid, then
+	 * the next module list block */
+	RRNOTIFY_MODULE_CONT_BEGIN	=29,
+	RRNOTIFY_MODULE_CONT_END	=30,
+	/* record_fields COMM and ARGV: written in a record before the
+	 * thread info for strings it is the first to use: id, length in
+	 * bytes, then the bytes packed into entries. The thread info then
+	 * has the id, 0 if there is no string. Query results define their
+	 * strings each time, with ids of their own. */
+	RRNOTIFY_STRING_BEGIN		=31,
+	RRNOTIFY_STRING_END			=32,
+	/* written from userspace, see struct rrnotify_marker: time (sec,
+	 * nsec), tgid and pid of the writer, value (u64), label length in
+	 * bytes, then the label packed into entries */
+	RRNOTIFY_MARKER_BEGIN		=33,
+	RRNOTIFY_MARKER_END			=34,
+	/* the live settings changed: the header's entries after the
+	 * version, as they are from here on */
+	RRNOTIFY_CONFIG_BEGIN		=35,
+	RRNOTIFY_CONFIG_END			=36
 } RRNotifyLinuxCode;
 
+/* Version of the stream layout, written in the header record.
+ * Decoders should skip header entries they don't know up to
+ * RRNOTIFY_HEADER_END.
+ */
+#define RRNOTIFY_FORMAT_VERSION	5
+
+/* Thread info (version 5 on): THREAD_INFO_BEGIN, the record_fields
+ * the record was written with, then those fields.
+ */
+
+/* Module lists (version 3 on): MODULE_LIST_BEGIN, entry count, these
+ * flags, then the entries. A list may be split over several blocks,
+ * CONTINUED saying that another follows.
+ */
+#define RR_MODULES_CONTINUED	0x1
+#define RR_MODULES_TRUNCATED	0x2	/* module_limit was reached */
+
+/* With buffer_compress set the stream is a sequence of chunks instead:
+ * RR_CHUNK_MAGIC, raw size and compressed size in bytes, then the LZ4
+ * block padded to a whole entry. A compressed size of 0 means the raw
+ * entries follow uncompressed.
+ */
+#define RR_CHUNK_MAGIC			0x5a4c5252UL	/* "RRLZ" */
+#define RR_CHUNK_HEADER_WORDS	3
+
 #define RR_INVALID_COOKIE	~0UL
 #define RR_NO_COOKIE		0UL
+/* anonymous executable memory (module_options ANON_EXEC), e.g. JIT
+ * code; the daemon can look it up in /tmp/perf-<tgid>.map */
+#define RR_ANON_COOKIE		1UL
+
+/* ioctl on the buffer file: look up the current thread info and
+ * module lists of up to 4096 threads at once. The results for as many
+ * threads as fit whole in buf are written there, each framed by
+ * QUERY_BEGIN/QUERY_END and using the session's record_fields.
+ * Fails with ENOSPC if not even the first fits. The output is in the
+ * kernel's unsigned long, so 32-bit callers on a 64-bit kernel get
+ * ENOTTY.
+ */
+#define RRNOTIFY_QUERY_THREAD	0x1
+#define RRNOTIFY_QUERY_MODULES	0x2	/* both if neither is set */
 
-/* add data to the event buffer */
-void add_event_entry(unsigned long data);
+struct rrnotify_query {
+	__u64 pids;		/* in: user pointer to nr_pids pid_t */
+	__u64 buf;		/* in: user pointer to the output */
+	__u64 buf_size;	/* in: size of buf in bytes */
+	__u64 buf_used;	/* out: bytes written to buf */
+	__u32 nr_pids;	/* in */
+	__u32 nr_done;	/* out: pids whose results are in buf */
+	__u32 flags;	/* in: RRNOTIFY_QUERY_* */
+	__u32 reserved;
+};
 
-extern struct file_operations event_buffer_fops;
+/* write() of exactly this struct to the buffer file adds a MARKER
+ * record, in stream order with the records around it. The file may
+ * also be opened write-only for this while the daemon reads it. Any
+ * other write by the reader ends the session's wait as before.
+ */
+#define RRNOTIFY_MARKER_MAGIC		0x4b52414d	/* "MARK" */
+#define RRNOTIFY_MARKER_LABEL_LEN	48
+
+struct rrnotify_marker {
+	__u32 magic;	/* RRNOTIFY_MARKER_MAGIC */
+	__u32 flags;	/* must be 0 */
+	__u64 value;
+	char label[RRNOTIFY_MARKER_LABEL_LEN];	/* NUL padded */
+};
+
+#define RRNOTIFY_IOC_MAGIC		'r'
+#define RRNOTIFY_IOC_QUERY		_IOWR(RRNOTIFY_IOC_MAGIC, 1, struct rrnotify_query)
+
+/* The buffer has a part on each NUMA node, at most EVENT_MAX_BUFFERS,
+ * each a stream of its own. Records go to the writer's node's part.
+ */
+#define EVENT_MAX_BUFFERS	BITS_PER_LONG
 
-/* mutex between sync_cpu_buffers() and the
- * file reading code.
+struct node_buffer;
+
+int event_buffer_count(void);
+/* the part of the calling CPU's node */
+int event_buffer_local(void);
+int event_buffer_index(struct node_buffer const * nb);
+
+/* Each part has a lock of its own, so writers on different nodes don't
+ * wait for each other. Whatever touches every part, like the readers,
+ * takes all of them, in order.
  */
-extern struct semaphore buffer_sem;
+struct node_buffer * event_buffer_lock(int buffer);
+struct node_buffer * event_buffer_lock_local(void);
+void event_buffer_unlock(struct node_buffer * nb);
+void event_buffer_lock_all(void);
+void event_buffer_unlock_all(void);
+/* a part, with event_buffer_lock_all() held */
+struct node_buffer * event_buffer_part(int buffer);
+
+/* add data to a locked part */
+void add_event_entry(struct node_buffer * nb, unsigned long data);
+void add_event_u64(struct node_buffer * nb, u64 data);
+
+/* frame a record; a record that overflows the part is dropped whole */
+unsigned long event_buffer_begin_record(struct node_buffer * nb, int code);
+int event_buffer_end_record(struct node_buffer * nb, int code);
+
+extern struct file_operations event_buffer_fops;
+
 extern atomic_t buffer_dump;
 
 #endif /* EVENT_BUFFER_H */
@@ -0,0 +1,116 @@
+/**
+ * @file exit_filter.c
+ *
+ * @remark Copyright (C) 2006-2015 RotateRight, LLC
+ * @remark Read the file COPYING
+ *
+ * Cheap checks run on every exit before any of the locks on the
+ * recording path are taken: 1-in-N sampling by pid hash, and a token
+ * bucket per tgid. Suppressed exits are counted per reason so totals
+ * can be scaled back up.
+ */
+
+#include <linux/sched.h>
+#include <linux/hash.h>
+#include <linux/jiffies.h>
+#include <linux/spinlock.h>
+#include <linux/string.h>
+#include <linux/rcupdate.h>
+
+#include "rrnotify.h"
+#include "rrnotify_stats.h"
+#include "config.h"
+#include "exit_filter.h"
+
+#define RATE_BUCKET_BITS	10
+#define RATE_BUCKETS		(1 << RATE_BUCKET_BITS)
+
+/* Buckets are indexed by tgid hash. A tgid that hashes to a bucket in
+ * use by another tgid takes it over with a full bucket, so the limit is
+ * approximate when many tgids exit at once.
+ */
+struct rate_bucket {
+	spinlock_t lock;
+	pid_t tgid;
+	/* in 1/HZ tokens, so refill is elapsed jiffies * rate */
+	unsigned long tokens;
+	unsigned long last;
+};
+
+static struct rate_bucket rate_buckets[RATE_BUCKETS];
+
+
+void exit_filter_start(void)
+{
+	int i;
+
+	for (i = 0; i < RATE_BUCKETS; i++) {
+		spin_lock_init(&rate_buckets[i].lock);
+		rate_buckets[i].tgid = 0;
+	}
+}
+
+
+/* A change of rate_limit or rate_burst applies to the buckets as they
+ * refill, tokens already in a bucket are kept up to the new capacity.
+ */
+static int rate_limited(pid_t tgid, unsigned long rate_limit, unsigned long rate_burst)
+{
+	struct rate_bucket * bucket = &rate_buckets[hash_32(tgid, RATE_BUCKET_BITS)];
+	unsigned long const capacity = rate_burst * HZ;
+	unsigned long now = jiffies;
+	int limited = 0;
+
+	spin_lock(&bucket->lock);
+
+	if (bucket->tgid != tgid) {
+		bucket->tgid = tgid;
+		bucket->tokens = capacity;
+	} else {
+		unsigned long elapsed = now - bucket->last;
+
+		/* full once elapsed * rate_limit >= capacity, without the
+		 * product overflowing. A rate above capacity per jiffy still
+		 * needs a jiffy to pass: capacity / rate_limit would be 0. */
+		if (elapsed >= (capacity - 1) / rate_limit + 1)
+			bucket->tokens = capacity;
+		else
+			bucket->tokens = min(bucket->tokens + elapsed * rate_limit, capacity);
+	}
+	bucket->last = now;
+
+	if (bucket->tokens >= HZ)
+		bucket->tokens -= HZ;
+	else
+		limited = 1;
+
+	spin_unlock(&bucket->lock);
+
+	return limited;
+}
+
+
+int exit_filter_task(struct task_struct * task)
+{
+	struct rrnotify_config const * cfg;
+	unsigned long sample_period, rate_limit, rate_burst;
+
+	rcu_read_lock();
+	cfg = rcu_dereference(rrnotify_config);
+	sample_period = cfg->sample_period;
+	rate_limit = cfg->rate_limit;
+	rate_burst = cfg->rate_burst;
+	rcu_read_unlock();
+
+	if (sample_period > 1 && hash_32(task->pid, 32) % sample_period) {
+		atomic_inc(&rrnotify_stats.event_suppressed_sample);
+		return 1;
+	}
+
+	if (rate_limit && rate_limited(task->tgid, rate_limit, rate_burst)) {
+		atomic_inc(&rrnotify_stats.event_suppressed_ratelimit);
+		return 1;
+	}
+
+	return 0;
+}
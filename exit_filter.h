@@ -0,0 +1,19 @@
+/**
+ * @file exit_filter.h
+ *
+ * @remark Copyright (C) 2006-2015 RotateRight, LLC
+ * @remark Read the file COPYING
+ */
+
+#ifndef RRNOTIFY_EXIT_FILTER_H_
+#define RRNOTIFY_EXIT_FILTER_H_
+
+struct task_struct;
+
+/* empty the rate limit buckets */
+void exit_filter_start(void);
+
+/* returns non-zero if the exit should not be recorded */
+int exit_filter_task(struct task_struct * task);
+
+#endif /* RRNOTIFY_EXIT_FILTER_H_ */
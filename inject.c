@@ -0,0 +1,243 @@
+/**
+ * @file inject.c
+ *
+ * @remark Copyright (C) 2006-2015 RotateRight, LLC
+ * @remark Read the file COPYING
+ *
+ * Synthetic exit records for load testing consumers without fork/exit
+ * storms. Writing 1 to inject/enable starts inject/threads kernel
+ * threads that together write inject/rate records per second, in
+ * bursts of inject/burst records, each with between inject/vmas_min and
+ * inject/vmas_max module entries. The records go through the normal
+ * add_event_entry() path and look like RECORD exits of tgid 0, with the
+ * thread info of the injector thread and made up module entries.
+ */
+
+#include <linux/kthread.h>
+#include <linux/mm.h>
+#include <linux/sched.h>
+#include <linux/jiffies.h>
+#include <linux/slab.h>
+#include <linux/fs.h>
+#include <linux/version.h>
+
+#include "rrnotify.h"
+#include "rrnotify_stats.h"
+#include "logging.h"
+#include "event_buffer.h"
+#include "buffer_sync.h"
+#include "inject.h"
+
+#define INJECT_MAX_THREADS	64
+/* module entries per record, as written in one chunk */
+#define INJECT_MAX_VMAS		512
+#define THREAD_INFO_WORDS	64
+
+static unsigned long inject_rate = 1000;
+static unsigned long inject_burst = 1;
+static unsigned long inject_threads = 1;
+static unsigned long inject_vmas_min = 1;
+static unsigned long inject_vmas_max = 32;
+
+static struct {
+	char const * name;
+	unsigned long * val;
+} const inject_params[] = {
+	{ "rate",	&inject_rate },
+	{ "burst",	&inject_burst },
+	{ "threads",	&inject_threads },
+	{ "vmas_min",	&inject_vmas_min },
+	{ "vmas_max",	&inject_vmas_max },
+};
+
+/* settings of the running injector */
+struct inject_config {
+	/* records per second and thread */
+	unsigned long rate;
+	unsigned long burst;
+	unsigned long vmas_min;
+	unsigned long vmas_max;
+};
+
+static struct inject_config config;
+static struct task_struct * inject_tasks[INJECT_MAX_THREADS];
+static int nr_inject_tasks;
+
+/* pids of the synthetic threads, so each record is distinct */
+static atomic_t inject_pid = ATOMIC_INIT(0);
+
+
+/* xorshift, good enough for picking sizes */
+static inline u32 inject_random(u32 * state)
+{
+	u32 x = *state;
+
+	x ^= x << 13;
+	x ^= x >> 17;
+	x ^= x << 5;
+	return *state = x;
+}
+
+
+static void add_inject_record(unsigned long * info, size_t info_words, u32 * seed)
+{
+	struct node_buffer * nb;
+	unsigned long vmas = config.vmas_min;
+	unsigned long addr = 0x400000;
+	unsigned long i;
+
+	if (config.vmas_max > config.vmas_min)
+		vmas += inject_random(seed) % (config.vmas_max - config.vmas_min + 1);
+
+	nb = event_buffer_lock_local();
+	event_buffer_begin_record(nb, RRNOTIFY_RECORD_BEGIN);
+	for (i = 0; i < info_words; i++)
+		add_event_entry(nb, info[i]);
+
+	add_event_entry(nb, RR_ESCAPE_CODE);
+	add_event_entry(nb, RRNOTIFY_MODULE_LIST_BEGIN);
+	add_event_entry(nb, vmas);
+	add_event_entry(nb, 0);
+	for (i = 0; i < vmas; i++) {
+		add_event_entry(nb, addr);
+		add_event_entry(nb, addr + PAGE_SIZE * 16);
+		add_event_entry(nb, VM_READ | VM_EXEC);
+		add_event_entry(nb, RR_NO_COOKIE);
+		add_event_entry(nb, i * PAGE_SIZE * 16);
+		addr += PAGE_SIZE * 32;
+	}
+	add_event_entry(nb, RR_ESCAPE_CODE);
+	add_event_entry(nb, RRNOTIFY_MODULE_LIST_END);
+	event_buffer_end_record(nb, RRNOTIFY_RECORD_END);
+	event_buffer_unlock(nb);
+
+	atomic_inc(&rrnotify_stats.inject_record);
+}
+
+
+/* Sleep a burst's worth of time, then write the records due since. */
+static int inject_thread(void * data)
+{
+	unsigned long info[THREAD_INFO_WORDS];
+	unsigned long period = max(1UL, config.burst * HZ / config.rate);
+	unsigned long last = jiffies;
+	/* in records * HZ */
+	unsigned long credit = 0;
+	u32 seed = (unsigned long)data * 2654435761U + 1;
+	size_t info_words;
+
+	while (!kthread_should_stop()) {
+		unsigned long now;
+
+		schedule_timeout_interruptible(period);
+
+		now = jiffies;
+		credit += (now - last) * config.rate;
+		last = now;
+
+		while (credit >= HZ && !kthread_should_stop()) {
+			info_words = encode_synthetic_thread_info(atomic_inc_return(&inject_pid),
+				info, THREAD_INFO_WORDS);
+			add_inject_record(info, min(info_words, (size_t)THREAD_INFO_WORDS), &seed);
+			credit -= HZ;
+		}
+		/* don't save up for a burst bigger than asked */
+		if (credit > config.burst * HZ)
+			credit = config.burst * HZ;
+	}
+	return 0;
+}
+
+
+/* Called under start_sem with the session started. */
+int inject_start(void)
+{
+	unsigned long threads;
+	int i;
+
+	if (nr_inject_tasks)
+		return 0;
+
+	spin_lock(&rrnotifyfs_lock);
+	threads = clamp(inject_threads, 1UL, (unsigned long)INJECT_MAX_THREADS);
+	config.rate = inject_rate / threads;
+	config.burst = inject_burst ? inject_burst : 1;
+	config.vmas_min = min(inject_vmas_min, (unsigned long)INJECT_MAX_VMAS);
+	config.vmas_max = clamp(inject_vmas_max, config.vmas_min, (unsigned long)INJECT_MAX_VMAS);
+	spin_unlock(&rrnotifyfs_lock);
+
+	if (!config.rate)
+		return -EINVAL;
+
+	for (i = 0; i < threads; i++) {
+		struct task_struct * task = kthread_run(inject_thread, (void *)(unsigned long)i,
+			"rrnotify_inject/%d", i);
+		if (IS_ERR(task)) {
+			inject_stop();
+			return PTR_ERR(task);
+		}
+		inject_tasks[nr_inject_tasks++] = task;
+	}
+
+	return 0;
+}
+
+
+/* Called under start_sem. */
+void inject_stop(void)
+{
+	while (nr_inject_tasks)
+		kthread_stop(inject_tasks[--nr_inject_tasks]);
+}
+
+
+static ssize_t enable_read(struct file * file, char __user * buf, size_t count, loff_t * offset)
+{
+	return rrnotifyfs_ulong_to_user(nr_inject_tasks != 0, buf, count, offset);
+}
+
+
+static ssize_t enable_write(struct file * file, char const __user * buf, size_t count, loff_t * offset)
+{
+	unsigned long val;
+	int retval;
+
+	if (*offset)
+		return -EINVAL;
+
+	retval = rrnotifyfs_ulong_from_user(&val, buf, count);
+	if (retval)
+		return retval;
+
+	retval = rrnotify_inject(val != 0);
+	if (retval)
+		return retval;
+
+	return count;
+}
+
+
+static struct file_operations inject_enable_fops = {
+	.read		= enable_read,
+	.write		= enable_write,
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,37)
+	.llseek		= default_llseek,
+#endif // >= 2.6.37
+};
+
+
+void inject_create_files(struct super_block * sb, struct dentry * root)
+{
+	struct dentry * dir;
+	int i;
+
+	dir = rrnotifyfs_mkdir(sb, root, "inject");
+	if (!dir)
+		return;
+
+	rrnotifyfs_create_file(sb, dir, "enable", &inject_enable_fops);
+	for (i = 0; i < ARRAY_SIZE(inject_params); i++) {
+		rrnotifyfs_create_ulong(sb, dir, inject_params[i].name,
+			inject_params[i].val);
+	}
+}
@@ -0,0 +1,22 @@
+/**
+ * @file inject.h
+ *
+ * @remark Copyright (C) 2006-2015 RotateRight, LLC
+ * @remark Read the file COPYING
+ */
+
+#ifndef RRNOTIFY_INJECT_H_
+#define RRNOTIFY_INJECT_H_
+
+struct super_block;
+struct dentry;
+
+/* start the injector threads, the session must be started */
+int inject_start(void);
+
+/* stop the injector threads if running */
+void inject_stop(void);
+
+void inject_create_files(struct super_block * sb, struct dentry * root);
+
+#endif /* RRNOTIFY_INJECT_H_ */
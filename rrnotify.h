@@ -13,6 +13,28 @@
 #include <linux/types.h>
 #include <linux/spinlock.h>
 #include <linux/fs.h>
+#include <linux/time.h>
+#include <linux/version.h>
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4,2,0)
+#include <linux/timekeeping.h>
+#endif
+
+/* READ_ONCE replaced ACCESS_ONCE in 3.19 */
+#ifndef READ_ONCE
+#define READ_ONCE(x)	ACCESS_ONCE(x)
+#endif
+
+/* monotonic time stamp for records */
+static inline void rrnotify_get_time(struct timespec * ts)
+{
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4,2,0)
+	ktime_get_ts(ts);
+#elif LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,16)
+	do_posix_clock_monotonic_gettime(ts);
+#else
+	*ts = current_kernel_time();
+#endif
+}
 
 int rrnotify_setup(void);
 void rrnotify_shutdown(void); 
@@ -23,10 +45,64 @@ void rrnotifyfs_unregister(void);
 int rrnotify_start(void);
 void rrnotify_stop(void);
 
+/* write SNAPSHOT records for live threads, of all processes if nr_tgids is 0 */
+int rrnotify_snapshot(pid_t const * tgids, int nr_tgids);
+
+/* start or stop the synthetic record injector */
+int rrnotify_inject(int enable);
+
+struct rrnotify_marker;
+
+/* add a MARKER record to the stream of the running session */
+int rrnotify_marker(struct rrnotify_marker const * marker);
+
+/* fs_event_mask bits - optional events reported besides thread exit */
+#define RRNOTIFY_EVENT_EXEC	0x1
+#define RRNOTIFY_EVENT_FORK	0x2
+#define RRNOTIFY_EVENT_MMAP	0x4	/* executable mmap and munmap */
+
+/* fs_record_fields bits - thread info fields, written in this order */
+#define RRNOTIFY_FIELD_IDS			0x001	/* tgid, pid */
+#define RRNOTIFY_FIELD_CPU_TIME		0x002	/* utime, stime in usecs */
+#define RRNOTIFY_FIELD_START_TIME	0x004	/* sec, nsec */
+#define RRNOTIFY_FIELD_END_TIME		0x008	/* sec, nsec */
+#define RRNOTIFY_FIELD_RUNTIME		0x010	/* sum_exec_runtime in ns (u64) */
+#define RRNOTIFY_FIELD_CTX_SWITCHES	0x020	/* voluntary, involuntary */
+#define RRNOTIFY_FIELD_FAULTS		0x040	/* minor, major */
+#define RRNOTIFY_FIELD_MAX_RSS		0x080	/* kB */
+#define RRNOTIFY_FIELD_IO_BYTES		0x100	/* read, write bytes (u64 each) */
+#define RRNOTIFY_FIELD_LAST_CPU		0x200
+#define RRNOTIFY_FIELD_COMM			0x400	/* string id of the thread name */
+#define RRNOTIFY_FIELD_ARGV			0x800	/* string id of the command line */
+
+#define RRNOTIFY_FIELDS_DEFAULT		(RRNOTIFY_FIELD_IDS | RRNOTIFY_FIELD_CPU_TIME | \
+	RRNOTIFY_FIELD_START_TIME | RRNOTIFY_FIELD_END_TIME)
+#define RRNOTIFY_FIELDS_ALL			0xfff
+
+/* fs_module_options bits - extra information about mapped files */
+#define RRNOTIFY_MODULE_BUILD_ID	0x1	/* ELF build-ID once per file */
+#define RRNOTIFY_MODULE_ANON_EXEC	0x2	/* anonymous executable regions */
+#define RRNOTIFY_MODULE_COALESCE	0x4	/* merge adjacent vmas of one mapping */
+
 int rrnotify_set_ulong(unsigned long *addr, unsigned long val);
+int rrnotify_set_ulongs(unsigned long ** addrs, unsigned long * vals, int count);
 
 extern unsigned long fs_buffer_size;
 extern unsigned long fs_buffer_watershed;
+extern unsigned long fs_buffer_watershed_adaptive;
+extern unsigned long fs_buffer_compress;
+extern unsigned long fs_event_mask;
+extern unsigned long fs_record_fields;
+extern unsigned long fs_module_options;
+extern unsigned long fs_module_limit;
+extern unsigned long fs_argv_max;
+extern unsigned long fs_aggregate_mode;
+extern unsigned long fs_aggregate_interval;
+extern unsigned long fs_sample_period;
+extern unsigned long fs_rate_limit;
+extern unsigned long fs_rate_burst;
+extern unsigned long fs_cpu_tick_interval;
+extern unsigned long fs_spool_rotate_size;
 extern unsigned long rrnotify_started;
 
 extern int rrnotify_debug; // RR
@@ -49,6 +125,15 @@ int rrnotifyfs_create_file(struct super_block * sb, struct dentry * root,
 int rrnotifyfs_create_file_perm(struct super_block * sb, struct dentry * root,
 	char const * name, const struct file_operations * fops, int perm);
 
+/**
+ * Create a read-only file whose private data is priv; fops should open
+ * it with rrnotifyfs_open_private() to find it in file->private_data.
+ */
+int rrnotifyfs_create_ro_file(struct super_block * sb, struct dentry * root,
+	char const * name, const struct file_operations * fops, void * priv);
+
+int rrnotifyfs_open_private(struct inode * inode, struct file * filp);
+
 /** Create a file for read/write access to an unsigned long. */
 int rrnotifyfs_create_ulong(struct super_block * sb, struct dentry * root,
 	char const * name, unsigned long * val);
@@ -61,4 +146,10 @@ int rrnotifyfs_create_ro_atomic(struct super_block * sb, struct dentry * root,
 struct dentry * rrnotifyfs_mkdir(struct super_block * sb, struct dentry * root,
 	char const * name);
 
+/** Write the value and a newline to the user buffer, for read(). */
+ssize_t rrnotifyfs_ulong_to_user(unsigned long val, char __user * buf, size_t count, loff_t * offset);
+
+/** Parse an unsigned long written from userspace. */
+int rrnotifyfs_ulong_from_user(unsigned long * val, char const __user * buf, size_t count);
+
 #endif /*RRNOTIFY_H_*/
@@ -10,12 +10,22 @@
 #include <linux/kernel.h>
 #include <linux/module.h>
 #include <linux/init.h>
+#include <linux/slab.h>
 
 #include "rrnotify.h"
 #include "rrnotify_stats.h"
 #include "event_buffer.h"
 #include "buffer_sync.h"
+#include "aggregate.h"
+#include "inject.h"
+#include "config.h"
+#include "cpu_tick.h"
+#include "spool.h"
 
+/* Changed under start_sem and with every part of the event buffer
+ * locked, so that either is enough to read it. Markers check it with
+ * their part locked alone.
+ */
 unsigned long rrnotify_started;
 static unsigned long is_setup;
 #if LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,37)
@@ -30,22 +40,94 @@ static DECLARE_MUTEX(start_sem);
  */
 int rrnotify_debug = 0;
 
-int rrnotify_set_ulong(unsigned long *addr, unsigned long val)
+/* Settings that register hooks or allocate state when the session
+ * starts, and so can only change while it is stopped.
+ */
+static int is_session_setting(unsigned long * addr)
+{
+	return addr == &fs_buffer_compress || addr == &fs_event_mask
+		|| addr == &fs_aggregate_mode;
+}
+
+/* Apply several settings at once: either all of them are set or, on
+ * error, none. Apart from the session settings above they take effect
+ * while the session runs: the buffer is resized, the intervals are read
+ * again each time their work is scheduled, and the others are published
+ * as a new rrnotify_config.
+ */
+int rrnotify_set_ulongs(unsigned long ** addrs, unsigned long * vals, int count)
 {
-	int err = -EBUSY;
+	struct rrnotify_config * cfg = NULL;
+	unsigned long size, watershed;
+	int resize = 0;
+	int live = 0;
+	int intervals = 0;
+	int err = 0;
+	int i;
 
 	down(&start_sem);
 
-	if (!rrnotify_started) {
-		*addr = val;
-		err = 0;
+	size = fs_buffer_size;
+	watershed = fs_buffer_watershed;
+
+	for (i = 0; i < count; i++) {
+		if (addrs[i] == &fs_buffer_size) {
+			size = vals[i];
+			resize = 1;
+		} else if (addrs[i] == &fs_buffer_watershed) {
+			watershed = vals[i];
+			resize = 1;
+		} else if (rrnotify_config_has(addrs[i])) {
+			live = 1;
+		} else if (addrs[i] == &fs_cpu_tick_interval
+			   || addrs[i] == &fs_aggregate_interval) {
+			intervals = 1;
+		} else if (is_session_setting(addrs[i]) && rrnotify_started) {
+			err = -EBUSY;
+			goto out;
+		}
+	}
+
+	if (live && !(cfg = rrnotify_config_build(addrs, vals, count))) {
+		err = -ENOMEM;
+		goto out;
+	}
+
+	/* the buffer can be resized without stopping the session */
+	if (resize && is_setup) {
+		if ((err = event_buffer_resize(size, watershed))) {
+			kfree(cfg);
+			goto out;
+		}
 	}
 
+	for (i = 0; i < count; i++) {
+		*addrs[i] = vals[i];
+	}
+
+	if (cfg) {
+		rrnotify_config_publish(cfg);
+		if (is_setup)
+			sync_config_changed();
+	}
+
+	/* an interval turned on from 0 has no work scheduled to read it */
+	if (intervals && is_setup) {
+		cpu_tick_interval_changed();
+		aggregate_interval_changed();
+	}
+
+out:
 	up(&start_sem);
 
 	return err;
 }
 
+int rrnotify_set_ulong(unsigned long *addr, unsigned long val)
+{
+	return rrnotify_set_ulongs(&addr, &val, 1);
+}
+
 int rrnotify_setup(void)
 {
 	int err;
@@ -55,6 +137,10 @@ int rrnotify_setup(void)
 	if ((err = alloc_event_buffer())) {
 		goto out1;
 	}
+
+	if ((err = aggregate_start())) {
+		goto out2;
+	}
  
 	/* Note even though this starts part of the
 	 * profiling overhead, it's necessary to prevent
@@ -62,7 +148,7 @@ int rrnotify_setup(void)
 	 * when trying to process the event buffer.
 	 */
 	if ((err = sync_start())) {
-		goto out2;
+		goto out3;
 	}
 
 	is_setup = 1;
@@ -71,6 +157,8 @@ int rrnotify_setup(void)
 	up(&start_sem);
 	return 0;
  
+out3:
+	aggregate_stop();
 out2:
 	free_event_buffer();
 out1:
@@ -97,7 +185,9 @@ int rrnotify_start(void)
 
 	rrnotify_reset_stats();
 
+	event_buffer_lock_all();
 	rrnotify_started = 1;
+	event_buffer_unlock_all();
 	atomic_set(&buffer_dump, 0);
 	
 out:
@@ -112,18 +202,66 @@ void rrnotify_stop(void)
 	if (!rrnotify_started) {
 		goto out;
 	}
+	/* markers past this don't write into a buffer being freed */
+	event_buffer_lock_all();
 	rrnotify_started = 0;
+	event_buffer_unlock_all();
+
+	inject_stop();
 
 	/* wake up the daemon to read what remains */
+	aggregate_flush();
 	wake_up_buffer_waiter();
 out:
 	up(&start_sem);
 }
 
+/* echo [tgid...] >/dev/rrnotify/snapshot */
+int rrnotify_snapshot(pid_t const * tgids, int nr_tgids)
+{
+	int err = -EINVAL;
+
+	down(&start_sem);
+	if (rrnotify_started) {
+		err = sync_snapshot(tgids, nr_tgids);
+	}
+	up(&start_sem);
+	return err;
+}
+
+/* echo 0|1 >/dev/rrnotify/inject/enable */
+int rrnotify_inject(int enable)
+{
+	int err = 0;
+
+	down(&start_sem);
+	if (!enable) {
+		inject_stop();
+	} else if (rrnotify_started) {
+		err = inject_start();
+	} else {
+		err = -EINVAL;
+	}
+	up(&start_sem);
+	return err;
+}
+
+/* write() of struct rrnotify_marker to the buffer file. Not under
+ * start_sem, which a snapshot holds for its whole task walk;
+ * sync_marker() checks again with its part locked.
+ */
+int rrnotify_marker(struct rrnotify_marker const * marker)
+{
+	if (!READ_ONCE(rrnotify_started))
+		return -EINVAL;
+	return sync_marker(marker);
+}
+
 void rrnotify_shutdown(void)
 {
 	down(&start_sem);
 	sync_stop();
+	aggregate_stop();
 	is_setup = 0;
 	free_event_buffer();
 	up(&start_sem);
@@ -138,15 +276,26 @@ static int __init rrnotify_init(void)
 #endif
 	init_event_buffer();
 
+	if ((err = rrnotify_config_init()))
+		return err;
+
 	printk(KERN_INFO "rrnotify: init\n");
 	err = rrnotifyfs_register();
+	if (!err) {
+		spool_init();
+	} else {
+		rrnotify_config_exit();
+	}
 	
 	return err;
 }
 
 static void __exit rrnotify_exit(void)
 {
+	spool_exit();
 	rrnotifyfs_unregister();
+	destroy_event_buffer();
+	rrnotify_config_exit();
 	printk(KERN_INFO "rrnotify: exit\n");
 }
 
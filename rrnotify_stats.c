@@ -14,32 +14,190 @@
 #include <linux/smp.h>
 #include <linux/cpumask.h>
 #include <linux/threads.h>
+#include <linux/slab.h>
+#include <linux/time.h>
+#include <linux/stddef.h>
+#include <asm/uaccess.h>
  
 #include "rrnotify_stats.h"
+#include "event_buffer.h"
  
 struct rrnotify_stat_struct rrnotify_stats;
+
+DEFINE_PER_CPU(struct rrnotify_cpu_stat_struct, rrnotify_cpu_stats);
+
+/* the per-cpu counter summed over the cpus for a stats/ file */
+#define CPU_STAT(field)	NULL, offsetof(struct rrnotify_cpu_stat_struct, field)
+
+/* the stats/ files, also the order of counters in stats_snapshot */
+static struct stat_file {
+	char const * name;
+	atomic_t * val;
+	/* for a val of NULL */
+	size_t cpu_offset;
+} const stat_files[] = {
+	{ "sample_lost_no_mm",		&rrnotify_stats.sample_lost_no_mm },
+	{ "event_lost_overflow",	&rrnotify_stats.event_lost_overflow },
+	{ "event_received",		&rrnotify_stats.event_received },
+	{ "task_event_received",	&rrnotify_stats.task_event_received },
+	{ "task_event_lost_queue",	&rrnotify_stats.task_event_lost_queue },
+	{ "event_aggregated",		&rrnotify_stats.event_aggregated },
+	{ "event_suppressed_sample",	&rrnotify_stats.event_suppressed_sample },
+	{ "event_suppressed_ratelimit",	&rrnotify_stats.event_suppressed_ratelimit },
+	{ "chunk_compressed",		&rrnotify_stats.chunk_compressed },
+	{ "chunk_stored",		&rrnotify_stats.chunk_stored },
+	{ "spool_files",		&rrnotify_stats.spool_files },
+	{ "spool_write_error",		&rrnotify_stats.spool_write_error },
+	{ "watershed_current",		&rrnotify_stats.watershed_current },
+	{ "watershed_adjust",		&rrnotify_stats.watershed_adjust },
+	{ "snapshot_task",		&rrnotify_stats.snapshot_task },
+	{ "cpu_tick_thread",		&rrnotify_stats.cpu_tick_thread },
+	{ "inject_record",		&rrnotify_stats.inject_record },
+	{ "string_defined",		&rrnotify_stats.string_defined },
+	{ "string_table_reset",	&rrnotify_stats.string_table_reset },
+	{ "marker_record",		&rrnotify_stats.marker_record },
+	{ "buffer_write_local",		CPU_STAT(buffer_write_local) },
+	{ "buffer_write_remote",	CPU_STAT(buffer_write_remote) },
+};
+
+#define NR_CPU_COUNTERS	(sizeof(struct rrnotify_cpu_stat_struct) / sizeof(unsigned long))
  
 void rrnotify_reset_stats(void)
 {
-	atomic_set(&rrnotify_stats.sample_lost_no_mm, 0);
-	atomic_set(&rrnotify_stats.event_lost_overflow, 0);
-	atomic_set(&rrnotify_stats.event_received, 0);
+	/* watershed_current is a setting, not a counter */
+	int watershed = atomic_read(&rrnotify_stats.watershed_current);
+	int i;
+
+	for (i = 0; i < ARRAY_SIZE(stat_files); i++) {
+		if (stat_files[i].val)
+			atomic_set(stat_files[i].val, 0);
+	}
+	atomic_set(&rrnotify_stats.watershed_current, watershed);
+
+	for_each_possible_cpu(i) {
+		memset(&per_cpu(rrnotify_cpu_stats, i), 0, sizeof(struct rrnotify_cpu_stat_struct));
+	}
+}
+
+
+static unsigned long read_stat(struct stat_file const * stat)
+{
+	unsigned long sum = 0;
+	int cpu;
+
+	if (stat->val)
+		return atomic_read(stat->val);
+
+	for_each_possible_cpu(cpu)
+		sum += *(unsigned long *)((char *)&per_cpu(rrnotify_cpu_stats, cpu) + stat->cpu_offset);
+	return sum;
+}
+
+
+static size_t stats_snapshot_size(void)
+{
+	return sizeof(struct rrnotify_stats_snapshot)
+		+ sizeof(__u64) * ARRAY_SIZE(stat_files)
+		+ sizeof(__u64) * NR_CPU_COUNTERS * nr_cpu_ids;
+}
+
+static void fill_stats_snapshot(struct rrnotify_stats_snapshot * snapshot)
+{
+	__u64 * counter = (__u64 *)(snapshot + 1);
+	struct timespec now;
+	int i, cpu;
+
+	memset(snapshot, 0, stats_snapshot_size());
+	snapshot->version = RRNOTIFY_STATS_SNAPSHOT_VERSION;
+	snapshot->header_size = sizeof(struct rrnotify_stats_snapshot);
+	snapshot->nr_counters = ARRAY_SIZE(stat_files);
+	snapshot->nr_cpu_counters = NR_CPU_COUNTERS;
+	snapshot->nr_cpus = nr_cpu_ids;
+
+	/* the exit path updates its counters with its part locked */
+	event_buffer_lock_all();
+
+	rrnotify_get_time(&now);
+	snapshot->timestamp_ns = timespec_to_ns(&now);
+
+	for (i = 0; i < ARRAY_SIZE(stat_files); i++) {
+		*counter++ = read_stat(&stat_files[i]);
+	}
+
+	for_each_possible_cpu(cpu) {
+		unsigned long * cpu_counter = (unsigned long *)&per_cpu(rrnotify_cpu_stats, cpu);
+		__u64 * block = (__u64 *)(snapshot + 1) + ARRAY_SIZE(stat_files) + cpu * NR_CPU_COUNTERS;
+
+		for (i = 0; i < NR_CPU_COUNTERS; i++) {
+			block[i] = cpu_counter[i];
+		}
+	}
+
+	event_buffer_unlock_all();
+}
+
+
+/* Every read takes a snapshot of its own into a buffer of its own, so a
+ * poller can keep the file open and pread() it, and concurrent readers
+ * don't share state. A read should take the whole snapshot at once.
+ */
+static ssize_t stats_snapshot_read(struct file * file, char __user * buf, size_t count, loff_t * offset)
+{
+	struct rrnotify_stats_snapshot * snapshot;
+	ssize_t ret;
+
+	snapshot = kzalloc(stats_snapshot_size(), GFP_KERNEL);
+	if (!snapshot)
+		return -ENOMEM;
+
+	fill_stats_snapshot(snapshot);
+	ret = simple_read_from_buffer(buf, count, offset, snapshot, stats_snapshot_size());
+
+	kfree(snapshot);
+	return ret;
+}
+
+
+static ssize_t stat_read(struct file * file, char __user * buf, size_t count, loff_t * offset)
+{
+	return rrnotifyfs_ulong_to_user(read_stat(file->private_data), buf, count, offset);
 }
 
 
+static const struct file_operations stat_fops = {
+	.read		= stat_read,
+	.open		= rrnotifyfs_open_private,
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,37)
+	.llseek		= default_llseek,
+#endif // >= 2.6.37
+};
+
+
+static const struct file_operations stats_snapshot_fops = {
+	.read		= stats_snapshot_read,
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,37)
+	.llseek		= default_llseek,
+#endif // >= 2.6.37
+};
+
+
 void rrnotify_create_stats_files(struct super_block * sb, struct dentry * root)
 {
 	struct dentry * dir;
+	int i;
+
+	rrnotifyfs_create_file_perm(sb, root, "stats_snapshot", &stats_snapshot_fops, 0444);
 
 	dir = rrnotifyfs_mkdir(sb, root, "stats");
 	if (!dir)
 		return;
  
-	rrnotifyfs_create_ro_atomic(sb, dir, "sample_lost_no_mm",
-		&rrnotify_stats.sample_lost_no_mm);
-	rrnotifyfs_create_ro_atomic(sb, dir, "event_lost_overflow",
-		&rrnotify_stats.event_lost_overflow);
-	rrnotifyfs_create_ro_atomic(sb, dir, "event_received",
-		&rrnotify_stats.event_received);
-
+	for (i = 0; i < ARRAY_SIZE(stat_files); i++) {
+		if (stat_files[i].val)
+			rrnotifyfs_create_ro_atomic(sb, dir, stat_files[i].name,
+				stat_files[i].val);
+		else
+			rrnotifyfs_create_ro_file(sb, dir, stat_files[i].name,
+				&stat_fops, (void *)&stat_files[i]);
+	}
 }
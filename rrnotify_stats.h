@@ -10,6 +10,8 @@
 #ifndef RRNOTIFY_STATS_H
 #define RRNOTIFY_STATS_H
 
+#include <linux/types.h>
+#include <linux/percpu.h>
 #include <asm/atomic.h>
  
 // XXX names must match oprofile/rrprofile stats
@@ -17,9 +19,61 @@ struct rrnotify_stat_struct {
 	atomic_t sample_lost_no_mm;
 	atomic_t event_lost_overflow;
 	atomic_t event_received;
+	atomic_t task_event_received;
+	atomic_t task_event_lost_queue;
+	atomic_t event_aggregated;
+	atomic_t event_suppressed_sample;
+	atomic_t event_suppressed_ratelimit;
+	atomic_t chunk_compressed;
+	atomic_t chunk_stored;
+	atomic_t spool_files;
+	atomic_t spool_write_error;
+	atomic_t watershed_current;
+	atomic_t watershed_adjust;
+	atomic_t snapshot_task;
+	atomic_t cpu_tick_thread;
+	atomic_t inject_record;
+	atomic_t string_defined;
+	atomic_t string_table_reset;
+	atomic_t marker_record;
 };
 
 extern struct rrnotify_stat_struct rrnotify_stats;
+
+/* Per-cpu breakdown, reported through stats_snapshot. The records
+ * written to the part of the buffer on the writer's node or to another
+ * one are only counted here, as every record of every node would
+ * otherwise hit the same cache line; their stats/ files are the sums.
+ */
+struct rrnotify_cpu_stat_struct {
+	unsigned long event_received;
+	unsigned long event_lost_overflow;
+	unsigned long buffer_write_remote;
+	unsigned long buffer_write_local;
+};
+
+DECLARE_PER_CPU(struct rrnotify_cpu_stat_struct, rrnotify_cpu_stats);
+
+#define rrnotify_cpu_stat_inc(field) \
+	do { get_cpu_var(rrnotify_cpu_stats).field++; put_cpu_var(rrnotify_cpu_stats); } while (0)
+
+/* Layout of the stats_snapshot file: this header, then nr_counters u64
+ * values in the order of the stats/ files, then nr_cpus blocks of
+ * nr_cpu_counters u64 values in rrnotify_cpu_stat_struct order, indexed
+ * by cpu id. The counters of the exit path are updated with its part
+ * of the buffer locked, so they are mutually consistent.
+ */
+#define RRNOTIFY_STATS_SNAPSHOT_VERSION	1
+
+struct rrnotify_stats_snapshot {
+	__u32 version;
+	__u32 header_size;
+	__u32 nr_counters;
+	__u32 nr_cpu_counters;
+	__u32 nr_cpus;
+	__u32 reserved;
+	__u64 timestamp_ns;
+};
  
 /* reset all stats to zero */
 void rrnotify_reset_stats(void);
@@ -27,7 +81,7 @@ void rrnotify_reset_stats(void);
 struct super_block;
 struct dentry;
  
-/* create the stats/ dir */
+/* create the stats/ dir and the stats_snapshot file */
 void rrnotify_create_stats_files(struct super_block * sb, struct dentry * root);
 
 #endif /* RRNOTIFY_STATS_H */
@@ -11,20 +11,74 @@
 #include <linux/fs.h>
 #include <linux/pagemap.h>
 #include <linux/version.h>
+#include <linux/slab.h>
+#include <linux/string.h>
 #include <asm/uaccess.h>
 
 #include "rrnotify.h"
 #include "rrnotify_stats.h"
 #include "logging.h"
 #include "event_buffer.h"
+#include "spool.h"
+#include "inject.h"
 
 #define RRNOTIFYFS_MAGIC 0x6022006f
 
 DEFINE_SPINLOCK(rrnotifyfs_lock);
 
-/* fs_buffer_size and fs_buffer_watershed are defined in units of (unsigned long). */
+/* fs_buffer_size and fs_buffer_watershed are defined in units of (unsigned long),
+ * split evenly between the buffer's parts on the NUMA nodes. */
 unsigned long fs_buffer_size = (1 * 1024 * 1024) / sizeof(unsigned long); // 1MB
 unsigned long fs_buffer_watershed = (256 * 1024) / sizeof(unsigned long); // 256kB (fs_buffer_size/4)
+/* move the watershed with the observed bursts, starting at fs_buffer_watershed */
+unsigned long fs_buffer_watershed_adaptive = 0;
+/* LZ4 compress the buffer in chunks */
+unsigned long fs_buffer_compress = 0;
+/* RRNOTIFY_EVENT_* bits, thread exit is always reported */
+unsigned long fs_event_mask = 0;
+/* RRNOTIFY_FIELD_* bits written in each thread info record */
+unsigned long fs_record_fields = RRNOTIFY_FIELDS_DEFAULT;
+/* RRNOTIFY_MODULE_* bits */
+unsigned long fs_module_options = 0;
+/* most module entries reported for one address space (0 is unlimited) */
+unsigned long fs_module_limit = 65536;
+/* most bytes of the command line kept for RRNOTIFY_FIELD_ARGV */
+unsigned long fs_argv_max = 128;
+/* RRNOTIFY_AGGREGATE_* key for exit summaries, and their flush interval in ms */
+unsigned long fs_aggregate_mode = 0;
+unsigned long fs_aggregate_interval = 1000;
+/* record 1 in fs_sample_period exits (0 or 1 records all) */
+unsigned long fs_sample_period = 0;
+/* per-tgid limit in exits per second (0 is unlimited) and burst size */
+unsigned long fs_rate_limit = 0;
+unsigned long fs_rate_burst = 100;
+/* ms between cpu time records of live threads (0 is off) */
+unsigned long fs_cpu_tick_interval = 0;
+/* start a new spool file once this many bytes were written (0 never) */
+unsigned long fs_spool_rotate_size = 64 * 1024 * 1024;
+
+/* Settings exposed both as their own file and through the config file. */
+static struct {
+	char const * name;
+	unsigned long * val;
+} const config_files[] = {
+	{ "buffer_size",	&fs_buffer_size },
+	{ "buffer_watershed",	&fs_buffer_watershed },
+	{ "buffer_watershed_adaptive",	&fs_buffer_watershed_adaptive },
+	{ "buffer_compress",	&fs_buffer_compress },
+	{ "event_mask",		&fs_event_mask },
+	{ "record_fields",	&fs_record_fields },
+	{ "module_options",	&fs_module_options },
+	{ "module_limit",	&fs_module_limit },
+	{ "argv_max",		&fs_argv_max },
+	{ "aggregate_mode",	&fs_aggregate_mode },
+	{ "aggregate_interval",	&fs_aggregate_interval },
+	{ "sample_period",	&fs_sample_period },
+	{ "rate_limit",		&fs_rate_limit },
+	{ "rate_burst",		&fs_rate_burst },
+	{ "cpu_tick_interval",	&fs_cpu_tick_interval },
+	{ "spool_rotate_size",	&fs_spool_rotate_size },
+};
 
 static struct inode * rrnotifyfs_get_inode(struct super_block * sb, int mode)
 {
@@ -135,7 +189,7 @@ static ssize_t ulong_write_file(struct file * file, char const __user * buf, siz
 }
 
 
-static int default_open(struct inode * inode, struct file * filp)
+int rrnotifyfs_open_private(struct inode * inode, struct file * filp)
 {
 #ifdef HAS_IPRIVATE
 	if (inode->i_private)
@@ -151,7 +205,7 @@ static int default_open(struct inode * inode, struct file * filp)
 static const struct file_operations ulong_fops = {
 	.read		= ulong_read_file,
 	.write		= ulong_write_file,
-	.open		= default_open,
+	.open		= rrnotifyfs_open_private,
 #if LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,37)
 	.llseek		= default_llseek,
 #endif
@@ -160,7 +214,7 @@ static const struct file_operations ulong_fops = {
 
 static const struct file_operations ulong_ro_fops = {
 	.read		= ulong_read_file,
-	.open		= default_open,
+	.open		= rrnotifyfs_open_private,
 #if LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,37)
 	.llseek		= default_llseek,
 #endif
@@ -226,7 +280,7 @@ static ssize_t atomic_read_file(struct file * file, char __user * buf, size_t co
 
 static const struct file_operations atomic_ro_fops = {
 	.read		= atomic_read_file,
-	.open		= default_open,
+	.open		= rrnotifyfs_open_private,
 #if LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,37)
 	.llseek		= default_llseek,
 #endif // >= 2.6.37
@@ -255,6 +309,13 @@ int rrnotifyfs_create_file_perm(struct super_block * sb, struct dentry * root,
 }
 
 
+int rrnotifyfs_create_ro_file(struct super_block * sb, struct dentry * root,
+	char const * name, const struct file_operations * fops, void * priv)
+{
+	return __rrnotifyfs_create_file(sb, root, name, fops, 0444, priv);
+}
+
+
 struct dentry * rrnotifyfs_mkdir(struct super_block * sb,
 	struct dentry * root, char const * name)
 {
@@ -338,6 +399,60 @@ static struct file_operations enable_fops = {
 };
 
 
+#define SNAPSHOT_MAX_TGIDS	64
+
+/* Write a list of tgids to snapshot their threads, or 0 for all. */
+static ssize_t snapshot_write(struct file * file, char const __user * buf, size_t count, loff_t * offset)
+{
+	pid_t tgids[SNAPSHOT_MAX_TGIDS];
+	char tmpbuf[512];
+	char * cursor = tmpbuf;
+	char * token;
+	char * end;
+	int nr_tgids = 0;
+	int retval;
+
+	if (*offset || count >= sizeof(tmpbuf)) {
+		return -EINVAL;
+	}
+
+	if (copy_from_user(tmpbuf, buf, count)) {
+		return -EFAULT;
+	}
+	tmpbuf[count] = '\0';
+
+	while ((token = strsep(&cursor, " \t\n,")) != NULL) {
+		unsigned long tgid;
+
+		if (!*token) {
+			continue;
+		}
+		tgid = simple_strtoul(token, &end, 0);
+		if (*end || nr_tgids == SNAPSHOT_MAX_TGIDS) {
+			return -EINVAL;
+		}
+		if (tgid) {
+			tgids[nr_tgids++] = tgid;
+		}
+	}
+
+	retval = rrnotify_snapshot(tgids, nr_tgids);
+	if (retval) {
+		return retval;
+	}
+
+	return count;
+}
+
+
+static struct file_operations snapshot_fops = {
+	.write		= snapshot_write,
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,37)
+	.llseek		= default_llseek,
+#endif // >= 2.6.37
+};
+
+
 static ssize_t debug_read(struct file * file, char __user * buf, size_t count, loff_t * offset)
 {
 	return rrnotifyfs_ulong_to_user(rrnotify_debug, buf, count, offset);
@@ -379,10 +494,123 @@ static struct file_operations debug_fops = {
 #endif // >= 2.6.37
 };
 
+#define CONFIG_LINE_SIZE 64
+
+/* config: one "name=value" line per setting */
+static ssize_t config_read(struct file * file, char __user * buf, size_t count, loff_t * offset)
+{
+	size_t size = ARRAY_SIZE(config_files) * CONFIG_LINE_SIZE;
+	size_t len = 0;
+	ssize_t retval;
+	char * text;
+	int i;
+
+	text = kmalloc(size, GFP_KERNEL);
+	if (!text)
+		return -ENOMEM;
+
+	for (i = 0; i < ARRAY_SIZE(config_files); i++) {
+		len += snprintf(text + len, size - len, "%s=%lu\n",
+			config_files[i].name, *config_files[i].val);
+	}
+
+	retval = simple_read_from_buffer(buf, count, offset, text, len);
+	kfree(text);
+	return retval;
+}
+
+
+/* Write any number of "name=value" pairs separated by white space or
+ * commas. They are applied together through rrnotify_set_ulongs(), so
+ * either all of them take effect or none does.
+ */
+static ssize_t config_write(struct file * file, char const __user * buf, size_t count, loff_t * offset)
+{
+	unsigned long * addrs[ARRAY_SIZE(config_files)];
+	unsigned long vals[ARRAY_SIZE(config_files)];
+	int is_set[ARRAY_SIZE(config_files)];
+	char * text, * cursor, * token;
+	int nr_set = 0;
+	int retval;
+	int i;
+
+	if (*offset)
+		return -EINVAL;
+
+	if (!count)
+		return 0;
+
+	if (count > PAGE_SIZE - 1)
+		return -EINVAL;
+
+	text = kmalloc(count + 1, GFP_KERNEL);
+	if (!text)
+		return -ENOMEM;
+
+	retval = -EFAULT;
+	if (copy_from_user(text, buf, count))
+		goto out;
+	text[count] = '\0';
+
+	memset(is_set, 0, sizeof(is_set));
+
+	retval = -EINVAL;
+	cursor = text;
+	while ((token = strsep(&cursor, " \t\n,")) != NULL) {
+		char * value;
+
+		if (!*token)
+			continue;
+
+		value = strchr(token, '=');
+		if (!value)
+			goto out;
+		*value++ = '\0';
+
+		for (i = 0; i < ARRAY_SIZE(config_files); i++) {
+			if (!strcmp(token, config_files[i].name))
+				break;
+		}
+		if (i == ARRAY_SIZE(config_files)) {
+			LOG_WARNING("unknown config setting '%s'", token);
+			goto out;
+		}
+
+		vals[i] = simple_strtoul(value, NULL, 0);
+		is_set[i] = 1;
+	}
+
+	for (i = 0; i < ARRAY_SIZE(config_files); i++) {
+		if (is_set[i]) {
+			addrs[nr_set] = config_files[i].val;
+			vals[nr_set] = vals[i];
+			nr_set++;
+		}
+	}
+
+	retval = rrnotify_set_ulongs(addrs, vals, nr_set);
+	if (!retval)
+		retval = count;
+
+out:
+	kfree(text);
+	return retval;
+}
+
+
+static struct file_operations config_fops = {
+	.read		= config_read,
+	.write		= config_write,
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,37)
+	.llseek		= default_llseek,
+#endif // >= 2.6.37
+};
+
 static int rrnotifyfs_fill_super(struct super_block * sb, void * data, int silent)
 {
 	struct inode * root_inode;
 	struct dentry * root_dentry;
+	int i;
 
 	sb->s_blocksize = PAGE_CACHE_SIZE;
 	sb->s_blocksize_bits = PAGE_CACHE_SHIFT;
@@ -410,9 +638,15 @@ static int rrnotifyfs_fill_super(struct super_block * sb, void * data, int silen
 	rrnotifyfs_create_file_perm(sb, root_dentry, "debug", &debug_fops, 0666);
 	rrnotifyfs_create_file_perm(sb, root_dentry, "enable", &enable_fops, 0666);
 	rrnotifyfs_create_file_perm(sb, root_dentry, "buffer", &event_buffer_fops, 0666);
-	rrnotifyfs_create_ulong(sb, root_dentry, "buffer_size", &fs_buffer_size);
-	rrnotifyfs_create_ulong(sb, root_dentry, "buffer_watershed", &fs_buffer_watershed);
+	for (i = 0; i < ARRAY_SIZE(config_files); i++) {
+		rrnotifyfs_create_ulong(sb, root_dentry, config_files[i].name,
+			config_files[i].val);
+	}
+	rrnotifyfs_create_file(sb, root_dentry, "config", &config_fops);
+	rrnotifyfs_create_file_perm(sb, root_dentry, "snapshot", &snapshot_fops, 0200);
 	rrnotifyfs_create_file(sb, root_dentry, "pointer_size", &pointer_size_fops);
+	spool_create_files(sb, root_dentry);
+	inject_create_files(sb, root_dentry);
 
 	rrnotify_create_stats_files(sb, root_dentry);
 
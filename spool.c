@@ -0,0 +1,411 @@
+/**
+ * @file spool.c
+ *
+ * @remark Copyright (C) 2006-2015 RotateRight, LLC
+ * @remark Read the file COPYING
+ *
+ * Daemon-less capture. With spooling on, a kernel thread owns the
+ * session whenever the buffer file is closed and streams the buffer to
+ * spool_path in large sequential writes, starting a new file
+ * (spool_path.N) once one holds spool_rotate_size bytes. Opening the buffer file
+ * hands the session to the reader once the thread has written out what
+ * it drained, so nothing is lost across daemon restarts.
+ *
+ * Each spool file, and the reader's stream after a handover, starts the
+ * stream over with its own headers and string and build-id definitions
+ * (sync_restart_stream()), so it decodes on its own.
+ */
+
+#include <linux/module.h>
+#include <linux/kthread.h>
+#include <linux/fs.h>
+#include <linux/file.h>
+#include <linux/dcookies.h>
+#include <linux/vmalloc.h>
+#include <linux/string.h>
+#include <linux/err.h>
+#include <linux/version.h>
+#include <asm/uaccess.h>
+
+#include "rrnotify.h"
+#include "rrnotify_stats.h"
+#include "logging.h"
+#include "event_buffer.h"
+#include "spool.h"
+
+#define SPOOL_PATH_LEN		256
+/* drain at least this often when the watershed isn't reached */
+#define SPOOL_INTERVAL		HZ
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,37)
+static DEFINE_SEMAPHORE(spool_sem);
+#else
+static DECLARE_MUTEX(spool_sem);
+#endif
+
+static char spool_path[SPOOL_PATH_LEN];
+module_param_string(spool_path, spool_path, SPOOL_PATH_LEN, 0444);
+MODULE_PARM_DESC(spool_path, "spool captured records to this file from module load on");
+
+static unsigned long spool_enabled;
+static struct task_struct * spool_task;
+/* dcookie user on behalf of the spool, held while spooling is enabled */
+static struct dcookie_user * spool_dcookie;
+
+/* the spool thread's state */
+static struct file * spool_file;
+static loff_t spool_file_pos;
+static unsigned long spool_file_index;
+static void * spool_data;
+static size_t spool_data_size;
+
+
+void spool_lock(void)
+{
+	down(&spool_sem);
+}
+
+
+void spool_unlock(void)
+{
+	up(&spool_sem);
+}
+
+
+static ssize_t spool_write_file(void const * buf, size_t count)
+{
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4,14,0)
+	return kernel_write(spool_file, buf, count, &spool_file_pos);
+#elif LINUX_VERSION_CODE >= KERNEL_VERSION(3,9,0)
+	ssize_t ret = kernel_write(spool_file, buf, count, spool_file_pos);
+	if (ret > 0)
+		spool_file_pos += ret;
+	return ret;
+#else
+	mm_segment_t old_fs = get_fs();
+	ssize_t ret;
+
+	set_fs(KERNEL_DS);
+	ret = vfs_write(spool_file, (char __user const *)buf, count, &spool_file_pos);
+	set_fs(old_fs);
+	return ret;
+#endif
+}
+
+
+static void spool_close_file(void)
+{
+	if (spool_file) {
+		filp_close(spool_file, NULL);
+		spool_file = NULL;
+	}
+}
+
+
+/* The next spool_path.N that doesn't exist yet, so the files of an
+ * earlier capture, e.g. before the module was reloaded, are kept.
+ */
+static int spool_open_file(void)
+{
+	char name[SPOOL_PATH_LEN + 24];
+
+	do {
+		snprintf(name, sizeof(name), "%s.%lu", spool_path, spool_file_index++);
+		spool_file = filp_open(name, O_WRONLY | O_CREAT | O_EXCL | O_LARGEFILE, 0600);
+	} while (IS_ERR(spool_file) && PTR_ERR(spool_file) == -EEXIST);
+
+	if (IS_ERR(spool_file)) {
+		LOG_ERROR("failed to open spool file %s (%ld)", name, PTR_ERR(spool_file));
+		spool_file = NULL;
+		return -EIO;
+	}
+	spool_file_pos = 0;
+	atomic_inc(&rrnotify_stats.spool_files);
+	return 0;
+}
+
+
+/* Move what is in the event buffer to the spool file. With last set,
+ * the stream is started over behind it for the reader taking over.
+ */
+static void spool_drain(int last)
+{
+	size_t count;
+	int restart;
+
+	if (spool_data_size < event_buffer_bytes()) {
+		/* the buffer was resized */
+		vfree(spool_data);
+		spool_data_size = event_buffer_bytes();
+		spool_data = vmalloc(spool_data_size);
+		if (!spool_data) {
+			spool_data_size = 0;
+			goto fail;
+		}
+	}
+
+	for (;;) {
+		/* Open before draining: if that fails the data stays in the
+		 * buffer until the next interval, and records that don't fit
+		 * meanwhile are accounted for in LOST records. */
+		if (!spool_file && spool_open_file()) {
+			atomic_inc(&rrnotify_stats.spool_write_error);
+			goto fail;
+		}
+
+		/* a full file ends with the stream, the next one starts it over */
+		restart = last || (fs_spool_rotate_size && spool_file_pos >= fs_spool_rotate_size);
+		count = event_buffer_drain(spool_data, spool_data_size, &restart);
+
+		if (count && spool_write_file(spool_data, count) != count)
+			atomic_inc(&rrnotify_stats.spool_write_error);
+
+		if (restart) {
+			spool_close_file();
+			if (last)
+				return;
+		}
+		if (!count)
+			return;
+	}
+
+fail:
+	/* the reader can't pick up a stream that began in the spool */
+	if (last)
+		event_buffer_restart();
+}
+
+
+static int spool_thread(void * data)
+{
+	while (!kthread_should_stop()) {
+		event_buffer_wait_timeout(SPOOL_INTERVAL);
+		spool_drain(0);
+	}
+
+	/* hand over an empty buffer and a fresh stream */
+	spool_drain(1);
+	spool_close_file();
+	return 0;
+}
+
+
+static int spool_start_thread(void)
+{
+	struct task_struct * task = kthread_run(spool_thread, NULL, "rrnotify_spool");
+
+	if (IS_ERR(task))
+		return PTR_ERR(task);
+	spool_task = task;
+	return 0;
+}
+
+
+static void spool_stop_thread(void)
+{
+	if (spool_task) {
+		kthread_stop(spool_task);
+		spool_task = NULL;
+	}
+}
+
+
+int spool_suspend(void)
+{
+	if (!spool_task)
+		return 0;
+	spool_stop_thread();
+	return 1;
+}
+
+
+int spool_resume(void)
+{
+	if (!spool_enabled)
+		return 0;
+	/* what the reader left unread is dropped, as when a session ends */
+	event_buffer_restart();
+	return spool_start_thread() == 0;
+}
+
+
+/* Called with spool_sem held. */
+static int spool_enable(void)
+{
+	int err;
+
+	if (spool_enabled)
+		return 0;
+
+	if (!spool_path[0])
+		return -EINVAL;
+
+	spool_dcookie = dcookie_register();
+	if (!spool_dcookie)
+		return -ENOMEM;
+
+	spool_enabled = 1;
+
+	/* a reader is attached, take over when it goes away */
+	if (event_buffer_reader_attached())
+		return 0;
+
+	if ((err = rrnotify_setup()))
+		goto fail;
+
+	if ((err = rrnotify_start()))
+		goto fail_shutdown;
+
+	if ((err = spool_start_thread()))
+		goto fail_stop;
+
+	return 0;
+
+fail_stop:
+	rrnotify_stop();
+fail_shutdown:
+	rrnotify_shutdown();
+fail:
+	spool_enabled = 0;
+	dcookie_unregister(spool_dcookie);
+	spool_dcookie = NULL;
+	return err;
+}
+
+
+/* Called with spool_sem held. */
+static void spool_disable(void)
+{
+	if (!spool_enabled)
+		return;
+
+	spool_enabled = 0;
+
+	if (spool_task) {
+		spool_stop_thread();
+		rrnotify_stop();
+		rrnotify_shutdown();
+	}
+
+	dcookie_unregister(spool_dcookie);
+	spool_dcookie = NULL;
+
+	vfree(spool_data);
+	spool_data = NULL;
+	spool_data_size = 0;
+}
+
+
+void spool_init(void)
+{
+	int err;
+
+	if (!spool_path[0])
+		return;
+
+	spool_lock();
+	if ((err = spool_enable()))
+		LOG_ERROR("failed to start spooling to %s (%d)", spool_path, err);
+	spool_unlock();
+}
+
+
+void spool_exit(void)
+{
+	spool_lock();
+	spool_disable();
+	spool_unlock();
+}
+
+
+static ssize_t spool_read(struct file * file, char __user * buf, size_t count, loff_t * offset)
+{
+	return rrnotifyfs_ulong_to_user(spool_enabled, buf, count, offset);
+}
+
+
+static ssize_t spool_write(struct file * file, char const __user * buf, size_t count, loff_t * offset)
+{
+	unsigned long val;
+	int retval;
+
+	if (*offset)
+		return -EINVAL;
+
+	retval = rrnotifyfs_ulong_from_user(&val, buf, count);
+	if (retval)
+		return retval;
+
+	spool_lock();
+	if (val)
+		retval = spool_enable();
+	else
+		spool_disable();
+	spool_unlock();
+
+	return retval ? retval : count;
+}
+
+
+static struct file_operations spool_fops = {
+	.read		= spool_read,
+	.write		= spool_write,
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,37)
+	.llseek		= default_llseek,
+#endif // >= 2.6.37
+};
+
+
+static ssize_t spool_path_read(struct file * file, char __user * buf, size_t count, loff_t * offset)
+{
+	char tmpbuf[SPOOL_PATH_LEN + 1];
+	size_t len;
+
+	spool_lock();
+	len = snprintf(tmpbuf, sizeof(tmpbuf), "%s\n", spool_path);
+	spool_unlock();
+
+	return simple_read_from_buffer(buf, count, offset, tmpbuf, len);
+}
+
+
+static ssize_t spool_path_write(struct file * file, char const __user * buf, size_t count, loff_t * offset)
+{
+	char tmpbuf[SPOOL_PATH_LEN];
+	int retval = -EBUSY;
+
+	if (*offset || count > SPOOL_PATH_LEN - 1)
+		return -EINVAL;
+
+	if (copy_from_user(tmpbuf, buf, count))
+		return -EFAULT;
+	tmpbuf[count] = '\0';
+	if (count && tmpbuf[count - 1] == '\n')
+		tmpbuf[count - 1] = '\0';
+
+	spool_lock();
+	if (!spool_enabled) {
+		strcpy(spool_path, tmpbuf);
+		spool_file_index = 0;
+		retval = count;
+	}
+	spool_unlock();
+
+	return retval;
+}
+
+
+static struct file_operations spool_path_fops = {
+	.read		= spool_path_read,
+	.write		= spool_path_write,
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,37)
+	.llseek		= default_llseek,
+#endif // >= 2.6.37
+};
+
+
+void spool_create_files(struct super_block * sb, struct dentry * root)
+{
+	rrnotifyfs_create_file_perm(sb, root, "spool", &spool_fops, 0644);
+	rrnotifyfs_create_file_perm(sb, root, "spool_path", &spool_path_fops, 0644);
+}
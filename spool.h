@@ -0,0 +1,36 @@
+/**
+ * @file spool.h
+ *
+ * @remark Copyright (C) 2006-2015 RotateRight, LLC
+ * @remark Read the file COPYING
+ */
+
+#ifndef RRNOTIFY_SPOOL_H_
+#define RRNOTIFY_SPOOL_H_
+
+/* serialises spooling against opening and closing the buffer file */
+void spool_lock(void);
+void spool_unlock(void);
+
+/* Called with spool_lock() held when the buffer file is opened: stops
+ * the spool thread and returns 1 if it was running the session.
+ */
+int spool_suspend(void);
+
+/* Called with spool_lock() held when the buffer file is closed: returns
+ * 1 if the spool thread took the session over.
+ */
+int spool_resume(void);
+
+/* start spooling from module load if spool_path was given */
+void spool_init(void);
+
+/* stop spooling and end its session */
+void spool_exit(void);
+
+struct super_block;
+struct dentry;
+
+void spool_create_files(struct super_block * sb, struct dentry * root);
+
+#endif /* RRNOTIFY_SPOOL_H_ */
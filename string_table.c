@@ -0,0 +1,206 @@
+/**
+ * @file string_table.c
+ *
+ * @remark Copyright (C) 2006-2015 RotateRight, LLC
+ * @remark Read the file COPYING
+ *
+ * Strings such as thread names and command lines are interned per
+ * session: the first record to use one carries its definition, later
+ * ones only its id. A workload that starts the same command over and
+ * over then costs a word per string and record. When the table fills
+ * up it starts over; ids keep increasing, so a consumer never sees an
+ * id defined twice. Each part of the event buffer is a stream of its
+ * own, so a string is defined once in each part that uses it, usually
+ * with the same id. The writers of the parts share the table and each
+ * keep the definitions of the record they are writing to themselves.
+ */
+
+#include <linux/jhash.h>
+#include <linux/string.h>
+#include <linux/spinlock.h>
+
+#include "event_buffer.h"
+#include "rrnotify_stats.h"
+#include "string_table.h"
+
+#define STRING_HASH_BITS	12
+#define STRING_HASH_SIZE	(1 << STRING_HASH_BITS)
+#define STRING_MAX_PROBES	16
+#define STRING_ARENA_SIZE	(128 * 1024)
+#define MAX_PENDING			4
+/* a record defines its comm and command line at most */
+#define PENDING_BYTES		(STRING_MAX_LEN + 64)
+
+struct string_slot {
+	u32 hash;
+	u32 len;
+	u32 offset;			/* into arena, or the pending bytes */
+	unsigned long id;	/* 0 is empty */
+	unsigned long buffers;	/* parts of the event buffer defining it */
+};
+
+/* The table is protected by table_lock. */
+static DEFINE_SPINLOCK(table_lock);
+
+static struct string_slot slots[STRING_HASH_SIZE];
+static char arena[STRING_ARENA_SIZE];
+static size_t arena_used;
+static unsigned long next_id;
+
+/* Strings defined in the record being written to a part, only touched
+ * by the writer holding the part's lock.
+ */
+static struct pending_strings {
+	struct string_slot slots[MAX_PENDING];
+	int nr;
+	size_t bytes;
+	/* definitions written in the record, including uncached ones */
+	int nr_defined;
+	char data[PENDING_BYTES];
+} pending[EVENT_MAX_BUFFERS];
+
+
+static void string_table_reset(void)
+{
+	memset(slots, 0, sizeof(slots));
+	arena_used = 0;
+}
+
+
+void string_table_start(void)
+{
+	int i;
+
+	spin_lock(&table_lock);
+	string_table_reset();
+	next_id = 1;
+	spin_unlock(&table_lock);
+
+	for (i = 0; i < EVENT_MAX_BUFFERS; i++) {
+		pending[i].nr = 0;
+		pending[i].bytes = 0;
+		pending[i].nr_defined = 0;
+	}
+}
+
+
+static inline int slot_matches(struct string_slot const * slot, char const * data,
+	u32 hash, char const * str, size_t len)
+{
+	return slot->hash == hash && slot->len == len
+		&& !memcmp(data + slot->offset, str, len);
+}
+
+
+/* Returns the slot holding the string, or the empty slot it would go
+ * in. Called with table_lock held.
+ */
+static struct string_slot * find_slot(u32 hash, char const * str, size_t len)
+{
+	int i;
+
+	for (i = 0; i < STRING_MAX_PROBES; i++) {
+		struct string_slot * slot = &slots[(hash + i) & (STRING_HASH_SIZE - 1)];
+		if (!slot->id || slot_matches(slot, arena, hash, str, len))
+			return slot;
+	}
+	return NULL;
+}
+
+
+unsigned long string_table_intern(int buffer, char const * str, size_t len, int * is_new)
+{
+	struct pending_strings * p = &pending[buffer];
+	struct string_slot * slot;
+	struct string_slot * def;
+	unsigned long id;
+	u32 hash;
+	int i;
+
+	*is_new = 0;
+	if (!len)
+		return 0;
+	if (len > STRING_MAX_LEN)
+		len = STRING_MAX_LEN;
+
+	hash = jhash(str, len, 0);
+	for (i = 0; i < p->nr; i++) {
+		if (slot_matches(&p->slots[i], p->data, hash, str, len))
+			return p->slots[i].id;
+	}
+
+	spin_lock(&table_lock);
+	slot = find_slot(hash, str, len);
+	if (slot && slot->id) {
+		id = slot->id;
+		if (slot->buffers & (1UL << buffer)) {
+			spin_unlock(&table_lock);
+			return id;
+		}
+	} else {
+		id = next_id++;
+	}
+	spin_unlock(&table_lock);
+
+	*is_new = 1;
+	p->nr_defined++;
+
+	if (p->nr == MAX_PENDING || p->bytes + len > PENDING_BYTES)
+		return id;
+
+	def = &p->slots[p->nr++];
+	def->hash = hash;
+	def->len = len;
+	def->offset = p->bytes;
+	def->id = id;
+	memcpy(p->data + p->bytes, str, len);
+	p->bytes += len;
+
+	return id;
+}
+
+
+/* Called with table_lock held. */
+static void commit_string(struct string_slot const * def, char const * str,
+	unsigned long buffer)
+{
+	struct string_slot * slot = find_slot(def->hash, str, def->len);
+
+	if (slot && slot->id) {
+		/* another part may have defined it under an id of its own
+		 * meanwhile; this one then defines that one as well later */
+		if (slot->id == def->id)
+			slot->buffers |= buffer;
+		return;
+	}
+
+	if (!slot || arena_used + def->len > STRING_ARENA_SIZE) {
+		string_table_reset();
+		atomic_inc(&rrnotify_stats.string_table_reset);
+		slot = find_slot(def->hash, str, def->len);
+	}
+
+	*slot = *def;
+	slot->offset = arena_used;
+	slot->buffers = buffer;
+	memcpy(arena + arena_used, str, def->len);
+	arena_used += def->len;
+}
+
+
+void string_table_record_done(int buffer, int err)
+{
+	struct pending_strings * p = &pending[buffer];
+	int i;
+
+	if (!err) {
+		spin_lock(&table_lock);
+		for (i = 0; i < p->nr; i++)
+			commit_string(&p->slots[i], p->data + p->slots[i].offset, 1UL << buffer);
+		spin_unlock(&table_lock);
+		atomic_add(p->nr_defined, &rrnotify_stats.string_defined);
+	}
+	p->nr = 0;
+	p->bytes = 0;
+	p->nr_defined = 0;
+}
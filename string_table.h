@@ -0,0 +1,31 @@
+/**
+ * @file string_table.h
+ *
+ * @remark Copyright (C) 2006-2015 RotateRight, LLC
+ * @remark Read the file COPYING
+ */
+
+#ifndef RRNOTIFY_STRING_TABLE_H_
+#define RRNOTIFY_STRING_TABLE_H_
+
+#include <linux/types.h>
+
+/* longest string interned, longer ones are cut */
+#define STRING_MAX_LEN		1024
+
+/* forget the strings defined in the previous session */
+void string_table_start(void);
+
+/* Id of a string, 0 for none. *is_new is set if the string has no
+ * definition in the given part of the event buffer yet; the caller
+ * writes one in the current record. Called with the part locked, inside
+ * a record.
+ */
+unsigned long string_table_intern(int buffer, char const * str, size_t len, int * is_new);
+
+/* Called with the result of event_buffer_end_record(): strings first
+ * defined in a record that was dropped are defined again next time.
+ */
+void string_table_record_done(int buffer, int err);
+
+#endif /* RRNOTIFY_STRING_TABLE_H_ */
@@ -0,0 +1,86 @@
+#!/bin/sh
+#
+# Run the tools over streams from rrgen: capture, query, analyze and
+# compare.
+# Run by "make check" from this directory.
+#
+
+set -e
+
+tmp=$(mktemp -d)
+trap 'rm -rf "$tmp"' EXIT
+failed=0
+
+fail()
+{
+	echo "FAIL: $*"
+	failed=1
+}
+
+expect_lines()
+{
+	what=$1 want=$2 file=$3
+	got=$(grep -vc '^	' "$file" || true)
+	[ "$got" = "$want" ] || fail "$what: $got exits, expected $want"
+}
+
+# read and write the little endian integers of a capture header
+read_u64()
+{
+	od -An -tu8 -j "$2" -N 8 "$1" | tr -d ' '
+}
+
+poke()
+{
+	printf "$3" | dd of="$1" bs=1 seek="$2" conv=notrunc 2>/dev/null
+}
+
+./rrgen > "$tmp/raw.rr" 2>/dev/null
+./rrgen -c > "$tmp/chunked.rr" 2>/dev/null
+
+for s in raw chunked; do
+	./rrcapture -o "$tmp/$s.cap" "$tmp/$s.rr" 2>/dev/null
+	./rrcapture -q "$tmp/$s.cap" -m > "$tmp/$s.all"
+	expect_lines "$s all" 5000 "$tmp/$s.all"
+	./rrcapture -q "$tmp/$s.cap" -p 103 > "$tmp/$s.tgid"
+	expect_lines "$s -p 103" 500 "$tmp/$s.tgid"
+	grep -v ' tgid 103 ' "$tmp/$s.tgid" > /dev/null && fail "$s -p 103: other tgids"
+	./rrcapture -q "$tmp/$s.cap" -t 1.1,1.199 > "$tmp/$s.time"
+	expect_lines "$s -t 1.1,1.199" 100 "$tmp/$s.time"
+	# continued module lists are joined back up
+	[ "$(grep -c '	600000-621000' "$tmp/$s.all")" = 714 ] \
+		|| fail "$s: continued module lists not joined"
+done
+cmp -s "$tmp/raw.all" "$tmp/chunked.all" || fail "chunked and raw captures differ"
+
+# parallel decoding gives the same report at any thread count
+for s in raw chunked; do
+	./rranalyze -j1 "$tmp/$s.rr" > "$tmp/$s.j1"
+	head -n 1 "$tmp/$s.j1" | grep -q '^5000 exits, 3 lost,' \
+		|| fail "$s rranalyze: $(head -n 1 "$tmp/$s.j1")"
+	for j in 2 3 8; do
+		./rranalyze -j$j "$tmp/$s.rr" | cmp -s - "$tmp/$s.j1" \
+			|| fail "$s rranalyze -j$j differs from -j1"
+	done
+done
+cmp -s "$tmp/raw.j1" "$tmp/chunked.j1" || fail "rranalyze: chunked and raw reports differ"
+
+# a header_size past the end of the file
+cp "$tmp/raw.cap" "$tmp/bad.cap"
+poke "$tmp/bad.cap" 12 '\377\377\377\177'
+if ./rrcapture -q "$tmp/bad.cap" > /dev/null 2>&1; then
+	fail "bad header_size accepted"
+elif [ $? -gt 128 ]; then
+	fail "bad header_size crashed rrcapture"
+fi
+
+# a tgid index pointing past the time index
+cp "$tmp/raw.cap" "$tmp/bad.cap"
+tgid_index=$(read_u64 "$tmp/bad.cap" 112)
+poke "$tmp/bad.cap" $((tgid_index + 8)) '\000\000\000\020\000\000\000\000'
+status=0
+./rrcapture -q "$tmp/bad.cap" -p 100 > /dev/null 2>&1 || status=$?
+[ $status -le 128 ] || fail "bad tgid index crashed rrcapture"
+
+[ $failed = 0 ] && echo "all checks passed"
+exit $failed
@@ -0,0 +1,596 @@
+/**
+ * @file rranalyze.c
+ * Parallel rollups over a raw buffer stream.
+ *
+ *   rranalyze [-j threads] [-n top] [-B] stream
+ *
+ * The mmapped stream is cut into pieces, several per thread, and each
+ * piece is moved to the first record boundary at or after its start
+ * (see rr_resync()). A piece holds the records that begin in it, the
+ * last of which may run into the next piece. Every thread starts on a
+ * contiguous run of pieces and, once out of work, steals from the far
+ * end of another thread's run. Each thread rolls up into its own
+ * tables, which are merged when all are done.
+ *
+ * Reported are the top binaries and processes by CPU time, the
+ * distribution of thread lifetimes and how many exits mapped each
+ * module. The stream carries no uid, so processes stand in for users.
+ * With -B the analysis is run at 1, 2, 4, ... threads and timed.
+ *
+ * @remark Copyright (C) 2006-2015 RotateRight, LLC
+ * @remark Read the file COPYING
+ */
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "rrdecode.h"
+
+#define PIECES_PER_THREAD	8
+#define LIFETIME_BUCKETS	64
+
+struct rollup {
+	uint64_t key;
+	uint64_t count;
+	uint64_t utime_us;
+	uint64_t stime_us;
+	uint64_t runtime_ns;
+};
+
+/* open addressing keyed by rollup.key, count 0 marks a free slot */
+struct table {
+	struct rollup * slots;
+	size_t size;
+	size_t used;
+};
+
+struct result {
+	struct table binaries;		/* by cookie of the main executable */
+	struct table processes;		/* by tgid */
+	struct table modules;		/* by cookie, count only */
+	uint64_t lifetime[LIFETIME_BUCKETS];	/* log2 of usecs */
+	uint64_t exits;
+	uint64_t lost;
+	uint64_t aggregated;
+	uint64_t errors;
+};
+
+/* a thread's run of pieces: it takes from head, thieves from tail */
+struct run {
+	pthread_mutex_t lock;
+	size_t head;
+	size_t tail;
+};
+
+struct worker {
+	pthread_t thread;
+	unsigned index;
+	struct result result;
+	uint64_t stolen;
+};
+
+static unsigned long const * words;
+static size_t nr_words;
+static struct rr_decoder stream_settings;
+static size_t * piece_start;
+static size_t nr_pieces;
+static struct run * runs;
+static unsigned nr_threads;
+
+
+static void die(char const * what)
+{
+	fprintf(stderr, "rranalyze: %s: %s\n", what, strerror(errno));
+	exit(1);
+}
+
+
+static uint64_t hash_u64(uint64_t val)
+{
+	val ^= val >> 33;
+	val *= 0xff51afd7ed558ccdULL;
+	val ^= val >> 33;
+	return val;
+}
+
+
+static struct rollup * table_get(struct table * table, uint64_t key);
+
+static void table_grow(struct table * table)
+{
+	struct table old = *table;
+	size_t i;
+
+	table->size = old.size ? old.size * 2 : 256;
+	table->used = 0;
+	table->slots = calloc(table->size, sizeof(*table->slots));
+	if (!table->slots)
+		die("out of memory");
+
+	for (i = 0; i < old.size; i++) {
+		if (old.slots[i].count)
+			*table_get(table, old.slots[i].key) = old.slots[i];
+	}
+	free(old.slots);
+}
+
+
+static struct rollup * table_get(struct table * table, uint64_t key)
+{
+	size_t slot;
+
+	if ((table->used + 1) * 2 > table->size)
+		table_grow(table);
+
+	slot = hash_u64(key) & (table->size - 1);
+	while (table->slots[slot].count && table->slots[slot].key != key)
+		slot = (slot + 1) & (table->size - 1);
+
+	if (!table->slots[slot].count) {
+		table->slots[slot].key = key;
+		table->used++;
+	}
+	return &table->slots[slot];
+}
+
+
+static void table_merge(struct table * into, struct table const * from)
+{
+	size_t i;
+
+	for (i = 0; i < from->size; i++) {
+		struct rollup const * src = &from->slots[i];
+		struct rollup * dst;
+
+		if (!src->count)
+			continue;
+		dst = table_get(into, src->key);
+		dst->count += src->count;
+		dst->utime_us += src->utime_us;
+		dst->stime_us += src->stime_us;
+		dst->runtime_ns += src->runtime_ns;
+	}
+}
+
+
+static void table_free(struct table * table)
+{
+	free(table->slots);
+	memset(table, 0, sizeof(*table));
+}
+
+
+static void add_cpu(struct table * table, uint64_t key, struct rr_thread_info const * info)
+{
+	struct rollup * r = table_get(table, key);
+
+	r->count++;
+	r->utime_us += info->utime_us;
+	r->stime_us += info->stime_us;
+	r->runtime_ns += info->runtime_ns;
+}
+
+
+/* each module once per list block */
+static void add_modules(struct result * res, struct rr_record const * rec)
+{
+	unsigned long i, j;
+
+	for (i = 0; i < rec->nr_modules; i++) {
+		unsigned long cookie = rec->modules[i * RR_MODULE_WORDS + 3];
+
+		for (j = 0; j < i; j++) {
+			if (rec->modules[j * RR_MODULE_WORDS + 3] == cookie)
+				break;
+		}
+		if (j == i)
+			table_get(&res->modules, cookie)->count++;
+	}
+}
+
+
+static void add_exit(struct result * res, struct rr_record const * rec)
+{
+	struct rr_thread_info const * info = &rec->info;
+	unsigned long binary = RR_NO_COOKIE;
+	unsigned long i;
+	int bucket = 0;
+
+	for (i = 0; i < rec->nr_modules; i++) {
+		unsigned long const * entry = rec->modules + i * RR_MODULE_WORDS;
+
+		if (entry[2] & RR_VM_EXECUTABLE) {
+			binary = entry[3];
+			break;
+		}
+	}
+
+	add_cpu(&res->binaries, binary, info);
+	add_cpu(&res->processes, info->tgid, info);
+	add_modules(res, rec);
+
+	if (info->end_ns > info->start_ns) {
+		uint64_t usecs = (info->end_ns - info->start_ns) / 1000;
+
+		if (usecs)
+			bucket = 64 - __builtin_clzll(usecs);
+	}
+	res->lifetime[bucket]++;
+	res->exits++;
+}
+
+
+static void account(struct result * res, struct rr_record const * rec)
+{
+	switch (rec->code) {
+	case RRNOTIFY_RECORD_BEGIN:
+		add_exit(res, rec);
+		break;
+	case RRNOTIFY_MODULE_CONT_BEGIN:
+		add_modules(res, rec);
+		break;
+	case RRNOTIFY_LOST_BEGIN:
+		res->lost += rec->lost_count;
+		break;
+	case RRNOTIFY_AGGREGATE_BEGIN:
+		res->aggregated++;
+		break;
+	}
+}
+
+
+static void decode_piece(struct result * res, size_t piece)
+{
+	struct rr_decoder dec = stream_settings;
+	size_t pos = rr_resync(&stream_settings, words, nr_words, piece_start[piece]);
+	size_t end = piece + 1 < nr_pieces
+		? rr_resync(&stream_settings, words, nr_words, piece_start[piece + 1]) : nr_words;
+
+	while (pos < end || dec.chunk_pos < dec.chunk_words) {
+		struct rr_record rec;
+		size_t used;
+		int ret = rr_decode(&dec, words + pos, nr_words - pos, &rec, &used);
+
+		pos += used;
+		if (ret == RR_DECODE_RECORD) {
+			account(res, &rec);
+			continue;
+		}
+		/* a stream cut off mid record */
+		if (ret == RR_DECODE_MORE)
+			break;
+
+		res->errors++;
+		dec.chunk_pos = dec.chunk_words = 0;
+		pos = rr_resync(&stream_settings, words, nr_words, pos + 1);
+	}
+
+	rr_decoder_free(&dec);
+}
+
+
+static int take_piece(struct run * run, size_t * piece, int steal)
+{
+	int ret = 0;
+
+	pthread_mutex_lock(&run->lock);
+	if (run->head < run->tail) {
+		*piece = steal ? --run->tail : run->head++;
+		ret = 1;
+	}
+	pthread_mutex_unlock(&run->lock);
+	return ret;
+}
+
+
+/* Pieces are only ever taken, so a sweep that finds every run empty
+ * means the work is done.
+ */
+static void * worker_fn(void * arg)
+{
+	struct worker * w = arg;
+	size_t piece = 0;
+
+	for (;;) {
+		unsigned i;
+
+		if (take_piece(&runs[w->index], &piece, 0)) {
+			decode_piece(&w->result, piece);
+			continue;
+		}
+
+		for (i = 1; i < nr_threads; i++) {
+			if (take_piece(&runs[(w->index + i) % nr_threads], &piece, 1))
+				break;
+		}
+		if (i == nr_threads)
+			break;
+		w->stolen++;
+		decode_piece(&w->result, piece);
+	}
+
+	return NULL;
+}
+
+
+static void free_result(struct result * res)
+{
+	table_free(&res->binaries);
+	table_free(&res->processes);
+	table_free(&res->modules);
+}
+
+
+static void merge_result(struct result * into, struct result const * from)
+{
+	int i;
+
+	table_merge(&into->binaries, &from->binaries);
+	table_merge(&into->processes, &from->processes);
+	table_merge(&into->modules, &from->modules);
+	for (i = 0; i < LIFETIME_BUCKETS; i++)
+		into->lifetime[i] += from->lifetime[i];
+	into->exits += from->exits;
+	into->lost += from->lost;
+	into->aggregated += from->aggregated;
+	into->errors += from->errors;
+}
+
+
+/* Analyze with threads threads, the merged result in *res. */
+static uint64_t analyze(unsigned threads, struct result * res)
+{
+	struct worker * workers = calloc(threads, sizeof(*workers));
+	uint64_t stolen = 0;
+	unsigned i;
+
+	if (!workers)
+		die("out of memory");
+
+	nr_threads = threads;
+	nr_pieces = (size_t)threads * PIECES_PER_THREAD;
+	if (nr_pieces > nr_words)
+		nr_pieces = nr_words ? nr_words : 1;
+	piece_start = realloc(piece_start, nr_pieces * sizeof(*piece_start));
+	runs = realloc(runs, threads * sizeof(*runs));
+	if (!piece_start || !runs)
+		die("out of memory");
+
+	for (i = 0; i < nr_pieces; i++)
+		piece_start[i] = (uint64_t)nr_words * i / nr_pieces;
+	for (i = 0; i < threads; i++) {
+		pthread_mutex_init(&runs[i].lock, NULL);
+		runs[i].head = (uint64_t)nr_pieces * i / threads;
+		runs[i].tail = (uint64_t)nr_pieces * (i + 1) / threads;
+	}
+
+	for (i = 0; i < threads; i++) {
+		workers[i].index = i;
+		if (pthread_create(&workers[i].thread, NULL, worker_fn, &workers[i])) {
+			errno = EAGAIN;
+			die("starting threads");
+		}
+	}
+
+	memset(res, 0, sizeof(*res));
+	for (i = 0; i < threads; i++) {
+		pthread_join(workers[i].thread, NULL);
+		merge_result(res, &workers[i].result);
+		free_result(&workers[i].result);
+		stolen += workers[i].stolen;
+	}
+
+	for (i = 0; i < threads; i++)
+		pthread_mutex_destroy(&runs[i].lock);
+	free(workers);
+	return stolen;
+}
+
+
+static struct rollup * sorted(struct table const * table, int by_cpu)
+{
+	struct rollup * list = malloc((table->used + 1) * sizeof(*list));
+	size_t i, n = 0;
+
+	if (!list)
+		die("out of memory");
+	for (i = 0; i < table->size; i++) {
+		if (table->slots[i].count)
+			list[n++] = table->slots[i];
+	}
+
+	/* insertion into a heap would do, but the tables are small */
+	for (i = 1; i < n; i++) {
+		struct rollup r = list[i];
+		uint64_t key = by_cpu ? r.utime_us + r.stime_us : r.count;
+		size_t j = i;
+
+		while (j && (by_cpu ? list[j - 1].utime_us + list[j - 1].stime_us : list[j - 1].count) < key) {
+			list[j] = list[j - 1];
+			j--;
+		}
+		list[j] = r;
+	}
+	return list;
+}
+
+
+static void print_cpu_top(char const * title, struct table const * table, size_t top, int cookies)
+{
+	struct rollup * list = sorted(table, 1);
+	size_t i;
+
+	printf("\n%s\n%14s %14s %10s  %s\n", title, "user ms", "sys ms", "exits", cookies ? "binary" : "tgid");
+	for (i = 0; i < top && i < table->used; i++) {
+		char name[4096];
+
+		if (cookies)
+			rr_cookie_name(list[i].key, name, sizeof(name));
+		else
+			snprintf(name, sizeof(name), "%llu", (unsigned long long)list[i].key);
+		printf("%14.1f %14.1f %10llu  %s\n", list[i].utime_us / 1e3, list[i].stime_us / 1e3,
+			(unsigned long long)list[i].count, name);
+	}
+	free(list);
+}
+
+
+static void report(struct result const * res, size_t top)
+{
+	struct rollup * list;
+	uint64_t max = 0;
+	size_t i;
+	int last = 0;
+
+	printf("%llu exits, %llu lost, %llu aggregate records, %llu decode errors\n",
+		(unsigned long long)res->exits, (unsigned long long)res->lost,
+		(unsigned long long)res->aggregated, (unsigned long long)res->errors);
+
+	print_cpu_top("Binaries by CPU time", &res->binaries, top, 1);
+	print_cpu_top("Processes by CPU time", &res->processes, top, 0);
+
+	printf("\nThread lifetimes\n");
+	for (i = 0; i < LIFETIME_BUCKETS; i++) {
+		if (res->lifetime[i] > max)
+			max = res->lifetime[i];
+		if (res->lifetime[i])
+			last = i;
+	}
+	for (i = 0; i <= (size_t)last && max; i++) {
+		char const * bar = "##################################################";
+		int width = (int)(50 * res->lifetime[i] / max);
+
+		printf("%12s%-8llu %10llu %.*s\n", "< ", i ? 1ULL << i : 1ULL,
+			(unsigned long long)res->lifetime[i], width, bar);
+	}
+	printf("%21s\n", "usecs");
+
+	list = sorted(&res->modules, 0);
+	printf("\nModules by exits mapping them\n%10s  %s\n", "exits", "module");
+	for (i = 0; i < top && i < res->modules.used; i++) {
+		char name[4096];
+
+		rr_cookie_name(list[i].key, name, sizeof(name));
+		printf("%10llu  %s\n", (unsigned long long)list[i].count, name);
+	}
+	free(list);
+}
+
+
+static double now_sec(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+
+/* Scaling: the same analysis at doubling thread counts. */
+static void bench(unsigned max_threads)
+{
+	double base = 0;
+	unsigned threads;
+
+	printf("%8s %10s %10s %8s %8s\n", "threads", "seconds", "MB/s", "speedup", "steals");
+	for (threads = 1; ; threads *= 2) {
+		struct result res;
+		double start, secs;
+		uint64_t stolen;
+
+		if (threads > max_threads)
+			threads = max_threads;
+
+		start = now_sec();
+		stolen = analyze(threads, &res);
+		secs = now_sec() - start;
+		if (threads == 1)
+			base = secs;
+
+		printf("%8u %10.3f %10.1f %8.2f %8llu\n", threads, secs,
+			nr_words * sizeof(unsigned long) / secs / 1e6, base / secs,
+			(unsigned long long)stolen);
+		free_result(&res);
+
+		if (threads == max_threads)
+			break;
+	}
+}
+
+
+static void usage(void)
+{
+	fprintf(stderr,
+		"usage: rranalyze [-j threads] [-n top] [-B] <stream>\n"
+		"  -j  threads to decode with (default: online cpus)\n"
+		"  -n  entries in each top list (default 20)\n"
+		"  -B  time the analysis at 1, 2, 4, ... threads up to -j\n");
+	exit(2);
+}
+
+
+int main(int argc, char ** argv)
+{
+	long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+	unsigned threads = cpus > 0 ? cpus : 1;
+	size_t top = 20;
+	int do_bench = 0;
+	struct result res;
+	struct rr_record rec;
+	struct stat st;
+	size_t used;
+	void * map;
+	int opt, fd;
+
+	while ((opt = getopt(argc, argv, "j:n:B")) != -1) {
+		switch (opt) {
+		case 'j': threads = strtoul(optarg, NULL, 0); break;
+		case 'n': top = strtoul(optarg, NULL, 0); break;
+		case 'B': do_bench = 1; break;
+		default: usage();
+		}
+	}
+	if (optind + 1 != argc || !threads)
+		usage();
+
+	fd = open(argv[optind], O_RDONLY | O_CLOEXEC);
+	if (fd < 0 || fstat(fd, &st))
+		die(argv[optind]);
+	nr_words = st.st_size / sizeof(unsigned long);
+	if (!nr_words) {
+		fprintf(stderr, "rranalyze: %s is empty\n", argv[optind]);
+		return 1;
+	}
+	map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (map == MAP_FAILED)
+		die("mmap");
+	words = map;
+	madvise(map, st.st_size, MADV_WILLNEED);
+
+	/* every piece is decoded with the settings of the stream header */
+	rr_decoder_init(&stream_settings);
+	rr_decode(&stream_settings, words, nr_words, &rec, &used);
+	rr_decoder_free(&stream_settings);
+	stream_settings.chunk_alloc = stream_settings.chunk_words = stream_settings.chunk_pos = 0;
+
+	if (do_bench) {
+		bench(threads);
+	} else {
+		analyze(threads, &res);
+		report(&res, top);
+		free_result(&res);
+	}
+
+	munmap(map, st.st_size);
+	close(fd);
+	return 0;
+}
@@ -0,0 +1,197 @@
+/**
+ * @file rrcapfile.c
+ * Reading an indexed capture in place.
+ *
+ * @remark Copyright (C) 2006-2015 RotateRight, LLC
+ * @remark Read the file COPYING
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "rrcapture.h"
+
+static int section_fits(struct rrcap_file const * file, struct rrcap_section const * section,
+	size_t entry_size)
+{
+	return section->offset <= file->size
+		&& section->count <= (file->size - section->offset) / entry_size;
+}
+
+
+int rrcap_open(struct rrcap_file * file, char const * path)
+{
+	struct rrcap_header const * header;
+	struct stat st;
+	void * base;
+
+	memset(file, 0, sizeof(*file));
+
+	file->fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (file->fd < 0)
+		return -1;
+
+	if (fstat(file->fd, &st))
+		goto fail;
+	errno = EINVAL;
+	if ((size_t)st.st_size < RRCAP_HEADER_SIZE)
+		goto fail;
+
+	base = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, file->fd, 0);
+	if (base == MAP_FAILED)
+		goto fail;
+	file->base = base;
+	file->size = st.st_size;
+	header = (struct rrcap_header const *)file->base;
+	file->header = header;
+
+	errno = EINVAL;
+	if (header->magic != RRCAP_MAGIC || header->version != RRCAP_VERSION
+	    || header->block_size != RRCAP_BLOCK_SIZE
+	    || header->word_size != sizeof(unsigned long))
+		goto fail;
+	/* Everything below indexes off these, so a corrupt capture fails here. */
+	if (header->header_size < sizeof(*header) || header->header_size > file->size)
+		goto fail;
+	if (header->nr_blocks > (file->size - header->header_size) / header->block_size
+	    || !section_fits(file, &header->time_index, sizeof(struct rrcap_time_entry))
+	    || !section_fits(file, &header->tgid_index, sizeof(struct rrcap_tgid_entry))
+	    || !section_fits(file, &header->map_blocks, sizeof(uint64_t))
+	    || !section_fits(file, &header->modules, sizeof(struct rrcap_module))
+	    || !section_fits(file, &header->strings, 1))
+		goto fail;
+	/* Module paths are printed as C strings; the table must end in one. */
+	if (header->strings.count
+	    && file->base[header->strings.offset + header->strings.count - 1] != '\0')
+		goto fail;
+
+	return 0;
+
+fail:
+	rrcap_close(file);
+	return -1;
+}
+
+
+void rrcap_close(struct rrcap_file * file)
+{
+	int err = errno;
+
+	if (file->base)
+		munmap((void *)file->base, file->size);
+	if (file->fd >= 0)
+		close(file->fd);
+	memset(file, 0, sizeof(*file));
+	file->fd = -1;
+	errno = err;
+}
+
+
+struct rrcap_block_header const * rrcap_block(struct rrcap_file const * file, uint64_t block)
+{
+	if (block >= file->header->nr_blocks)
+		return NULL;
+	return (struct rrcap_block_header const *)(file->base + file->header->header_size
+		+ block * file->header->block_size);
+}
+
+
+struct rrcap_exit const * rrcap_block_records(struct rrcap_block_header const * block)
+{
+	return (struct rrcap_exit const *)(block + 1);
+}
+
+
+struct rrcap_map const * rrcap_map(struct rrcap_file const * file, uint64_t index)
+{
+	uint64_t const * map_blocks = (uint64_t const *)(file->base + file->header->map_blocks.offset);
+	uint64_t ordinal = index / RRCAP_MAPS_PER_BLOCK;
+	struct rrcap_block_header const * block;
+
+	if (ordinal >= file->header->map_blocks.count)
+		return NULL;
+	block = rrcap_block(file, map_blocks[ordinal]);
+	if (!block || index % RRCAP_MAPS_PER_BLOCK >= block->count)
+		return NULL;
+	return (struct rrcap_map const *)(block + 1) + index % RRCAP_MAPS_PER_BLOCK;
+}
+
+
+struct rrcap_module const * rrcap_module(struct rrcap_file const * file, uint32_t index)
+{
+	if (index >= file->header->modules.count)
+		return NULL;
+	return (struct rrcap_module const *)(file->base + file->header->modules.offset) + index;
+}
+
+
+char const * rrcap_module_path(struct rrcap_file const * file, struct rrcap_module const * module)
+{
+	if (module->path >= file->header->strings.count)
+		return "";
+	return (char const *)file->base + file->header->strings.offset + module->path;
+}
+
+
+/* hi_ns only grows and lo_ns only grows, so both ends are a binary
+ * search away.
+ */
+void rrcap_time_range(struct rrcap_file const * file, uint64_t from_ns, uint64_t to_ns,
+	uint64_t * first, uint64_t * last)
+{
+	struct rrcap_time_entry const * index =
+		(struct rrcap_time_entry const *)(file->base + file->header->time_index.offset);
+	uint64_t lo = 0, hi = file->header->time_index.count;
+
+	while (lo < hi) {
+		uint64_t mid = lo + (hi - lo) / 2;
+
+		if (index[mid].hi_ns < from_ns)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	*first = lo;
+
+	hi = file->header->time_index.count;
+	while (lo < hi) {
+		uint64_t mid = lo + (hi - lo) / 2;
+
+		if (index[mid].lo_ns <= to_ns)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	*last = lo;
+}
+
+
+struct rrcap_tgid_entry const * rrcap_tgid_blocks(struct rrcap_file const * file,
+	uint32_t tgid, size_t * count)
+{
+	struct rrcap_tgid_entry const * index =
+		(struct rrcap_tgid_entry const *)(file->base + file->header->tgid_index.offset);
+	uint64_t lo = 0, hi = file->header->tgid_index.count;
+	uint64_t first;
+
+	while (lo < hi) {
+		uint64_t mid = lo + (hi - lo) / 2;
+
+		if (index[mid].tgid < tgid)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	first = lo;
+
+	hi = file->header->tgid_index.count;
+	while (lo < hi && index[lo].tgid == tgid)
+		lo++;
+
+	*count = lo - first;
+	return *count ? index + first : NULL;
+}
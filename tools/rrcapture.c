@@ -0,0 +1,761 @@
+/**
+ * @file rrcapture.c
+ * Turn a raw buffer stream into an indexed capture, and query one.
+ *
+ *   rrcapture -o out.rrc [stream]     convert a stream (default stdin)
+ *   rrcapture -q in.rrc [-p tgid] [-t from,to] [-m]
+ *
+ * Exit and snapshot records become fixed-size entries. A record whose
+ * module list is continued is held back until its MODULE_CONT records
+ * have come in. Cookies are resolved to paths with lookup_dcookie(),
+ * which only works while the buffer file is still open, so convert
+ * live, e.g. rrcollect -o /dev/stdout | rrcapture -o out.rrc. Cookies
+ * that can't be resolved are kept as cookie:<hex>.
+ *
+ * @remark Copyright (C) 2006-2015 RotateRight, LLC
+ * @remark Read the file COPYING
+ */
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "rrcapture.h"
+#include "rrdecode.h"
+
+#define READ_CHUNK		(1 << 20)
+/* records later than this many others are written without the rest
+ * of their module list */
+#define PENDING_MAX_AGE	65536
+
+struct vec {
+	void * data;
+	size_t count;
+	size_t alloc;
+};
+
+struct pending {
+	struct rrcap_exit exit;
+	struct vec maps;		/* struct rrcap_map */
+	uint64_t since;			/* records seen when it came in */
+};
+
+static int out_fd = -1;
+static uint64_t next_block;
+static struct rrcap_header header;
+
+static union {
+	struct rrcap_block_header header;
+	unsigned char bytes[RRCAP_BLOCK_SIZE];
+} record_block, map_block;
+
+static struct vec time_index;	/* struct rrcap_time_entry */
+static struct vec tgid_index;	/* struct rrcap_tgid_entry */
+static struct vec map_blocks;	/* uint64_t */
+static struct vec modules;		/* struct rrcap_module */
+static struct vec strings;		/* char */
+static struct vec pending;		/* struct pending */
+static uint64_t records_seen;
+
+/* open addressing, index + 1 of the module or 0 */
+static uint32_t * cookie_hash;
+static uint32_t * path_hash;
+static size_t hash_size;
+
+
+static void die(char const * what)
+{
+	fprintf(stderr, "rrcapture: %s: %s\n", what, strerror(errno));
+	exit(1);
+}
+
+
+static void * vec_push(struct vec * vec, size_t size)
+{
+	if (vec->count == vec->alloc) {
+		size_t alloc = vec->alloc ? vec->alloc * 2 : 64;
+		void * data = realloc(vec->data, alloc * size);
+
+		if (!data)
+			die("out of memory");
+		vec->data = data;
+		vec->alloc = alloc;
+	}
+	return (char *)vec->data + vec->count++ * size;
+}
+
+
+static void write_at(void const * buf, size_t len, uint64_t offset)
+{
+	while (len) {
+		ssize_t ret = pwrite(out_fd, buf, len, offset);
+
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+			die("writing the capture");
+		}
+		buf = (char const *)buf + ret;
+		len -= ret;
+		offset += ret;
+	}
+}
+
+
+static uint64_t block_offset(uint64_t block)
+{
+	return RRCAP_HEADER_SIZE + block * RRCAP_BLOCK_SIZE;
+}
+
+
+/* Modules */
+
+static uint64_t hash_u64(uint64_t val)
+{
+	val ^= val >> 33;
+	val *= 0xff51afd7ed558ccdULL;
+	val ^= val >> 33;
+	return val;
+}
+
+
+static uint64_t hash_str(char const * str)
+{
+	uint64_t hash = 0xcbf29ce484222325ULL;
+
+	while (*str)
+		hash = (hash ^ (unsigned char)*str++) * 0x100000001b3ULL;
+	return hash;
+}
+
+
+static struct rrcap_module * module_at(uint32_t index)
+{
+	return (struct rrcap_module *)modules.data + index;
+}
+
+
+static char const * module_path(uint32_t index)
+{
+	return (char const *)strings.data + module_at(index)->path;
+}
+
+
+static void rehash(void)
+{
+	size_t i;
+
+	free(cookie_hash);
+	free(path_hash);
+	hash_size = hash_size ? hash_size * 2 : 1024;
+	cookie_hash = calloc(hash_size, sizeof(*cookie_hash));
+	path_hash = calloc(hash_size, sizeof(*path_hash));
+	if (!cookie_hash || !path_hash)
+		die("out of memory");
+
+	for (i = 0; i < modules.count; i++) {
+		size_t slot = hash_u64(module_at(i)->cookie) & (hash_size - 1);
+
+		while (cookie_hash[slot])
+			slot = (slot + 1) & (hash_size - 1);
+		cookie_hash[slot] = i + 1;
+
+		slot = hash_str(module_path(i)) & (hash_size - 1);
+		while (path_hash[slot])
+			slot = (slot + 1) & (hash_size - 1);
+		path_hash[slot] = i + 1;
+	}
+}
+
+
+/* Files are told apart by path, several cookies may share a module. */
+static uint32_t get_module(unsigned long cookie)
+{
+	struct rrcap_module * module;
+	char path[4096];
+	size_t slot, len, i;
+	uint32_t index;
+
+	if (!hash_size)
+		rehash();
+
+	slot = hash_u64(cookie) & (hash_size - 1);
+	while (cookie_hash[slot]) {
+		index = cookie_hash[slot] - 1;
+		if (module_at(index)->cookie == cookie)
+			return index;
+		slot = (slot + 1) & (hash_size - 1);
+	}
+
+	rr_cookie_name(cookie, path, sizeof(path));
+
+	slot = hash_str(path) & (hash_size - 1);
+	while (path_hash[slot]) {
+		index = path_hash[slot] - 1;
+		if (!strcmp(module_path(index), path))
+			return index;
+		slot = (slot + 1) & (hash_size - 1);
+	}
+
+	index = modules.count;
+	module = vec_push(&modules, sizeof(*module));
+	memset(module, 0, sizeof(*module));
+	module->cookie = cookie;
+	module->path = strings.count;
+	len = strlen(path);
+	module->path_len = len;
+	for (i = 0; i <= len; i++)
+		*(char *)vec_push(&strings, 1) = path[i];
+
+	if (modules.count * 2 > hash_size)
+		rehash();
+	else {
+		slot = hash_u64(cookie) & (hash_size - 1);
+		while (cookie_hash[slot])
+			slot = (slot + 1) & (hash_size - 1);
+		cookie_hash[slot] = index + 1;
+		slot = hash_str(path) & (hash_size - 1);
+		while (path_hash[slot])
+			slot = (slot + 1) & (hash_size - 1);
+		path_hash[slot] = index + 1;
+	}
+	return index;
+}
+
+
+static void add_build_ids(struct rr_record const * rec)
+{
+	unsigned long const * pos = rec->build_ids;
+	struct rr_build_id id;
+
+	while (rr_next_build_id(&pos, rec->build_ids_end, &id)) {
+		struct rrcap_module * module = module_at(get_module(id.cookie));
+
+		if (id.len > RRCAP_BUILD_ID_MAX)
+			continue;
+		module->build_id_len = id.len;
+		memcpy(module->build_id, id.id, id.len);
+	}
+}
+
+
+/* Blocks */
+
+static void flush_record_block(void)
+{
+	struct rrcap_block_header * block = &record_block.header;
+	struct rrcap_exit const * records = (struct rrcap_exit const *)(block + 1);
+	struct rrcap_time_entry * entry;
+	uint32_t i, j;
+
+	if (!block->count)
+		return;
+
+	block->type = RRCAP_BLOCK_RECORDS;
+	block->ordinal = time_index.count;
+	write_at(block, RRCAP_BLOCK_SIZE, block_offset(next_block));
+
+	entry = vec_push(&time_index, sizeof(*entry));
+	entry->block = next_block++;
+	entry->min_ns = block->min_ns;
+	entry->max_ns = block->max_ns;
+
+	/* one tgid entry per process in the block */
+	for (i = 0; i < block->count; i++) {
+		for (j = 0; j < i; j++) {
+			if (records[j].tgid == records[i].tgid)
+				break;
+		}
+		if (j == i) {
+			struct rrcap_tgid_entry * tgid = vec_push(&tgid_index, sizeof(*tgid));
+
+			tgid->tgid = records[i].tgid;
+			tgid->reserved = 0;
+			tgid->ordinal = block->ordinal;
+		}
+	}
+
+	memset(&record_block, 0, sizeof(record_block));
+}
+
+
+static void flush_map_block(void)
+{
+	struct rrcap_block_header * block = &map_block.header;
+
+	if (!block->count)
+		return;
+
+	block->type = RRCAP_BLOCK_MAPS;
+	block->ordinal = map_blocks.count;
+	write_at(block, RRCAP_BLOCK_SIZE, block_offset(next_block));
+	*(uint64_t *)vec_push(&map_blocks, sizeof(uint64_t)) = next_block++;
+
+	memset(&map_block, 0, sizeof(map_block));
+}
+
+
+static void emit_exit(struct rrcap_exit * exit_rec, struct rrcap_map const * maps, size_t nr_maps)
+{
+	struct rrcap_block_header * block = &record_block.header;
+	size_t i;
+
+	exit_rec->first_map = header.nr_maps;
+	exit_rec->nr_maps = nr_maps;
+	for (i = 0; i < nr_maps; i++) {
+		struct rrcap_map * slot = (struct rrcap_map *)(&map_block.header + 1) + map_block.header.count;
+
+		*slot = maps[i];
+		header.nr_maps++;
+		if (++map_block.header.count == RRCAP_MAPS_PER_BLOCK)
+			flush_map_block();
+	}
+
+	((struct rrcap_exit *)(block + 1))[block->count] = *exit_rec;
+	if (!block->count || exit_rec->end_ns < block->min_ns)
+		block->min_ns = exit_rec->end_ns;
+	if (exit_rec->end_ns > block->max_ns)
+		block->max_ns = exit_rec->end_ns;
+	if (!header.nr_records || exit_rec->end_ns < header.first_ns)
+		header.first_ns = exit_rec->end_ns;
+	if (exit_rec->end_ns > header.last_ns)
+		header.last_ns = exit_rec->end_ns;
+	header.nr_records++;
+
+	if (++block->count == RRCAP_RECORDS_PER_BLOCK)
+		flush_record_block();
+}
+
+
+/* Records */
+
+static void add_maps(struct vec * maps, struct rr_record const * rec)
+{
+	unsigned long i;
+
+	for (i = 0; i < rec->nr_modules; i++) {
+		unsigned long const * entry = rec->modules + i * RR_MODULE_WORDS;
+		struct rrcap_map * map = vec_push(maps, sizeof(*map));
+
+		map->start = entry[0];
+		map->end = entry[1];
+		map->flags = entry[2];
+		map->module = get_module(entry[3]);
+		map->offset = entry[4];
+	}
+}
+
+
+static void emit_pending(size_t index, uint32_t flags)
+{
+	struct pending * p = (struct pending *)pending.data + index;
+
+	p->exit.flags |= flags;
+	emit_exit(&p->exit, p->maps.data, p->maps.count);
+	free(p->maps.data);
+	*p = ((struct pending *)pending.data)[--pending.count];
+}
+
+
+static void add_exit(struct rr_record const * rec)
+{
+	struct pending * p = vec_push(&pending, sizeof(*p));
+	struct rrcap_exit * exit_rec = &p->exit;
+
+	memset(p, 0, sizeof(*p));
+	exit_rec->seq = rec->seq;
+	exit_rec->start_ns = rec->info.start_ns;
+	exit_rec->end_ns = rec->info.end_ns;
+	exit_rec->tgid = rec->info.tgid;
+	exit_rec->pid = rec->info.pid;
+	exit_rec->utime_us = rec->info.utime_us;
+	exit_rec->stime_us = rec->info.stime_us;
+	exit_rec->runtime_ns = rec->info.runtime_ns;
+	exit_rec->nvcsw = rec->info.nvcsw;
+	exit_rec->nivcsw = rec->info.nivcsw;
+	exit_rec->min_flt = rec->info.min_flt;
+	exit_rec->maj_flt = rec->info.maj_flt;
+	exit_rec->max_rss_kb = rec->info.max_rss_kb;
+	exit_rec->read_bytes = rec->info.read_bytes;
+	exit_rec->write_bytes = rec->info.write_bytes;
+	exit_rec->last_cpu = rec->info.last_cpu;
+	if (rec->code == RRNOTIFY_SNAPSHOT_BEGIN)
+		exit_rec->flags |= RRCAP_EXIT_SNAPSHOT;
+	if (rec->module_flags & RR_MODULES_TRUNCATED)
+		exit_rec->flags |= RRCAP_EXIT_TRUNCATED;
+	p->since = records_seen;
+
+	add_maps(&p->maps, rec);
+	if (!(rec->module_flags & RR_MODULES_CONTINUED))
+		emit_pending(pending.count - 1, 0);
+}
+
+
+static void add_continuation(struct rr_record const * rec)
+{
+	struct pending * p = pending.data;
+	size_t i;
+
+	for (i = 0; i < pending.count; i++) {
+		if (p[i].exit.seq == rec->cont_seq)
+			break;
+	}
+	/* its record was lost or given up on */
+	if (i == pending.count)
+		return;
+
+	add_maps(&p[i].maps, rec);
+	if (rec->module_flags & RR_MODULES_TRUNCATED)
+		p[i].exit.flags |= RRCAP_EXIT_TRUNCATED;
+	if (!(rec->module_flags & RR_MODULES_CONTINUED))
+		emit_pending(i, 0);
+}
+
+
+static void add_record(struct rr_decoder * dec, struct rr_record const * rec)
+{
+	size_t i;
+
+	records_seen++;
+
+	switch (rec->code) {
+	case RRNOTIFY_HEADER_BEGIN:
+		header.stream_version = dec->version;
+		header.record_fields = dec->record_fields;
+		header.module_options = dec->module_options;
+		break;
+	case RRNOTIFY_LOST_BEGIN:
+		header.lost_records += rec->lost_count;
+		break;
+	case RRNOTIFY_RECORD_BEGIN:
+	case RRNOTIFY_SNAPSHOT_BEGIN:
+		add_build_ids(rec);
+		add_exit(rec);
+		break;
+	case RRNOTIFY_MODULE_CONT_BEGIN:
+		add_build_ids(rec);
+		add_continuation(rec);
+		break;
+	case RRNOTIFY_EXEC_BEGIN:
+	case RRNOTIFY_MMAP_BEGIN:
+		add_build_ids(rec);
+		break;
+	}
+
+	for (i = 0; i < pending.count; ) {
+		struct pending * p = (struct pending *)pending.data + i;
+
+		if (records_seen - p->since > PENDING_MAX_AGE)
+			emit_pending(i, RRCAP_EXIT_INCOMPLETE);
+		else
+			i++;
+	}
+}
+
+
+static int compare_tgid(void const * a, void const * b)
+{
+	struct rrcap_tgid_entry const * x = a;
+	struct rrcap_tgid_entry const * y = b;
+
+	if (x->tgid != y->tgid)
+		return x->tgid < y->tgid ? -1 : 1;
+	if (x->ordinal != y->ordinal)
+		return x->ordinal < y->ordinal ? -1 : 1;
+	return 0;
+}
+
+
+static uint64_t write_section(struct rrcap_section * section, struct vec * vec,
+	size_t size, uint64_t offset)
+{
+	offset = (offset + 7) & ~7ULL;
+	section->offset = offset;
+	section->count = vec->count;
+	write_at(vec->data, vec->count * size, offset);
+	return offset + vec->count * size;
+}
+
+
+static void finish_capture(struct rr_decoder * dec)
+{
+	struct rrcap_time_entry * index;
+	uint64_t offset;
+	size_t i;
+
+	while (pending.count)
+		emit_pending(0, RRCAP_EXIT_INCOMPLETE);
+	flush_record_block();
+	flush_map_block();
+	index = time_index.data;
+
+	/* running bounds for the binary searches */
+	for (i = 0; i < time_index.count; i++) {
+		index[i].hi_ns = index[i].max_ns;
+		if (i && index[i - 1].hi_ns > index[i].hi_ns)
+			index[i].hi_ns = index[i - 1].hi_ns;
+	}
+	for (i = time_index.count; i--; ) {
+		index[i].lo_ns = index[i].min_ns;
+		if (i + 1 < time_index.count && index[i + 1].lo_ns < index[i].lo_ns)
+			index[i].lo_ns = index[i + 1].lo_ns;
+	}
+
+	qsort(tgid_index.data, tgid_index.count, sizeof(struct rrcap_tgid_entry), compare_tgid);
+
+	offset = block_offset(next_block);
+	offset = write_section(&header.time_index, &time_index, sizeof(struct rrcap_time_entry), offset);
+	offset = write_section(&header.tgid_index, &tgid_index, sizeof(struct rrcap_tgid_entry), offset);
+	offset = write_section(&header.map_blocks, &map_blocks, sizeof(uint64_t), offset);
+	offset = write_section(&header.modules, &modules, sizeof(struct rrcap_module), offset);
+	write_section(&header.strings, &strings, 1, offset);
+
+	header.version = RRCAP_VERSION;
+	header.header_size = RRCAP_HEADER_SIZE;
+	header.block_size = RRCAP_BLOCK_SIZE;
+	header.word_size = sizeof(unsigned long);
+	header.nr_blocks = next_block;
+	if (!dec->have_header) {
+		header.stream_version = dec->version;
+		header.record_fields = dec->record_fields;
+	}
+
+	/* the magic goes in after everything else is on disk */
+	if (fsync(out_fd))
+		die("syncing the capture");
+	header.magic = RRCAP_MAGIC;
+	write_at(&header, sizeof(header), 0);
+}
+
+
+static int convert(char const * input, char const * output)
+{
+	struct rr_decoder dec;
+	unsigned long * words = NULL;
+	size_t nr_words = 0, alloc = 0;
+	int in_fd = 0;
+	int eof = 0;
+
+	if (input && strcmp(input, "-")) {
+		in_fd = open(input, O_RDONLY | O_CLOEXEC);
+		if (in_fd < 0)
+			die(input);
+	}
+	out_fd = open(output, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	if (out_fd < 0)
+		die(output);
+	/* no magic until finished */
+	write_at(&header, sizeof(header), 0);
+
+	rr_decoder_init(&dec);
+
+	while (!eof) {
+		size_t bytes = 0;
+		size_t pos = 0;
+
+		/* the tail of the last read is a partial record */
+		if (alloc - nr_words < READ_CHUNK / sizeof(unsigned long)) {
+			alloc = nr_words + READ_CHUNK / sizeof(unsigned long);
+			words = realloc(words, alloc * sizeof(unsigned long));
+			if (!words)
+				die("out of memory");
+		}
+		while (bytes < READ_CHUNK) {
+			ssize_t ret = read(in_fd, (char *)(words + nr_words) + bytes, READ_CHUNK - bytes);
+
+			if (ret < 0) {
+				if (errno == EINTR)
+					continue;
+				die("reading the stream");
+			}
+			if (!ret) {
+				eof = 1;
+				break;
+			}
+			bytes += ret;
+			if (bytes % sizeof(unsigned long) == 0)
+				break;
+		}
+		nr_words += bytes / sizeof(unsigned long);
+
+		for (;;) {
+			struct rr_record rec;
+			size_t used;
+			int ret = rr_decode(&dec, words + pos, nr_words - pos, &rec, &used);
+
+			pos += used;
+			if (ret == RR_DECODE_MORE)
+				break;
+			if (ret == RR_DECODE_ERROR) {
+				fprintf(stderr, "rrcapture: malformed stream at word %zu\n", pos);
+				exit(1);
+			}
+			add_record(&dec, &rec);
+		}
+
+		memmove(words, words + pos, (nr_words - pos) * sizeof(unsigned long));
+		nr_words -= pos;
+	}
+
+	if (nr_words)
+		fprintf(stderr, "rrcapture: %zu words of a partial record at the end\n", nr_words);
+
+	finish_capture(&dec);
+	fprintf(stderr, "rrcapture: %llu records, %llu mappings, %zu modules, %llu lost\n",
+		(unsigned long long)header.nr_records, (unsigned long long)header.nr_maps,
+		modules.count, (unsigned long long)header.lost_records);
+
+	rr_decoder_free(&dec);
+	free(words);
+	close(out_fd);
+	return 0;
+}
+
+
+/* Query */
+
+static void print_exit(struct rrcap_file const * file, struct rrcap_exit const * e, int with_maps)
+{
+	uint32_t i;
+
+	printf("%llu.%09llu tgid %u pid %u start %llu.%09llu user %llu us sys %llu us seq %llu%s%s%s\n",
+		(unsigned long long)(e->end_ns / 1000000000), (unsigned long long)(e->end_ns % 1000000000),
+		e->tgid, e->pid,
+		(unsigned long long)(e->start_ns / 1000000000), (unsigned long long)(e->start_ns % 1000000000),
+		(unsigned long long)e->utime_us, (unsigned long long)e->stime_us,
+		(unsigned long long)e->seq,
+		e->flags & RRCAP_EXIT_SNAPSHOT ? " snapshot" : "",
+		e->flags & RRCAP_EXIT_TRUNCATED ? " truncated" : "",
+		e->flags & RRCAP_EXIT_INCOMPLETE ? " incomplete" : "");
+
+	if (!with_maps)
+		return;
+
+	for (i = 0; i < e->nr_maps; i++) {
+		struct rrcap_map const * map = rrcap_map(file, e->first_map + i);
+		struct rrcap_module const * module = map ? rrcap_module(file, map->module) : NULL;
+
+		if (!module)
+			break;
+		printf("\t%llx-%llx %llx %s\n", (unsigned long long)map->start,
+			(unsigned long long)map->end, (unsigned long long)map->offset,
+			rrcap_module_path(file, module));
+	}
+}
+
+
+static void query_block(struct rrcap_file const * file, uint64_t ordinal, int by_tgid,
+	uint32_t tgid, uint64_t from_ns, uint64_t to_ns, int with_maps)
+{
+	struct rrcap_time_entry const * entry;
+	struct rrcap_block_header const * block;
+	struct rrcap_exit const * records;
+	uint32_t i;
+
+	/* The ordinal comes from the tgid index, which may be corrupt. */
+	if (ordinal >= file->header->time_index.count)
+		return;
+	entry = (struct rrcap_time_entry const *)(file->base + file->header->time_index.offset)
+		+ ordinal;
+	if (entry->max_ns < from_ns || entry->min_ns > to_ns)
+		return;
+	block = rrcap_block(file, entry->block);
+	if (!block || block->type != RRCAP_BLOCK_RECORDS)
+		return;
+
+	records = rrcap_block_records(block);
+	for (i = 0; i < block->count && i < RRCAP_RECORDS_PER_BLOCK; i++) {
+		if (by_tgid && records[i].tgid != tgid)
+			continue;
+		if (records[i].end_ns < from_ns || records[i].end_ns > to_ns)
+			continue;
+		print_exit(file, &records[i], with_maps);
+	}
+}
+
+
+static uint64_t parse_time(char const * str)
+{
+	char * end;
+	double sec = strtod(str, &end);
+
+	return sec <= 0 ? 0 : (uint64_t)(sec * 1e9);
+}
+
+
+static int query(char const * path, int by_tgid, uint32_t tgid, char const * range, int with_maps)
+{
+	struct rrcap_file file;
+	uint64_t from_ns = 0, to_ns = UINT64_MAX;
+	uint64_t first, last;
+
+	if (rrcap_open(&file, path))
+		die(path);
+
+	if (range) {
+		char const * comma = strchr(range, ',');
+
+		from_ns = parse_time(range);
+		if (comma && comma[1])
+			to_ns = parse_time(comma + 1);
+	}
+
+	if (by_tgid) {
+		size_t count, i;
+		struct rrcap_tgid_entry const * entries = rrcap_tgid_blocks(&file, tgid, &count);
+
+		for (i = 0; i < count; i++)
+			query_block(&file, entries[i].ordinal, 1, tgid, from_ns, to_ns, with_maps);
+	} else {
+		rrcap_time_range(&file, from_ns, to_ns, &first, &last);
+		for (; first < last; first++)
+			query_block(&file, first, 0, 0, from_ns, to_ns, with_maps);
+	}
+
+	rrcap_close(&file);
+	return 0;
+}
+
+
+static void usage(void)
+{
+	fprintf(stderr,
+		"usage: rrcapture -o <capture> [stream]\n"
+		"       rrcapture -q <capture> [-p tgid] [-t from[,to]] [-m]\n"
+		"  times are seconds, as in the records' end time\n");
+	exit(2);
+}
+
+
+int main(int argc, char ** argv)
+{
+	char const * output = NULL;
+	char const * capture = NULL;
+	char const * range = NULL;
+	uint32_t tgid = 0;
+	int by_tgid = 0;
+	int with_maps = 0;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "o:q:p:t:m")) != -1) {
+		switch (opt) {
+		case 'o': output = optarg; break;
+		case 'q': capture = optarg; break;
+		case 'p': tgid = strtoul(optarg, NULL, 0); by_tgid = 1; break;
+		case 't': range = optarg; break;
+		case 'm': with_maps = 1; break;
+		default: usage();
+		}
+	}
+
+	if (output && !capture)
+		return convert(optind < argc ? argv[optind] : NULL, output);
+	if (capture && !output)
+		return query(capture, by_tgid, tgid, range, with_maps);
+	usage();
+	return 2;
+}
@@ -0,0 +1,167 @@
+/**
+ * @file rrcapture.h
+ * Indexed capture file of exit records.
+ *
+ * A capture is meant to be mmapped and read in place. After a header
+ * page it is a sequence of fixed-size blocks, each holding either
+ * decoded exit records or the module mappings they refer to, followed
+ * by the sections the header points at:
+ *
+ *  - time index: one entry per record block, in block order, with the
+ *    range of end times in the block and running bounds that make it
+ *    binary searchable although end times aren't strictly ordered
+ *  - tgid index: (tgid, record block) pairs sorted by tgid
+ *  - map blocks: the block number of every map block, in order
+ *  - modules: one entry per distinct file, with its path in the
+ *    string table and its build-id if the stream had one
+ *
+ * The header is written last, so a capture that wasn't finished has
+ * no magic. All values are in the byte order of the machine that wrote
+ * the capture.
+ *
+ * @remark Copyright (C) 2006-2015 RotateRight, LLC
+ * @remark Read the file COPYING
+ */
+
+#ifndef RRCAPTURE_H
+#define RRCAPTURE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define RRCAP_MAGIC			0x0031465041435252ULL	/* "RRCAPF1" */
+#define RRCAP_VERSION		1
+#define RRCAP_HEADER_SIZE	4096
+#define RRCAP_BLOCK_SIZE	65536
+#define RRCAP_BUILD_ID_MAX	64
+
+struct rrcap_section {
+	uint64_t offset;	/* bytes from the start of the file */
+	uint64_t count;		/* entries */
+};
+
+struct rrcap_header {
+	uint64_t magic;
+	uint32_t version;
+	uint32_t header_size;
+	uint32_t block_size;
+	uint32_t word_size;		/* of the machine that produced the stream */
+	uint64_t nr_blocks;
+	uint64_t nr_records;
+	uint64_t nr_maps;
+	uint64_t lost_records;	/* from LOST records in the stream */
+	uint64_t first_ns;		/* earliest and latest end time */
+	uint64_t last_ns;
+	/* from the stream header */
+	uint64_t stream_version;
+	uint64_t record_fields;
+	uint64_t module_options;
+	struct rrcap_section time_index;	/* struct rrcap_time_entry */
+	struct rrcap_section tgid_index;	/* struct rrcap_tgid_entry */
+	struct rrcap_section map_blocks;	/* uint64_t */
+	struct rrcap_section modules;		/* struct rrcap_module */
+	struct rrcap_section strings;		/* bytes */
+};
+
+#define RRCAP_BLOCK_RECORDS		1
+#define RRCAP_BLOCK_MAPS		2
+
+struct rrcap_block_header {
+	uint32_t type;			/* RRCAP_BLOCK_* */
+	uint32_t count;			/* entries used */
+	uint64_t ordinal;		/* among the blocks of its type */
+	uint64_t min_ns;		/* record blocks: range of end times */
+	uint64_t max_ns;
+};
+
+/* rrcap_exit.flags */
+#define RRCAP_EXIT_SNAPSHOT		0x1	/* a live thread, end is the snapshot time */
+#define RRCAP_EXIT_TRUNCATED	0x2	/* module_limit cut the module list */
+#define RRCAP_EXIT_INCOMPLETE	0x4	/* a module list continuation was lost */
+
+struct rrcap_exit {
+	uint64_t seq;
+	uint64_t start_ns;
+	uint64_t end_ns;
+	uint32_t tgid;
+	uint32_t pid;
+	uint64_t utime_us;
+	uint64_t stime_us;
+	uint64_t runtime_ns;
+	uint64_t nvcsw;
+	uint64_t nivcsw;
+	uint64_t min_flt;
+	uint64_t maj_flt;
+	uint64_t max_rss_kb;
+	uint64_t read_bytes;
+	uint64_t write_bytes;
+	uint32_t last_cpu;
+	uint32_t flags;			/* RRCAP_EXIT_* */
+	uint64_t first_map;		/* index of the first mapping */
+	uint32_t nr_maps;
+	uint32_t reserved;
+};
+
+struct rrcap_map {
+	uint64_t start;
+	uint64_t end;
+	uint64_t offset;
+	uint32_t module;		/* index into the module table */
+	uint32_t flags;			/* low bits of vm_flags */
+};
+
+struct rrcap_module {
+	uint64_t cookie;
+	uint64_t path;			/* offset into the string table */
+	uint32_t path_len;
+	uint32_t build_id_len;
+	uint8_t build_id[RRCAP_BUILD_ID_MAX];
+};
+
+struct rrcap_time_entry {
+	uint64_t block;			/* block number */
+	uint64_t min_ns;		/* end times in this block */
+	uint64_t max_ns;
+	uint64_t lo_ns;			/* smallest min_ns of this and later blocks */
+	uint64_t hi_ns;			/* largest max_ns of this and earlier blocks */
+};
+
+struct rrcap_tgid_entry {
+	uint32_t tgid;
+	uint32_t reserved;
+	uint64_t ordinal;		/* record block, index into the time index */
+};
+
+#define RRCAP_RECORDS_PER_BLOCK	\
+	((RRCAP_BLOCK_SIZE - sizeof(struct rrcap_block_header)) / sizeof(struct rrcap_exit))
+#define RRCAP_MAPS_PER_BLOCK	\
+	((RRCAP_BLOCK_SIZE - sizeof(struct rrcap_block_header)) / sizeof(struct rrcap_map))
+
+/* Reading a capture in place, see rrcapfile.c */
+struct rrcap_file {
+	int fd;
+	size_t size;
+	unsigned char const * base;
+	struct rrcap_header const * header;
+};
+
+int rrcap_open(struct rrcap_file * file, char const * path);
+void rrcap_close(struct rrcap_file * file);
+
+struct rrcap_block_header const * rrcap_block(struct rrcap_file const * file, uint64_t block);
+struct rrcap_exit const * rrcap_block_records(struct rrcap_block_header const * block);
+struct rrcap_map const * rrcap_map(struct rrcap_file const * file, uint64_t index);
+struct rrcap_module const * rrcap_module(struct rrcap_file const * file, uint32_t index);
+char const * rrcap_module_path(struct rrcap_file const * file, struct rrcap_module const * module);
+
+/* Time index entries [*first, *last) whose blocks may hold exits that
+ * ended in [from_ns, to_ns].
+ */
+void rrcap_time_range(struct rrcap_file const * file, uint64_t from_ns, uint64_t to_ns,
+	uint64_t * first, uint64_t * last);
+
+/* The tgid index entries of tgid, or NULL. */
+struct rrcap_tgid_entry const * rrcap_tgid_blocks(struct rrcap_file const * file,
+	uint32_t tgid, size_t * count);
+
+#endif /* RRCAPTURE_H */
@@ -0,0 +1,800 @@
+/**
+ * @file rrcollect.c
+ * Reference collector for the rrnotify event buffer.
+ *
+ * Drains /dev/rrnotify/buffer with io_uring into a ring of batch
+ * buffers and writes full batches to a file or a unix socket while the
+ * next read is already waiting in the kernel. Only one read is ever in
+ * flight, as every read drains the whole event buffer and completions
+ * of concurrent reads could land out of order.
+ *
+ * Every interval a line of key=value metrics goes to stderr: the
+ * collector's own lag (age of the oldest data not yet written), how
+ * long it could not post a read because every batch was waiting on the
+ * output, how full the largest read was, the share of records written
+ * to another NUMA node's part of the buffer, and the deltas of the
+ * stats/ counters. A drop while the collector stalled or a read came back
+ * close to the buffer size is the consumer's fault, not the kernel's.
+ *
+ * @remark Copyright (C) 2006-2015 RotateRight, LLC
+ * @remark Read the file COPYING
+ */
+
+#define _GNU_SOURCE
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sched.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/un.h>
+#include <linux/io_uring.h>
+
+#define DEFAULT_DIR		"/dev/rrnotify"
+#define DEFAULT_SLOTS		8
+#define DEFAULT_BATCH		(4 << 20)
+#define DEFAULT_FLUSH_MS	1000
+#define DEFAULT_REPORT_MS	5000
+#define TICK_MS			100
+#define MAX_STATS		64
+
+/* user_data of a completion: operation in the top byte, slot below */
+#define OP_READ			1ULL
+#define OP_WRITE		2ULL
+#define OP_TICK			3ULL
+#define OP_SHIFT		56
+#define OP_DATA(op, slot)	(((op) << OP_SHIFT) | (slot))
+
+enum slot_state {
+	SLOT_FREE,
+	SLOT_FILLING,
+	SLOT_QUEUED,
+	SLOT_WRITING,
+};
+
+struct slot {
+	char * data;
+	size_t fill;		/* bytes read into the slot */
+	size_t written;		/* bytes of fill already written out */
+	uint64_t offset;	/* output file offset of data[0] */
+	uint64_t first_ns;	/* when the oldest byte was read */
+	enum slot_state state;
+};
+
+struct ring {
+	int fd;
+	unsigned * sq_head;
+	unsigned * sq_tail;
+	unsigned * sq_mask;
+	unsigned * sq_array;
+	struct io_uring_sqe * sqes;
+	unsigned * cq_head;
+	unsigned * cq_tail;
+	unsigned * cq_mask;
+	struct io_uring_cqe * cqes;
+	unsigned to_submit;
+};
+
+struct stat_counter {
+	char name[64];
+	uint64_t value;
+	uint64_t last;
+};
+
+static struct options {
+	char const * dir;
+	char const * output;
+	char const * cpus;
+	size_t batch;
+	unsigned nr_slots;
+	unsigned flush_ms;
+	unsigned report_ms;
+	int control_enable;
+	int all_stats;
+} opts = {
+	.dir = DEFAULT_DIR,
+	.batch = DEFAULT_BATCH,
+	.nr_slots = DEFAULT_SLOTS,
+	.flush_ms = DEFAULT_FLUSH_MS,
+	.report_ms = DEFAULT_REPORT_MS,
+	.control_enable = 1,
+};
+
+static struct ring ring;
+static struct slot * slots;
+static unsigned * write_queue;	/* slot indices in stream order */
+static unsigned queue_head, queue_len;
+static unsigned cur_slot;
+static size_t read_size;
+static size_t slot_size;
+static int buffer_fd = -1;
+static int out_fd = -1;
+static int out_is_socket;
+static uint64_t out_offset;
+static int read_inflight, writes_inflight, tick_inflight;
+static int reading = 1, resize_pending;
+static struct __kernel_timespec tick_ts;
+static volatile sig_atomic_t stop_requested;
+
+/* per report interval */
+static uint64_t bytes_read, bytes_written, nr_reads;
+static size_t max_read;
+static uint64_t max_lag_ns;
+static uint64_t stall_ns, stall_start_ns;
+static uint64_t last_report_ns;
+
+static struct stat_counter stats[MAX_STATS];
+static unsigned nr_stats;
+
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+
+static void die(char const * what)
+{
+	fprintf(stderr, "rrcollect: %s: %s\n", what, strerror(errno));
+	exit(1);
+}
+
+
+static int read_ulong_file(char const * name, unsigned long * val)
+{
+	char path[4096];
+	char buf[64];
+	ssize_t len;
+	int fd;
+
+	snprintf(path, sizeof(path), "%s/%s", opts.dir, name);
+	fd = open(path, O_RDONLY);
+	if (fd < 0)
+		return -1;
+	len = read(fd, buf, sizeof(buf) - 1);
+	close(fd);
+	if (len <= 0)
+		return -1;
+	buf[len] = '\0';
+	*val = strtoul(buf, NULL, 0);
+	return 0;
+}
+
+
+static int write_enable(int on)
+{
+	char path[4096];
+	int fd, ret;
+
+	snprintf(path, sizeof(path), "%s/enable", opts.dir);
+	fd = open(path, O_WRONLY);
+	if (fd < 0)
+		return -1;
+	ret = write(fd, on ? "1" : "0", 1) == 1 ? 0 : -1;
+	close(fd);
+	return ret;
+}
+
+
+/* The module only accepts a read that fits everything pending, which
+ * is at most buffer_size words.
+ */
+static size_t buffer_bytes(void)
+{
+	unsigned long words, pointer_size;
+
+	if (read_ulong_file("buffer_size", &words) || read_ulong_file("pointer_size", &pointer_size))
+		die("reading buffer_size/pointer_size");
+	return words * pointer_size;
+}
+
+
+/* The stats/ files are read by name so that new counters show up
+ * without changes here.
+ */
+static void read_stats(void)
+{
+	char path[4096];
+	struct dirent * ent;
+	DIR * dir;
+	unsigned i;
+
+	snprintf(path, sizeof(path), "%s/stats", opts.dir);
+	dir = opendir(path);
+	if (!dir)
+		return;
+
+	while ((ent = readdir(dir))) {
+		char name[4096];
+		unsigned long val;
+
+		/* names are looked up in full, skip any that wouldn't fit */
+		if (ent->d_name[0] == '.' || strlen(ent->d_name) >= sizeof(stats[0].name))
+			continue;
+		snprintf(name, sizeof(name), "stats/%s", ent->d_name);
+		/* per-cpu directories don't read as a number */
+		if (read_ulong_file(name, &val))
+			continue;
+
+		for (i = 0; i < nr_stats; i++) {
+			if (!strcmp(stats[i].name, ent->d_name))
+				break;
+		}
+		if (i == nr_stats) {
+			if (nr_stats == MAX_STATS)
+				continue;
+			memcpy(stats[i].name, ent->d_name, strlen(ent->d_name) + 1);
+			stats[i].last = val;
+			nr_stats++;
+		}
+		stats[i].value = val;
+	}
+
+	closedir(dir);
+}
+
+
+static uint64_t stat_delta(char const * name)
+{
+	unsigned i;
+
+	for (i = 0; i < nr_stats; i++) {
+		/* counters go back to zero when the stats are reset */
+		if (!strcmp(stats[i].name, name))
+			return stats[i].value >= stats[i].last ? stats[i].value - stats[i].last : stats[i].value;
+	}
+	return 0;
+}
+
+
+static void report(uint64_t now)
+{
+	uint64_t elapsed = now - last_report_ns;
+	uint64_t received, lost, pending = 0;
+	uint64_t local, remote;
+	unsigned i;
+
+	if (!elapsed)
+		return;
+
+	read_stats();
+	received = stat_delta("event_received");
+	lost = stat_delta("event_lost_overflow") + stat_delta("task_event_lost_queue");
+	local = stat_delta("buffer_write_local");
+	remote = stat_delta("buffer_write_remote");
+
+	for (i = 0; i < opts.nr_slots; i++) {
+		if (slots[i].state != SLOT_FREE) {
+			uint64_t age = now - slots[i].first_ns;
+
+			pending += slots[i].fill - slots[i].written;
+			if (slots[i].fill && age > max_lag_ns)
+				max_lag_ns = age;
+		}
+	}
+	if (stall_start_ns) {
+		stall_ns += now - stall_start_ns;
+		stall_start_ns = now;
+	}
+
+	fprintf(stderr, "rrcollect: read_bytes=%llu write_bytes=%llu reads=%llu"
+		" max_read_pct=%.1f pending_bytes=%llu lag_ms=%.1f stall_pct=%.1f"
+		" received=%llu lost=%llu drop_pct=%.3f remote_write_pct=%.1f",
+		(unsigned long long)bytes_read, (unsigned long long)bytes_written,
+		(unsigned long long)nr_reads,
+		100.0 * max_read / read_size, (unsigned long long)pending,
+		max_lag_ns / 1e6, 100.0 * stall_ns / elapsed,
+		(unsigned long long)received, (unsigned long long)lost,
+		received + lost ? 100.0 * lost / (received + lost) : 0.0,
+		local + remote ? 100.0 * remote / (local + remote) : 0.0);
+
+	/* a full read means the buffer was full before we got to it */
+	if (lost)
+		fprintf(stderr, " drop_cause=%s",
+			stall_ns || max_read * 10 >= read_size * 9 ? "consumer" : "kernel");
+
+	if (opts.all_stats) {
+		for (i = 0; i < nr_stats; i++) {
+			fprintf(stderr, " %s=%llu", stats[i].name,
+				(unsigned long long)stat_delta(stats[i].name));
+		}
+	}
+	fprintf(stderr, "\n");
+
+	for (i = 0; i < nr_stats; i++)
+		stats[i].last = stats[i].value;
+	bytes_read = bytes_written = nr_reads = 0;
+	max_read = 0;
+	max_lag_ns = 0;
+	stall_ns = 0;
+	last_report_ns = now;
+}
+
+
+static int ring_setup(unsigned entries)
+{
+	struct io_uring_params p;
+	size_t sq_len, cq_len;
+	char * sq, * cq;
+
+	memset(&p, 0, sizeof(p));
+	ring.fd = syscall(__NR_io_uring_setup, entries, &p);
+	if (ring.fd < 0)
+		return -1;
+
+	sq_len = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+	cq_len = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+	if (p.features & IORING_FEAT_SINGLE_MMAP) {
+		if (cq_len > sq_len)
+			sq_len = cq_len;
+		cq_len = sq_len;
+	}
+
+	sq = mmap(NULL, sq_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+		  ring.fd, IORING_OFF_SQ_RING);
+	if (sq == MAP_FAILED)
+		return -1;
+	if (p.features & IORING_FEAT_SINGLE_MMAP) {
+		cq = sq;
+	} else {
+		cq = mmap(NULL, cq_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+			  ring.fd, IORING_OFF_CQ_RING);
+		if (cq == MAP_FAILED)
+			return -1;
+	}
+
+	ring.sqes = mmap(NULL, p.sq_entries * sizeof(struct io_uring_sqe),
+			 PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+			 ring.fd, IORING_OFF_SQES);
+	if (ring.sqes == MAP_FAILED)
+		return -1;
+
+	ring.sq_head = (unsigned *)(sq + p.sq_off.head);
+	ring.sq_tail = (unsigned *)(sq + p.sq_off.tail);
+	ring.sq_mask = (unsigned *)(sq + p.sq_off.ring_mask);
+	ring.sq_array = (unsigned *)(sq + p.sq_off.array);
+	ring.cq_head = (unsigned *)(cq + p.cq_off.head);
+	ring.cq_tail = (unsigned *)(cq + p.cq_off.tail);
+	ring.cq_mask = (unsigned *)(cq + p.cq_off.ring_mask);
+	ring.cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+	return 0;
+}
+
+
+/* The ring has room for every slot plus the read and the tick, so
+ * getting an sqe can't fail.
+ */
+static struct io_uring_sqe * get_sqe(void)
+{
+	unsigned tail = *ring.sq_tail;
+	unsigned index = tail & *ring.sq_mask;
+	struct io_uring_sqe * sqe = &ring.sqes[index];
+
+	memset(sqe, 0, sizeof(*sqe));
+	ring.sq_array[index] = index;
+	__atomic_store_n(ring.sq_tail, tail + 1, __ATOMIC_RELEASE);
+	ring.to_submit++;
+	return sqe;
+}
+
+
+static void queue_read(void)
+{
+	struct slot * slot = &slots[cur_slot];
+	struct io_uring_sqe * sqe = get_sqe();
+
+	sqe->opcode = IORING_OP_READ;
+	sqe->fd = buffer_fd;
+	sqe->addr = (unsigned long)(slot->data + slot->fill);
+	sqe->len = read_size;
+	/* the buffer file insists on offset 0 */
+	sqe->off = 0;
+	sqe->user_data = OP_DATA(OP_READ, cur_slot);
+	read_inflight = 1;
+}
+
+
+static void queue_write(unsigned index)
+{
+	struct slot * slot = &slots[index];
+	struct io_uring_sqe * sqe = get_sqe();
+
+	sqe->opcode = IORING_OP_WRITE;
+	sqe->fd = out_fd;
+	sqe->addr = (unsigned long)(slot->data + slot->written);
+	sqe->len = slot->fill - slot->written;
+	sqe->off = out_is_socket ? 0 : slot->offset + slot->written;
+	sqe->user_data = OP_DATA(OP_WRITE, index);
+	slot->state = SLOT_WRITING;
+	writes_inflight++;
+}
+
+
+static void queue_tick(void)
+{
+	struct io_uring_sqe * sqe = get_sqe();
+
+	tick_ts.tv_sec = TICK_MS / 1000;
+	tick_ts.tv_nsec = (TICK_MS % 1000) * 1000000L;
+	sqe->opcode = IORING_OP_TIMEOUT;
+	sqe->fd = -1;
+	sqe->addr = (unsigned long)&tick_ts;
+	sqe->len = 1;
+	sqe->user_data = OP_DATA(OP_TICK, 0);
+	tick_inflight = 1;
+}
+
+
+/* hand the filling slot to the writer and move on to the next one */
+static void retire_cur_slot(void)
+{
+	struct slot * slot = &slots[cur_slot];
+
+	if (slot->state != SLOT_FILLING || !slot->fill)
+		return;
+
+	slot->state = SLOT_QUEUED;
+	slot->offset = out_offset;
+	out_offset += slot->fill;
+	write_queue[(queue_head + queue_len) % opts.nr_slots] = cur_slot;
+	queue_len++;
+
+	cur_slot = (cur_slot + 1) % opts.nr_slots;
+}
+
+
+/* A socket takes one write at a time to keep the stream in order, a
+ * file can take them all as each carries its own offset.
+ */
+static void submit_writes(void)
+{
+	while (queue_len && (!out_is_socket || !writes_inflight)) {
+		queue_write(write_queue[queue_head]);
+		queue_head = (queue_head + 1) % opts.nr_slots;
+		queue_len--;
+	}
+}
+
+
+/* Reads go to the current slot while it has room for a whole read.
+ * With every slot waiting on the output the collector is stalled and
+ * the kernel buffer fills up behind it.
+ */
+static void post_read(uint64_t now)
+{
+	struct slot * slot = &slots[cur_slot];
+
+	if (slot->state == SLOT_FILLING && slot_size - slot->fill < read_size)
+		retire_cur_slot();
+
+	slot = &slots[cur_slot];
+	if (slot->state == SLOT_FREE) {
+		slot->state = SLOT_FILLING;
+		slot->fill = 0;
+		slot->written = 0;
+	}
+	if (slot->state != SLOT_FILLING) {
+		if (!stall_start_ns)
+			stall_start_ns = now;
+		return;
+	}
+
+	if (stall_start_ns) {
+		stall_ns += now - stall_start_ns;
+		stall_start_ns = 0;
+	}
+	queue_read();
+}
+
+
+/* The buffer was resized beyond the slots. Called once everything
+ * batched has been written, so no slot is in use.
+ */
+static void resize_slots(void)
+{
+	unsigned i;
+
+	read_size = buffer_bytes();
+	if (slot_size < read_size)
+		slot_size = read_size;
+	for (i = 0; i < opts.nr_slots; i++) {
+		free(slots[i].data);
+		slots[i].data = malloc(slot_size);
+		if (!slots[i].data)
+			die("allocating batch buffers");
+		slots[i].state = SLOT_FREE;
+		slots[i].fill = 0;
+	}
+}
+
+
+static void on_signal(int sig)
+{
+	stop_requested = 1;
+}
+
+
+static int open_output(char const * output)
+{
+	struct stat st;
+	int fd;
+
+	if (!strncmp(output, "unix:", 5)) {
+		struct sockaddr_un addr;
+
+		fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+
+		if (fd < 0)
+			return -1;
+		memset(&addr, 0, sizeof(addr));
+		addr.sun_family = AF_UNIX;
+		snprintf(addr.sun_path, sizeof(addr.sun_path), "%s", output + 5);
+		if (connect(fd, (struct sockaddr *)&addr, sizeof(addr))) {
+			close(fd);
+			return -1;
+		}
+		out_is_socket = 1;
+		return fd;
+	}
+
+	fd = open(output, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	/* a pipe or a tty takes the stream in order like a socket */
+	if (fd >= 0 && (fstat(fd, &st) || !S_ISREG(st.st_mode)))
+		out_is_socket = 1;
+	return fd;
+}
+
+
+/* "0-3,8,10-11" */
+static int pin_cpus(char const * list)
+{
+	cpu_set_t set;
+	char const * p = list;
+
+	CPU_ZERO(&set);
+	while (*p) {
+		char * end;
+		unsigned long first = strtoul(p, &end, 10);
+		unsigned long last = first;
+
+		if (end == p)
+			return -1;
+		if (*end == '-') {
+			p = end + 1;
+			last = strtoul(p, &end, 10);
+			if (end == p || last < first)
+				return -1;
+		}
+		for (; first <= last && first < CPU_SETSIZE; first++)
+			CPU_SET(first, &set);
+		p = end;
+		if (*p == ',')
+			p++;
+		else if (*p)
+			return -1;
+	}
+
+	return sched_setaffinity(0, sizeof(set), &set);
+}
+
+
+static void usage(void)
+{
+	fprintf(stderr,
+		"usage: rrcollect -o <file|unix:path> [options]\n"
+		"  -d dir     rrnotifyfs mount point (default " DEFAULT_DIR ")\n"
+		"  -c cpus    pin the collector and its io workers, e.g. 0-1,4\n"
+		"  -b bytes   batch size written at once (default %d)\n"
+		"  -n slots   batch buffers in the ring (default %d)\n"
+		"  -f ms      write a partial batch after this long (default %d)\n"
+		"  -i ms      metrics interval, 0 for none (default %d)\n"
+		"  -a         report every stats/ counter\n"
+		"  -e         leave the enable file alone\n",
+		DEFAULT_BATCH, DEFAULT_SLOTS, DEFAULT_FLUSH_MS, DEFAULT_REPORT_MS);
+	exit(2);
+}
+
+
+int main(int argc, char ** argv)
+{
+	char path[4096];
+	struct sigaction sa;
+	int draining = 0;
+	int opt;
+	unsigned i;
+
+	while ((opt = getopt(argc, argv, "d:o:c:b:n:f:i:ae")) != -1) {
+		switch (opt) {
+		case 'd': opts.dir = optarg; break;
+		case 'o': opts.output = optarg; break;
+		case 'c': opts.cpus = optarg; break;
+		case 'b': opts.batch = strtoul(optarg, NULL, 0); break;
+		case 'n': opts.nr_slots = strtoul(optarg, NULL, 0); break;
+		case 'f': opts.flush_ms = strtoul(optarg, NULL, 0); break;
+		case 'i': opts.report_ms = strtoul(optarg, NULL, 0); break;
+		case 'a': opts.all_stats = 1; break;
+		case 'e': opts.control_enable = 0; break;
+		default: usage();
+		}
+	}
+	if (!opts.output || opts.nr_slots < 2)
+		usage();
+
+	/* before the ring exists so its workers inherit the mask */
+	if (opts.cpus && pin_cpus(opts.cpus))
+		die("setting cpu affinity");
+
+	out_fd = open_output(opts.output);
+	if (out_fd < 0)
+		die(opts.output);
+
+	snprintf(path, sizeof(path), "%s/buffer", opts.dir);
+	buffer_fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (buffer_fd < 0)
+		die(path);
+
+	read_size = buffer_bytes();
+	slot_size = opts.batch > read_size ? opts.batch : read_size;
+	slots = calloc(opts.nr_slots, sizeof(*slots));
+	write_queue = calloc(opts.nr_slots, sizeof(*write_queue));
+	if (!slots || !write_queue)
+		die("allocating batch buffers");
+	for (i = 0; i < opts.nr_slots; i++) {
+		slots[i].data = malloc(slot_size);
+		if (!slots[i].data)
+			die("allocating batch buffers");
+	}
+
+	if (ring_setup(opts.nr_slots + 2))
+		die("io_uring_setup");
+
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = on_signal;
+	sigaction(SIGINT, &sa, NULL);
+	sigaction(SIGTERM, &sa, NULL);
+	signal(SIGPIPE, SIG_IGN);
+
+	read_stats();
+	last_report_ns = now_ns();
+
+	if (opts.control_enable && write_enable(1))
+		die("enable");
+
+	for (;;) {
+		uint64_t now = now_ns();
+		unsigned head, tail;
+		int ret;
+
+		/* stopping the session wakes the read up with what is left,
+		 * and reads return 0 once that is gone. Without control of
+		 * the session whatever is already batched is the end.
+		 */
+		if (stop_requested && !draining) {
+			draining = 1;
+			if (opts.control_enable)
+				write_enable(0);
+			else
+				reading = 0;
+		}
+
+		/* a resize waits for the output to catch up */
+		if (resize_pending) {
+			retire_cur_slot();
+			if (!queue_len && !writes_inflight) {
+				resize_slots();
+				resize_pending = 0;
+			}
+		}
+
+		if (reading && !resize_pending && !read_inflight)
+			post_read(now);
+		if (!reading) {
+			retire_cur_slot();
+			if (!queue_len && !writes_inflight)
+				break;
+		}
+		submit_writes();
+		if (!tick_inflight)
+			queue_tick();
+
+		ret = syscall(__NR_io_uring_enter, ring.fd, ring.to_submit, 1,
+			      IORING_ENTER_GETEVENTS, NULL, 0);
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+			die("io_uring_enter");
+		}
+		ring.to_submit -= ret;
+
+		head = *ring.cq_head;
+		tail = __atomic_load_n(ring.cq_tail, __ATOMIC_ACQUIRE);
+		now = now_ns();
+		for (; head != tail; head++) {
+			struct io_uring_cqe * cqe = &ring.cqes[head & *ring.cq_mask];
+			unsigned index = cqe->user_data & ((1ULL << OP_SHIFT) - 1);
+			struct slot * slot = &slots[index];
+			int res = cqe->res;
+
+			switch (cqe->user_data >> OP_SHIFT) {
+			case OP_READ:
+				read_inflight = 0;
+				if (!reading)
+					break;
+				if (res > 0) {
+					if (!slot->fill)
+						slot->first_ns = now;
+					slot->fill += res;
+					bytes_read += res;
+					nr_reads++;
+					if ((size_t)res > max_read)
+						max_read = res;
+				} else if (res == 0) {
+					/* nothing left after the session stopped */
+					if (draining)
+						reading = 0;
+				} else if (res == -EINVAL) {
+					/* buffer_size grew under us */
+					resize_pending = 1;
+				} else if (res != -EINTR && res != -EAGAIN) {
+					errno = -res;
+					die("reading the event buffer");
+				}
+				break;
+
+			case OP_WRITE:
+				writes_inflight--;
+				if (res < 0 && res != -EINTR && res != -EAGAIN) {
+					errno = -res;
+					die("writing the output");
+				}
+				if (res > 0) {
+					slot->written += res;
+					bytes_written += res;
+				}
+				if (slot->written < slot->fill) {
+					/* short write, the rest goes out next */
+					queue_head = (queue_head + opts.nr_slots - 1) % opts.nr_slots;
+					write_queue[queue_head] = index;
+					queue_len++;
+					slot->state = SLOT_QUEUED;
+					break;
+				}
+				if (now - slot->first_ns > max_lag_ns)
+					max_lag_ns = now - slot->first_ns;
+				slot->state = SLOT_FREE;
+				slot->fill = 0;
+				break;
+
+			case OP_TICK:
+				tick_inflight = 0;
+				break;
+			}
+		}
+		__atomic_store_n(ring.cq_head, head, __ATOMIC_RELEASE);
+
+		if (slots[cur_slot].state == SLOT_FILLING && slots[cur_slot].fill &&
+		    now - slots[cur_slot].first_ns >= opts.flush_ms * 1000000ULL)
+			retire_cur_slot();
+
+		if (opts.report_ms && now - last_report_ns >= opts.report_ms * 1000000ULL)
+			report(now);
+	}
+
+	if (opts.report_ms)
+		report(now_ns());
+	close(buffer_fd);
+	close(out_fd);
+	return 0;
+}
@@ -0,0 +1,649 @@
+/**
+ * @file rrdecode.c
+ * Decoder for the rrnotify buffer stream.
+ *
+ * Records are parsed by position from their layout rather than by
+ * looking for escape codes, as a data entry may well be ~0UL. Record
+ * types without a known layout are skipped up to their END code.
+ *
+ * @remark Copyright (C) 2006-2015 RotateRight, LLC
+ * @remark Read the file COPYING
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+
+#include "rrdecode.h"
+
+#define WORD_SIZE		sizeof(unsigned long)
+#define WORDS_PER_U64	(sizeof(uint64_t) / sizeof(unsigned long))
+#define NSEC_PER_SEC	1000000000ULL
+
+/* parse results below the top level */
+#define PARSE_OK		1
+#define PARSE_MORE		0
+#define PARSE_ERROR		(-1)
+
+struct cursor {
+	unsigned long const * pos;
+	unsigned long const * end;
+};
+
+static int take(struct cursor * c, unsigned long * val)
+{
+	if (c->pos == c->end)
+		return PARSE_MORE;
+	*val = *c->pos++;
+	return PARSE_OK;
+}
+
+static int take_u64(struct cursor * c, uint64_t * val)
+{
+	unsigned long lo, hi = 0;
+
+	if (!take(c, &lo))
+		return PARSE_MORE;
+	if (WORDS_PER_U64 == 2 && !take(c, &hi))
+		return PARSE_MORE;
+	*val = lo;
+	if (WORDS_PER_U64 == 2)
+		*val |= (uint64_t)hi << 16 << 16;
+	return PARSE_OK;
+}
+
+static int skip(struct cursor * c, size_t words)
+{
+	if ((size_t)(c->end - c->pos) < words)
+		return PARSE_MORE;
+	c->pos += words;
+	return PARSE_OK;
+}
+
+static int peek_escape(struct cursor * c, unsigned long code)
+{
+	return c->end - c->pos >= 2 && c->pos[0] == RR_ESCAPE_CODE && c->pos[1] == code;
+}
+
+static int expect_escape(struct cursor * c, unsigned long code)
+{
+	if (c->end - c->pos < 2)
+		return PARSE_MORE;
+	if (c->pos[0] != RR_ESCAPE_CODE || c->pos[1] != code)
+		return PARSE_ERROR;
+	c->pos += 2;
+	return PARSE_OK;
+}
+
+#define TRY(expr)	do { int _r = (expr); if (_r != PARSE_OK) return _r; } while (0)
+
+/* Since 3.17 kernels write the start time's nsec as the whole time. */
+static uint64_t to_ns(unsigned long sec, unsigned long nsec)
+{
+	if (nsec >= NSEC_PER_SEC)
+		return nsec;
+	return sec * NSEC_PER_SEC + nsec;
+}
+
+static int parse_thread_info(struct rr_decoder * dec, struct cursor * c,
+	struct rr_thread_info * info)
+{
+	unsigned long fields = dec->record_fields;
+	unsigned long a, b;
+
+	memset(info, 0, sizeof(*info));
+	TRY(expect_escape(c, RRNOTIFY_THREAD_INFO_BEGIN));
+	if (dec->version >= 5)
+		TRY(take(c, &fields));
+
+	if (fields & RRNOTIFY_FIELD_IDS) {
+		TRY(take(c, &a));
+		TRY(take(c, &b));
+		info->tgid = a;
+		info->pid = b;
+	}
+	if (fields & RRNOTIFY_FIELD_CPU_TIME) {
+		TRY(take(c, &a));
+		TRY(take(c, &b));
+		info->utime_us = a;
+		info->stime_us = b;
+	}
+	if (fields & RRNOTIFY_FIELD_START_TIME) {
+		TRY(take(c, &a));
+		TRY(take(c, &b));
+		info->start_ns = to_ns(a, b);
+	}
+	if (fields & RRNOTIFY_FIELD_END_TIME) {
+		TRY(take(c, &a));
+		TRY(take(c, &b));
+		info->end_ns = to_ns(a, b);
+	}
+	if (fields & RRNOTIFY_FIELD_RUNTIME)
+		TRY(take_u64(c, &info->runtime_ns));
+	if (fields & RRNOTIFY_FIELD_CTX_SWITCHES) {
+		TRY(take(c, &a));
+		TRY(take(c, &b));
+		info->nvcsw = a;
+		info->nivcsw = b;
+	}
+	if (fields & RRNOTIFY_FIELD_FAULTS) {
+		TRY(take(c, &a));
+		TRY(take(c, &b));
+		info->min_flt = a;
+		info->maj_flt = b;
+	}
+	if (fields & RRNOTIFY_FIELD_MAX_RSS) {
+		TRY(take(c, &a));
+		info->max_rss_kb = a;
+	}
+	if (fields & RRNOTIFY_FIELD_IO_BYTES) {
+		TRY(take_u64(c, &info->read_bytes));
+		TRY(take_u64(c, &info->write_bytes));
+	}
+	if (fields & RRNOTIFY_FIELD_LAST_CPU) {
+		TRY(take(c, &a));
+		info->last_cpu = a;
+	}
+	if (fields & RRNOTIFY_FIELD_COMM) {
+		TRY(take(c, &a));
+		info->comm_id = a;
+	}
+	if (fields & RRNOTIFY_FIELD_ARGV) {
+		TRY(take(c, &a));
+		info->argv_id = a;
+	}
+
+	return expect_escape(c, RRNOTIFY_THREAD_INFO_END);
+}
+
+/* String definitions for the thread info that follows. */
+static int parse_strings(struct cursor * c, struct rr_record * rec)
+{
+	rec->strings = c->pos;
+	while (peek_escape(c, RRNOTIFY_STRING_BEGIN)) {
+		unsigned long id, len;
+
+		c->pos += 2;
+		TRY(take(c, &id));
+		TRY(take(c, &len));
+		TRY(skip(c, (len + WORD_SIZE - 1) / WORD_SIZE));
+		TRY(expect_escape(c, RRNOTIFY_STRING_END));
+	}
+	rec->strings_end = c->pos;
+	return PARSE_OK;
+}
+
+/* A module list block and the build-ids that may follow it. */
+static int parse_module_list(struct rr_decoder * dec, struct cursor * c,
+	struct rr_record * rec)
+{
+	unsigned long count, flags = 0;
+
+	TRY(expect_escape(c, RRNOTIFY_MODULE_LIST_BEGIN));
+	TRY(take(c, &count));
+	/* the flags word came with format version 3 */
+	if (dec->version >= 3)
+		TRY(take(c, &flags));
+	if (count > (size_t)(c->end - c->pos) / RR_MODULE_WORDS)
+		return PARSE_MORE;
+
+	rec->has_modules = 1;
+	rec->nr_modules = count;
+	rec->module_flags = flags;
+	rec->modules = c->pos;
+	c->pos += count * RR_MODULE_WORDS;
+	TRY(expect_escape(c, RRNOTIFY_MODULE_LIST_END));
+
+	rec->build_ids = c->pos;
+	while (peek_escape(c, RRNOTIFY_BUILD_ID_BEGIN)) {
+		unsigned long cookie, len;
+
+		c->pos += 2;
+		TRY(take(c, &cookie));
+		TRY(take(c, &len));
+		TRY(skip(c, (len + WORD_SIZE - 1) / WORD_SIZE));
+		TRY(expect_escape(c, RRNOTIFY_BUILD_ID_END));
+	}
+	rec->build_ids_end = c->pos;
+
+	return PARSE_OK;
+}
+
+/* Fields of the stream header, which may grow at the end. A CONFIG
+ * record has the same fields but the version.
+ */
+static int parse_settings(struct rr_decoder * dec, struct cursor * c, unsigned long end,
+	int has_version)
+{
+	unsigned long vals[5];
+	int want = has_version ? 5 : 4;
+	int n = 0;
+
+	while (!peek_escape(c, end)) {
+		unsigned long val;
+
+		TRY(take(c, &val));
+		if (n < want)
+			vals[n++] = val;
+	}
+	if (n < want)
+		return PARSE_ERROR;
+
+	n = 0;
+	if (has_version) {
+		dec->have_header = 1;
+		dec->version = vals[n++];
+	}
+	dec->record_fields = vals[n++];
+	dec->event_mask = vals[n++];
+	dec->sample_period = vals[n++];
+	dec->module_options = vals[n++];
+	return PARSE_OK;
+}
+
+static unsigned long end_code(unsigned long code)
+{
+	return code == RRNOTIFY_RECORD_BEGIN ? RRNOTIFY_RECORD_END : code + 1;
+}
+
+static int parse_record(struct rr_decoder * dec, struct cursor * c, struct rr_record * rec)
+{
+	unsigned long code, val;
+
+	memset(rec, 0, sizeof(*rec));
+	TRY(take(c, &val));
+	if (val != RR_ESCAPE_CODE)
+		return PARSE_ERROR;
+	TRY(take(c, &code));
+	rec->code = code;
+
+	if (code == RRNOTIFY_HEADER_BEGIN) {
+		rec->body = c->pos;
+		TRY(parse_settings(dec, c, RRNOTIFY_HEADER_END, 1));
+		rec->body_words = c->pos - rec->body;
+		return expect_escape(c, RRNOTIFY_HEADER_END);
+	}
+
+	if (code == RRNOTIFY_LOST_BEGIN) {
+		rec->body = c->pos;
+		TRY(take(c, &rec->lost_count));
+		TRY(take(c, &rec->lost_first_seq));
+		TRY(skip(c, 4));
+		rec->body_words = c->pos - rec->body;
+		return expect_escape(c, RRNOTIFY_LOST_BEGIN + 1);
+	}
+
+	TRY(take(c, &rec->seq));
+	rec->body = c->pos;
+
+	switch (code) {
+	case RRNOTIFY_RECORD_BEGIN:
+	case RRNOTIFY_SNAPSHOT_BEGIN:
+		TRY(parse_strings(c, rec));
+		TRY(parse_thread_info(dec, c, &rec->info));
+		rec->has_info = 1;
+		TRY(parse_module_list(dec, c, rec));
+		break;
+
+	case RRNOTIFY_EXEC_BEGIN:
+	case RRNOTIFY_MMAP_BEGIN:
+		TRY(take(c, &val));
+		rec->info.tgid = val;
+		TRY(take(c, &val));
+		rec->info.pid = val;
+		TRY(parse_module_list(dec, c, rec));
+		break;
+
+	case RRNOTIFY_MODULE_CONT_BEGIN:
+		TRY(take(c, &rec->cont_seq));
+		TRY(take(c, &val));
+		rec->info.tgid = val;
+		TRY(take(c, &val));
+		rec->info.pid = val;
+		TRY(parse_module_list(dec, c, rec));
+		break;
+
+	case RRNOTIFY_FORK_BEGIN:
+		TRY(skip(c, 4));
+		break;
+
+	case RRNOTIFY_MUNMAP_BEGIN:
+		TRY(skip(c, 3));
+		break;
+
+	case RRNOTIFY_AGGREGATE_BEGIN:
+		/* mode, comm key, window, count, then three u64 */
+		TRY(skip(c, 1 + 16 / WORD_SIZE + 4 + 1 + 3 * WORDS_PER_U64));
+		break;
+
+	case RRNOTIFY_MARKER_BEGIN: {
+		unsigned long sec, nsec;
+
+		TRY(take(c, &sec));
+		TRY(take(c, &nsec));
+		rec->marker_ns = to_ns(sec, nsec);
+		TRY(take(c, &val));
+		rec->info.tgid = val;
+		TRY(take(c, &val));
+		rec->info.pid = val;
+		TRY(take_u64(c, &rec->marker_value));
+		TRY(take(c, &val));
+		rec->marker_label_len = val;
+		rec->marker_label = (char const *)c->pos;
+		TRY(skip(c, (val + WORD_SIZE - 1) / WORD_SIZE));
+		break;
+	}
+
+	case RRNOTIFY_CONFIG_BEGIN:
+		TRY(parse_settings(dec, c, RRNOTIFY_CONFIG_BEGIN + 1, 0));
+		break;
+
+	case RRNOTIFY_CPU_TICK_BEGIN:
+		TRY(skip(c, 2));
+		TRY(take(c, &val));
+		if (val > (size_t)(c->end - c->pos) / (4 + WORDS_PER_U64))
+			return PARSE_MORE;
+		c->pos += val * (4 + WORDS_PER_U64);
+		break;
+
+	default:
+		/* unknown, hope nothing in it looks like its end */
+		while (!peek_escape(c, end_code(code)))
+			TRY(skip(c, 1));
+		break;
+	}
+
+	rec->body_words = c->pos - rec->body;
+	return expect_escape(c, end_code(code));
+}
+
+
+/* LZ4 block format, as written by LZ4_compress_default(). */
+static int lz4_decompress(unsigned char const * src, size_t src_len,
+	unsigned char * dst, size_t dst_len)
+{
+	unsigned char const * ip = src;
+	unsigned char const * iend = src + src_len;
+	unsigned char * op = dst;
+	unsigned char * oend = dst + dst_len;
+
+	while (ip < iend) {
+		unsigned token = *ip++;
+		size_t len = token >> 4;
+		size_t offset;
+
+		if (len == 15) {
+			unsigned char b;
+			do {
+				if (ip == iend)
+					return -1;
+				b = *ip++;
+				len += b;
+			} while (b == 255);
+		}
+		if ((size_t)(iend - ip) < len || (size_t)(oend - op) < len)
+			return -1;
+		memcpy(op, ip, len);
+		ip += len;
+		op += len;
+
+		/* the last sequence has literals only */
+		if (ip == iend)
+			break;
+
+		if (iend - ip < 2)
+			return -1;
+		offset = ip[0] | (ip[1] << 8);
+		ip += 2;
+		if (!offset || offset > (size_t)(op - dst))
+			return -1;
+
+		len = (token & 15) + 4;
+		if ((token & 15) == 15) {
+			unsigned char b;
+			do {
+				if (ip == iend)
+					return -1;
+				b = *ip++;
+				len += b;
+			} while (b == 255);
+		}
+		if ((size_t)(oend - op) < len)
+			return -1;
+		/* overlapping copies repeat the pattern */
+		while (len--) {
+			*op = *(op - offset);
+			op++;
+		}
+	}
+
+	return op == oend ? 0 : -1;
+}
+
+static int take_chunk(struct rr_decoder * dec, unsigned long const * words, size_t nr_words,
+	size_t * consumed)
+{
+	unsigned long raw, compressed;
+	size_t total;
+
+	if (nr_words < RR_CHUNK_HEADER_WORDS)
+		return RR_DECODE_MORE;
+	raw = words[1];
+	compressed = words[2];
+	if (raw % WORD_SIZE)
+		return RR_DECODE_ERROR;
+
+	total = RR_CHUNK_HEADER_WORDS + ((compressed ? compressed : raw) + WORD_SIZE - 1) / WORD_SIZE;
+	if (nr_words < total)
+		return RR_DECODE_MORE;
+
+	if (raw > dec->chunk_alloc * WORD_SIZE) {
+		unsigned long * chunk = realloc(dec->chunk, raw);
+
+		if (!chunk)
+			return RR_DECODE_ERROR;
+		dec->chunk = chunk;
+		dec->chunk_alloc = raw / WORD_SIZE;
+	}
+
+	if (!compressed)
+		memcpy(dec->chunk, words + RR_CHUNK_HEADER_WORDS, raw);
+	else if (lz4_decompress((unsigned char const *)(words + RR_CHUNK_HEADER_WORDS),
+				compressed, (unsigned char *)dec->chunk, raw))
+		return RR_DECODE_ERROR;
+
+	dec->chunked = 1;
+	dec->chunk_words = raw / WORD_SIZE;
+	dec->chunk_pos = 0;
+	*consumed = total;
+	return RR_DECODE_RECORD;
+}
+
+
+void rr_decoder_init(struct rr_decoder * dec)
+{
+	memset(dec, 0, sizeof(*dec));
+	dec->record_fields = RRNOTIFY_FIELDS_DEFAULT;
+	dec->sample_period = 1;
+}
+
+
+void rr_decoder_free(struct rr_decoder * dec)
+{
+	free(dec->chunk);
+	dec->chunk = NULL;
+}
+
+
+int rr_decode(struct rr_decoder * dec, unsigned long const * words, size_t nr_words,
+	struct rr_record * rec, size_t * consumed)
+{
+	struct cursor c;
+	size_t taken;
+	int ret;
+
+	*consumed = 0;
+
+	for (;;) {
+		/* records never span chunks */
+		if (dec->chunk_pos < dec->chunk_words) {
+			c.pos = dec->chunk + dec->chunk_pos;
+			c.end = dec->chunk + dec->chunk_words;
+			if (parse_record(dec, &c, rec) != PARSE_OK)
+				return RR_DECODE_ERROR;
+			dec->chunk_pos = c.pos - dec->chunk;
+			return RR_DECODE_RECORD;
+		}
+
+		if (!nr_words)
+			return RR_DECODE_MORE;
+		if (words[0] != RR_CHUNK_MAGIC)
+			break;
+
+		ret = take_chunk(dec, words, nr_words, &taken);
+		if (ret != RR_DECODE_RECORD)
+			return ret;
+		*consumed += taken;
+		words += taken;
+		nr_words -= taken;
+	}
+
+	c.pos = words;
+	c.end = words + nr_words;
+	ret = parse_record(dec, &c, rec);
+	if (ret == PARSE_MORE)
+		return RR_DECODE_MORE;
+	if (ret == PARSE_ERROR)
+		return RR_DECODE_ERROR;
+	*consumed += c.pos - words;
+	return RR_DECODE_RECORD;
+}
+
+
+int rr_next_build_id(unsigned long const ** pos, unsigned long const * end,
+	struct rr_build_id * id)
+{
+	unsigned long const * p = *pos;
+
+	if (end - p < 6 || p[0] != RR_ESCAPE_CODE || p[1] != RRNOTIFY_BUILD_ID_BEGIN)
+		return 0;
+
+	id->cookie = p[2];
+	id->len = p[3];
+	id->id = (unsigned char const *)(p + 4);
+	*pos = p + 4 + (id->len + WORD_SIZE - 1) / WORD_SIZE + 2;
+	return 1;
+}
+
+
+int rr_next_string(unsigned long const ** pos, unsigned long const * end,
+	struct rr_string * string)
+{
+	unsigned long const * p = *pos;
+
+	if (end - p < 6 || p[0] != RR_ESCAPE_CODE || p[1] != RRNOTIFY_STRING_BEGIN)
+		return 0;
+
+	string->id = p[2];
+	string->len = p[3];
+	string->str = (char const *)(p + 4);
+	*pos = p + 4 + (string->len + WORD_SIZE - 1) / WORD_SIZE + 2;
+	return 1;
+}
+
+
+static int is_record_code(unsigned long code)
+{
+	switch (code) {
+	case RRNOTIFY_RECORD_BEGIN:
+	case RRNOTIFY_HEADER_BEGIN:
+	case RRNOTIFY_LOST_BEGIN:
+	case RRNOTIFY_MARKER_BEGIN:
+	case RRNOTIFY_CONFIG_BEGIN:
+		return 1;
+	case RRNOTIFY_BUILD_ID_BEGIN:
+	case RRNOTIFY_QUERY_BEGIN:
+		return 0;
+	}
+	/* the other top level codes are odd, their ENDs even */
+	return code >= RRNOTIFY_EXEC_BEGIN && code <= RRNOTIFY_MODULE_CONT_BEGIN && (code & 1);
+}
+
+static int is_chunk(unsigned long const * words, size_t nr_words, size_t pos, size_t * next)
+{
+	unsigned long raw, compressed;
+	size_t total;
+
+	if (nr_words - pos < RR_CHUNK_HEADER_WORDS || words[pos] != RR_CHUNK_MAGIC)
+		return 0;
+	raw = words[pos + 1];
+	compressed = words[pos + 2];
+	if (raw % WORD_SIZE || compressed > raw + raw / 255 + 16)
+		return 0;
+	total = RR_CHUNK_HEADER_WORDS + ((compressed ? compressed : raw) + WORD_SIZE - 1) / WORD_SIZE;
+	if (total > nr_words - pos)
+		return 0;
+	*next = pos + total;
+	return 1;
+}
+
+size_t rr_resync(struct rr_decoder const * dec, unsigned long const * words, size_t nr_words,
+	size_t pos)
+{
+	for (; pos < nr_words; pos++) {
+		struct rr_decoder probe;
+		struct rr_record rec;
+		struct cursor c;
+		size_t next;
+
+		if (is_chunk(words, nr_words, pos, &next)) {
+			if (next == nr_words || words[next] == RR_CHUNK_MAGIC)
+				return pos;
+			continue;
+		}
+
+		if (dec->chunked || words[pos] != RR_ESCAPE_CODE || pos + 1 == nr_words
+		    || !is_record_code(words[pos + 1]))
+			continue;
+
+		/* decoding may change the settings if it is a header */
+		probe = *dec;
+		probe.chunk = NULL;
+		probe.chunk_words = probe.chunk_pos = probe.chunk_alloc = 0;
+
+		c.pos = words + pos;
+		c.end = words + nr_words;
+		if (parse_record(&probe, &c, &rec) != PARSE_OK)
+			continue;
+		/* the second may run into the end of the input */
+		if (c.pos == c.end || parse_record(&probe, &c, &rec) != PARSE_ERROR)
+			return pos;
+	}
+
+	return nr_words;
+}
+
+
+void rr_cookie_name(unsigned long cookie, char * buf, size_t len)
+{
+	long ret = -1;
+
+	if (cookie == RR_NO_COOKIE) {
+		snprintf(buf, len, "[unknown]");
+		return;
+	}
+	if (cookie == RR_ANON_COOKIE) {
+		snprintf(buf, len, "[anon]");
+		return;
+	}
+#ifdef __NR_lookup_dcookie
+	ret = syscall(__NR_lookup_dcookie, (uint64_t)cookie, buf, len - 1);
+	if (ret > 0)
+		buf[ret] = '\0';
+#endif
+	if (ret <= 0)
+		snprintf(buf, len, "cookie:%lx", cookie);
+}
@@ -0,0 +1,200 @@
+/**
+ * @file rrdecode.h
+ * Decoder for the rrnotify buffer stream.
+ *
+ * The codes and layouts mirror event_buffer.h and rrnotify.h, which
+ * can't be included from userspace. Entries are the producer's
+ * unsigned long, so a capture has to be decoded on a machine with the
+ * same word size.
+ *
+ * @remark Copyright (C) 2006-2015 RotateRight, LLC
+ * @remark Read the file COPYING
+ */
+
+#ifndef RRDECODE_H
+#define RRDECODE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define RR_ESCAPE_CODE			(~0UL)
+#define RR_CHUNK_MAGIC			0x5a4c5252UL
+#define RR_CHUNK_HEADER_WORDS	3
+
+enum {
+	RRNOTIFY_RECORD_BEGIN		=1,
+	RRNOTIFY_THREAD_INFO_BEGIN	=2,
+	RRNOTIFY_THREAD_INFO_END	=3,
+	RRNOTIFY_MODULE_LIST_BEGIN	=4,
+	RRNOTIFY_MODULE_LIST_END	=5,
+	RRNOTIFY_RECORD_END			=6,
+	RRNOTIFY_EXEC_BEGIN			=7,
+	RRNOTIFY_FORK_BEGIN			=9,
+	RRNOTIFY_MMAP_BEGIN			=11,
+	RRNOTIFY_MUNMAP_BEGIN		=13,
+	RRNOTIFY_HEADER_BEGIN		=15,
+	RRNOTIFY_HEADER_END			=16,
+	RRNOTIFY_LOST_BEGIN			=17,
+	RRNOTIFY_AGGREGATE_BEGIN	=19,
+	RRNOTIFY_BUILD_ID_BEGIN		=21,
+	RRNOTIFY_BUILD_ID_END		=22,
+	RRNOTIFY_SNAPSHOT_BEGIN		=23,
+	RRNOTIFY_QUERY_BEGIN		=25,
+	RRNOTIFY_CPU_TICK_BEGIN		=27,
+	RRNOTIFY_MODULE_CONT_BEGIN	=29,
+	RRNOTIFY_STRING_BEGIN		=31,
+	RRNOTIFY_STRING_END			=32,
+	RRNOTIFY_MARKER_BEGIN		=33,
+	RRNOTIFY_CONFIG_BEGIN		=35,
+};
+
+#define RRNOTIFY_FIELD_IDS			0x001
+#define RRNOTIFY_FIELD_CPU_TIME		0x002
+#define RRNOTIFY_FIELD_START_TIME	0x004
+#define RRNOTIFY_FIELD_END_TIME		0x008
+#define RRNOTIFY_FIELD_RUNTIME		0x010
+#define RRNOTIFY_FIELD_CTX_SWITCHES	0x020
+#define RRNOTIFY_FIELD_FAULTS		0x040
+#define RRNOTIFY_FIELD_MAX_RSS		0x080
+#define RRNOTIFY_FIELD_IO_BYTES		0x100
+#define RRNOTIFY_FIELD_LAST_CPU		0x200
+#define RRNOTIFY_FIELD_COMM			0x400
+#define RRNOTIFY_FIELD_ARGV			0x800
+
+/* streams before the header record carried these */
+#define RRNOTIFY_FIELDS_DEFAULT		(RRNOTIFY_FIELD_IDS | RRNOTIFY_FIELD_CPU_TIME | \
+	RRNOTIFY_FIELD_START_TIME | RRNOTIFY_FIELD_END_TIME)
+
+#define RR_MODULES_CONTINUED	0x1
+#define RR_MODULES_TRUNCATED	0x2
+
+#define RR_NO_COOKIE		0UL
+#define RR_ANON_COOKIE		1UL
+#define RR_INVALID_COOKIE	(~0UL)
+
+/* start, end, flags, cookie, offset */
+#define RR_MODULE_WORDS		5
+/* in a module's flags, the main executable */
+#define RR_VM_EXECUTABLE	0x1000UL
+
+struct rr_thread_info {
+	uint64_t tgid, pid;
+	uint64_t utime_us, stime_us;
+	uint64_t start_ns, end_ns;
+	uint64_t runtime_ns;
+	uint64_t nvcsw, nivcsw;
+	uint64_t min_flt, maj_flt;
+	uint64_t max_rss_kb;
+	uint64_t read_bytes, write_bytes;
+	uint64_t last_cpu;
+	/* string ids, 0 for none */
+	uint64_t comm_id, argv_id;
+};
+
+struct rr_build_id {
+	unsigned long cookie;
+	size_t len;
+	unsigned char const * id;
+};
+
+/* Not NUL terminated. Ids in a stream are defined once, by the first
+ * record to use the string; query results define their own.
+ */
+struct rr_string {
+	unsigned long id;
+	size_t len;
+	char const * str;
+};
+
+/* One top level record. Pointers are into the input or the decoder's
+ * chunk buffer and stay valid until the next call.
+ */
+struct rr_record {
+	unsigned long code;		/* RRNOTIFY_*_BEGIN */
+	unsigned long seq;		/* none for HEADER and LOST */
+	/* RECORD and SNAPSHOT; EXEC, MMAP and MODULE_CONT set the ids */
+	int has_info;
+	unsigned long const * strings;	/* walk with rr_next_string() */
+	unsigned long const * strings_end;
+	struct rr_thread_info info;
+	/* RECORD, SNAPSHOT, EXEC, MMAP and MODULE_CONT */
+	int has_modules;
+	unsigned long nr_modules;
+	unsigned long module_flags;
+	unsigned long const * modules;	/* RR_MODULE_WORDS each */
+	unsigned long const * build_ids;	/* walk with rr_next_build_id() */
+	unsigned long const * build_ids_end;
+	/* MODULE_CONT: the record continued; tgid and pid go to info */
+	unsigned long cont_seq;
+	/* MARKER: the writer's tgid and pid go to info */
+	uint64_t marker_ns;
+	uint64_t marker_value;
+	size_t marker_label_len;
+	char const * marker_label;	/* not NUL terminated */
+	/* LOST */
+	unsigned long lost_count;
+	unsigned long lost_first_seq;
+	/* everything between the sequence number and the END code */
+	unsigned long const * body;
+	size_t body_words;
+};
+
+struct rr_decoder {
+	/* from the stream header and the latest CONFIG record; from
+	 * version 5 on each thread info carries its own fields */
+	int have_header;
+	unsigned long version;
+	unsigned long record_fields;
+	unsigned long event_mask;
+	unsigned long sample_period;
+	unsigned long module_options;
+	/* seen a chunk; a compressed part is chunks throughout */
+	int chunked;
+	/* decompressed chunk still being walked */
+	unsigned long * chunk;
+	size_t chunk_alloc;
+	size_t chunk_words;
+	size_t chunk_pos;
+};
+
+#define RR_DECODE_RECORD	1
+#define RR_DECODE_MORE		0
+#define RR_DECODE_ERROR		(-1)
+
+void rr_decoder_init(struct rr_decoder * dec);
+void rr_decoder_free(struct rr_decoder * dec);
+
+/* Decode the next record from words[0, nr_words). Returns
+ * RR_DECODE_RECORD, RR_DECODE_MORE if the next record is incomplete, or
+ * RR_DECODE_ERROR on a malformed stream. Whatever the result the first
+ * *consumed words are used up; that is 0 while the records of a chunk
+ * taken earlier are walked.
+ */
+int rr_decode(struct rr_decoder * dec, unsigned long const * words, size_t nr_words,
+	struct rr_record * rec, size_t * consumed);
+
+/* Next build-id after a module list; returns 0 at the end. */
+int rr_next_build_id(unsigned long const ** pos, unsigned long const * end,
+	struct rr_build_id * id);
+
+/* Next string defined ahead of a record's thread info; returns 0 at
+ * the end.
+ */
+int rr_next_string(unsigned long const ** pos, unsigned long const * end,
+	struct rr_string * string);
+
+/* The first record boundary at or after words[pos], nr_words if there
+ * is none. A boundary is a position where two records in a row decode
+ * with dec's settings, or where a chunk is followed by another. Once
+ * dec has seen a chunk only chunks count, as the records in a stored
+ * chunk would otherwise be decoded twice.
+ */
+size_t rr_resync(struct rr_decoder const * dec, unsigned long const * words, size_t nr_words,
+	size_t pos);
+
+/* Path of a file cookie, which lookup_dcookie() only knows while the
+ * buffer file is open; cookie:<hex> otherwise.
+ */
+void rr_cookie_name(unsigned long cookie, char * buf, size_t len);
+
+#endif /* RRDECODE_H */
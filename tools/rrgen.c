@@ -0,0 +1,431 @@
+/**
+ * @file rrgen.c
+ * Write a synthetic rrnotify buffer stream, for testing the tools.
+ *
+ *   rrgen [-c] [-n records] > stream
+ *
+ * The stream is the same on every run. Record i is an exit of pid
+ * tgid * 1000 + i in tgid 100 + i % 10, ending i ms after the first
+ * second, so queries have predictable answers. Mixed in are a LOST
+ * record, CONFIG records, markers, build-ids and every 7th record has
+ * its module list continued by a MODULE_CONT record after the next
+ * exit. With -c the stream is packed in chunks, alternately stored and
+ * LZ4 compressed, as a part is with buffer_compress.
+ *
+ * @remark Copyright (C) 2006-2015 RotateRight, LLC
+ * @remark Read the file COPYING
+ */
+
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "rrdecode.h"
+
+#define ESC					RR_ESCAPE_CODE
+#define STREAM_VERSION		5
+#define RECORD_FIELDS		(RRNOTIFY_FIELDS_DEFAULT | RRNOTIFY_FIELD_COMM)
+#define NR_TGIDS			10
+#define CONT_EVERY			7
+#define MARKER_EVERY		50
+#define CONFIG_EVERY		1000
+#define RECORDS_PER_CHUNK	16
+#define LOST_AT				100
+#define LOST_COUNT			3
+
+struct words {
+	unsigned long * data;
+	size_t count;
+	size_t alloc;
+};
+
+static unsigned long seq;
+static unsigned long nr_exits, nr_maps;
+
+
+static void die(char const * what)
+{
+	fprintf(stderr, "rrgen: %s: %s\n", what, strerror(errno));
+	exit(1);
+}
+
+
+static void put(struct words * w, unsigned long val)
+{
+	if (w->count == w->alloc) {
+		w->alloc = w->alloc ? w->alloc * 2 : 4096;
+		w->data = realloc(w->data, w->alloc * sizeof(unsigned long));
+		if (!w->data)
+			die("realloc");
+	}
+	w->data[w->count++] = val;
+}
+
+
+static void put_u64(struct words * w, uint64_t val)
+{
+	put(w, (unsigned long)val);
+	if (sizeof(uint64_t) > sizeof(unsigned long))
+		put(w, (unsigned long)(val >> 16 >> 16));
+}
+
+
+/* Length word, then the bytes padded to whole words. */
+static void put_bytes(struct words * w, void const * bytes, size_t len)
+{
+	size_t start;
+
+	put(w, len);
+	start = w->count;
+	while ((w->count - start) * sizeof(unsigned long) < len)
+		put(w, 0);
+	memcpy(w->data + start, bytes, len);
+}
+
+
+static void put_module_list(struct words * w, unsigned long tgid, unsigned long flags,
+	int cont, int with_build_id)
+{
+	static unsigned char const build_id[20] = {
+		0xde, 0xad, 0xbe, 0xef, 0x01, 0x02, 0x03, 0x04, 0x05, 0x06,
+		0x07, 0x08, 0x09, 0x0a, 0x0b, 0x0c, 0x0d, 0x0e, 0x0f, 0x10,
+	};
+	unsigned long exe = 0x1000 + tgid;
+
+	put(w, ESC);
+	put(w, RRNOTIFY_MODULE_LIST_BEGIN);
+	put(w, 2);
+	put(w, flags);
+	if (!cont) {
+		/* the executable, then libc */
+		put(w, 0x400000);
+		put(w, 0x401000);
+		put(w, 0x5 | RR_VM_EXECUTABLE);
+		put(w, exe);
+		put(w, 0);
+		put(w, 0x7f000000);
+		put(w, 0x7f200000);
+		put(w, 0x5);
+		put(w, 0x2000);
+		put(w, 0x1000);
+	} else {
+		/* heap and stack, in the continuation */
+		put(w, 0x600000);
+		put(w, 0x621000);
+		put(w, 0x3);
+		put(w, RR_ANON_COOKIE);
+		put(w, 0);
+		put(w, 0xbf000000);
+		put(w, 0xbf021000);
+		put(w, 0x3);
+		put(w, RR_ANON_COOKIE);
+		put(w, 0);
+	}
+	put(w, ESC);
+	put(w, RRNOTIFY_MODULE_LIST_END);
+	nr_maps += 2;
+
+	if (with_build_id) {
+		put(w, ESC);
+		put(w, RRNOTIFY_BUILD_ID_BEGIN);
+		put(w, exe);
+		put_bytes(w, build_id, sizeof(build_id));
+		put(w, ESC);
+		put(w, RRNOTIFY_BUILD_ID_END);
+	}
+}
+
+
+static void put_exit(struct words * w, unsigned long i, int continued)
+{
+	static int comm_defined[NR_TGIDS];
+	unsigned long tgid = 100 + i % NR_TGIDS;
+	unsigned long pid = tgid * 1000 + i;
+	unsigned long end_ms = 1000 + i;
+
+	put(w, ESC);
+	put(w, RRNOTIFY_RECORD_BEGIN);
+	put(w, seq++);
+
+	if (!comm_defined[i % NR_TGIDS]) {
+		char comm[16];
+
+		comm_defined[i % NR_TGIDS] = 1;
+		snprintf(comm, sizeof(comm), "task%lu", tgid);
+		put(w, ESC);
+		put(w, RRNOTIFY_STRING_BEGIN);
+		put(w, 1 + i % NR_TGIDS);
+		put_bytes(w, comm, strlen(comm));
+		put(w, ESC);
+		put(w, RRNOTIFY_STRING_END);
+	}
+
+	put(w, ESC);
+	put(w, RRNOTIFY_THREAD_INFO_BEGIN);
+	put(w, RECORD_FIELDS);
+	put(w, tgid);
+	put(w, pid);
+	put(w, 100 + i % 1000);		/* utime, stime in us */
+	put(w, 10 + i % 100);
+	put(w, 1);					/* started in the first second */
+	put(w, (i % 1000) * 1000);
+	put(w, end_ms / 1000);
+	put(w, (end_ms % 1000) * 1000000);
+	put(w, 1 + i % NR_TGIDS);
+	put(w, ESC);
+	put(w, RRNOTIFY_THREAD_INFO_END);
+
+	put_module_list(w, tgid, continued ? RR_MODULES_CONTINUED : 0, 0, i < NR_TGIDS);
+	put(w, ESC);
+	put(w, RRNOTIFY_RECORD_END);
+	nr_exits++;
+}
+
+
+static void put_module_cont(struct words * w, unsigned long i, unsigned long cont_seq)
+{
+	unsigned long tgid = 100 + i % NR_TGIDS;
+
+	put(w, ESC);
+	put(w, RRNOTIFY_MODULE_CONT_BEGIN);
+	put(w, seq++);
+	put(w, cont_seq);
+	put(w, tgid);
+	put(w, tgid * 1000 + i);
+	put_module_list(w, tgid, 0, 1, 0);
+	put(w, ESC);
+	put(w, RRNOTIFY_MODULE_CONT_BEGIN + 1);
+}
+
+
+static void put_settings(struct words * w, unsigned long code, int with_version)
+{
+	put(w, ESC);
+	put(w, code);
+	if (with_version)
+		put(w, STREAM_VERSION);
+	else
+		put(w, seq++);
+	put(w, RECORD_FIELDS);
+	put(w, 0);		/* event_mask */
+	put(w, 0);		/* sample_period */
+	put(w, 0);		/* module_options */
+	put(w, ESC);
+	put(w, code + 1);
+}
+
+
+static void put_marker(struct words * w, unsigned long i)
+{
+	char label[32];
+	unsigned long end_ms = 1000 + i;
+
+	snprintf(label, sizeof(label), "phase %lu", i / MARKER_EVERY);
+	put(w, ESC);
+	put(w, RRNOTIFY_MARKER_BEGIN);
+	put(w, seq++);
+	put(w, end_ms / 1000);
+	put(w, (end_ms % 1000) * 1000000);
+	put(w, 1);
+	put(w, 1);
+	put_u64(w, i);
+	put_bytes(w, label, strlen(label));
+	put(w, ESC);
+	put(w, RRNOTIFY_MARKER_BEGIN + 1);
+}
+
+
+static void put_lost(struct words * w)
+{
+	put(w, ESC);
+	put(w, RRNOTIFY_LOST_BEGIN);
+	put(w, LOST_COUNT);
+	put(w, seq);
+	put(w, 1);
+	put(w, 0);
+	put(w, 1);
+	put(w, 0);
+	put(w, ESC);
+	put(w, RRNOTIFY_LOST_BEGIN + 1);
+	seq += LOST_COUNT;
+}
+
+
+static size_t put_lz4_length(unsigned char * op, size_t len)
+{
+	size_t n = 0;
+
+	for (; len >= 255; len -= 255)
+		op[n++] = 255;
+	op[n++] = len;
+	return n;
+}
+
+
+/* A minimal greedy LZ4 block compressor; dst needs len + len / 255 + 16
+ * bytes. Keeps the format's end rules: the last five bytes are
+ * literals and no match starts in the last twelve.
+ */
+static size_t lz4_compress(unsigned char const * src, size_t len, unsigned char * dst)
+{
+	static uint32_t table[4096];
+	unsigned char * op = dst;
+	size_t ip = 0, anchor = 0;
+	size_t limit = len > 12 ? len - 12 : 0;
+
+	memset(table, 0, sizeof(table));
+	while (ip < limit) {
+		uint32_t word, ref_word, hash;
+		size_t ref, lits, match;
+
+		memcpy(&word, src + ip, 4);
+		hash = (word * 2654435761U) >> 20;
+		ref = table[hash];
+		table[hash] = ip + 1;
+		if (!ref--) {
+			ip++;
+			continue;
+		}
+		memcpy(&ref_word, src + ref, 4);
+		if (ref_word != word || ip - ref > 65535) {
+			ip++;
+			continue;
+		}
+
+		match = 4;
+		while (ip + match < len - 5 && src[ref + match] == src[ip + match])
+			match++;
+		lits = ip - anchor;
+
+		*op++ = (lits < 15 ? lits : 15) << 4 | (match - 4 < 15 ? match - 4 : 15);
+		if (lits >= 15)
+			op += put_lz4_length(op, lits - 15);
+		memcpy(op, src + anchor, lits);
+		op += lits;
+		*op++ = (ip - ref) & 0xff;
+		*op++ = (ip - ref) >> 8;
+		if (match - 4 >= 15)
+			op += put_lz4_length(op, match - 4 - 15);
+
+		ip += match;
+		anchor = ip;
+	}
+
+	*op++ = (len - anchor < 15 ? len - anchor : 15) << 4;
+	if (len - anchor >= 15)
+		op += put_lz4_length(op, len - anchor - 15);
+	memcpy(op, src + anchor, len - anchor);
+	op += len - anchor;
+	return op - dst;
+}
+
+
+static void put_chunk(struct words * out, unsigned long const * words, size_t count,
+	int compress)
+{
+	size_t raw = count * sizeof(unsigned long);
+	unsigned char * packed = NULL;
+	size_t packed_len = 0;
+
+	if (compress) {
+		packed = malloc(raw + raw / 255 + 16);
+		if (!packed)
+			die("malloc");
+		packed_len = lz4_compress((unsigned char const *)words, raw, packed);
+	}
+
+	put(out, RR_CHUNK_MAGIC);
+	put(out, raw);
+	put(out, packed_len);
+	if (packed) {
+		size_t start = out->count;
+
+		while ((out->count - start) * sizeof(unsigned long) < packed_len)
+			put(out, 0);
+		memcpy(out->data + start, packed, packed_len);
+		free(packed);
+	} else {
+		size_t i;
+
+		for (i = 0; i < count; i++)
+			put(out, words[i]);
+	}
+}
+
+
+static void usage(void)
+{
+	fprintf(stderr,
+		"usage: rrgen [-c] [-n records] > stream\n"
+		"  -c  pack the records in chunks, every other one compressed\n"
+		"  -n  exit records to write (default 5000)\n");
+	exit(2);
+}
+
+
+int main(int argc, char ** argv)
+{
+	struct words out = { 0 }, chunk = { 0 };
+	struct words * w;
+	unsigned long nr_records = 5000;
+	unsigned long i, pending_cont = 0, nr_chunks = 0;
+	int do_chunks = 0, have_pending = 0;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "cn:")) != -1) {
+		switch (opt) {
+		case 'c': do_chunks = 1; break;
+		case 'n': nr_records = strtoul(optarg, NULL, 0); break;
+		default: usage();
+		}
+	}
+	if (optind != argc)
+		usage();
+
+	w = do_chunks ? &chunk : &out;
+	put_settings(w, RRNOTIFY_HEADER_BEGIN, 1);
+
+	for (i = 0; i < nr_records; i++) {
+		int continued = i % CONT_EVERY == CONT_EVERY - 1;
+
+		if (i % CONFIG_EVERY == 0)
+			put_settings(w, RRNOTIFY_CONFIG_BEGIN, 0);
+		if (i == LOST_AT)
+			put_lost(w);
+
+		put_exit(w, i, continued);
+		/* the continuation follows one record behind, as under load */
+		if (have_pending) {
+			put_module_cont(w, i - 1, pending_cont);
+			have_pending = 0;
+		}
+		if (continued) {
+			pending_cont = seq - 1;
+			have_pending = 1;
+		}
+		if (i % MARKER_EVERY == MARKER_EVERY - 1)
+			put_marker(w, i);
+
+		if (do_chunks && i % RECORDS_PER_CHUNK == RECORDS_PER_CHUNK - 1) {
+			put_chunk(&out, chunk.data, chunk.count, nr_chunks++ & 1);
+			chunk.count = 0;
+		}
+	}
+	if (have_pending)
+		put_module_cont(w, nr_records - 1, pending_cont);
+	if (chunk.count)
+		put_chunk(&out, chunk.data, chunk.count, nr_chunks++ & 1);
+
+	if (fwrite(out.data, sizeof(unsigned long), out.count, stdout) != out.count
+	    || fflush(stdout))
+		die("write");
+	fprintf(stderr, "rrgen: %lu exits, %lu mappings, %lu chunks\n", nr_exits, nr_maps,
+		nr_chunks);
+
+	free(out.data);
+	free(chunk.data);
+	return 0;
+}
@@ -0,0 +1,87 @@
+/**
+ * @file rrmark.c
+ * Add a MARKER record to the rrnotify event stream.
+ *
+ * Meant for benchmark harnesses and deploy scripts that want to bracket
+ * phases in a capture: the marker lands in stream order, timestamped by
+ * the kernel, next to the exit records of the phase it labels. The
+ * buffer file is opened write-only, which works while a collector
+ * reads it.
+ *
+ * @remark Copyright (C) 2006-2015 RotateRight, LLC
+ * @remark Read the file COPYING
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define DEFAULT_DIR		"/dev/rrnotify"
+
+/* mirrors struct rrnotify_marker in event_buffer.h */
+#define RR_MARKER_MAGIC		0x4b52414d
+#define RR_MARKER_LABEL_LEN	48
+
+struct rr_marker {
+	uint32_t magic;
+	uint32_t flags;
+	uint64_t value;
+	char label[RR_MARKER_LABEL_LEN];
+};
+
+static void usage(void)
+{
+	fprintf(stderr,
+		"usage: rrmark [options] label\n"
+		"  -d dir     rrnotifyfs mount point (default " DEFAULT_DIR ")\n"
+		"  -v value   64-bit value carried with the label (default 0)\n"
+		"labels longer than %d bytes are cut\n",
+		RR_MARKER_LABEL_LEN);
+	exit(2);
+}
+
+int main(int argc, char ** argv)
+{
+	char const * dir = DEFAULT_DIR;
+	struct rr_marker marker;
+	char path[4096];
+	char * end;
+	int fd, opt;
+
+	memset(&marker, 0, sizeof(marker));
+	marker.magic = RR_MARKER_MAGIC;
+
+	while ((opt = getopt(argc, argv, "d:v:")) != -1) {
+		switch (opt) {
+		case 'd': dir = optarg; break;
+		case 'v':
+			errno = 0;
+			marker.value = strtoull(optarg, &end, 0);
+			if (errno || *end || end == optarg)
+				usage();
+			break;
+		default: usage();
+		}
+	}
+	if (optind + 1 != argc)
+		usage();
+	memcpy(marker.label, argv[optind], strnlen(argv[optind], sizeof(marker.label)));
+
+	snprintf(path, sizeof(path), "%s/buffer", dir);
+	fd = open(path, O_WRONLY | O_CLOEXEC);
+	if (fd < 0) {
+		fprintf(stderr, "rrmark: %s: %s\n", path, strerror(errno));
+		return 1;
+	}
+	if (write(fd, &marker, sizeof(marker)) != sizeof(marker)) {
+		/* EINVAL: no session running; ENOSPC: the buffer was full */
+		fprintf(stderr, "rrmark: writing the marker: %s\n", strerror(errno));
+		return 1;
+	}
+	close(fd);
+	return 0;
+}